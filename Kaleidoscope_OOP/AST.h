@@ -2,7 +2,9 @@
 # include <memory>
 # include <string>
 # include <vector>
+# include "llvm/ADT/ArrayRef.h"
 # include "llvm/IR/Value.h"
+# include "Types.h"
 
 using namespace std;
 using namespace llvm;
@@ -31,28 +33,94 @@ template <class ReturnType> class ExprASTVisitor
 public:
 	virtual ReturnType visit(class NumberExprAST*) = 0;
 	virtual ReturnType visit(class VariableExprAST*) = 0;
+	virtual ReturnType visit(class UnaryExprAST*) = 0;
 	virtual ReturnType visit(class BinaryExprAST*) = 0;
 	virtual ReturnType visit(class CallExprAST*) = 0;
+	virtual ReturnType visit(class IndexExprAST*) = 0;
+	virtual ReturnType visit(class IndexAssignExprAST*) = 0;
+	virtual ReturnType visit(class ParallelExprAST*) = 0;
 	virtual ReturnType visit(class PrototypeAST*) = 0;
 	virtual ReturnType visit(class FunctionAST*) = 0;
 };
 
+/**
+* Every node also accepts an ExprASTVisitor<ValueType> so the type inference pass (TypeInference.h) can walk the
+* tree before code generation. The inferred type of an expression is stored on the node itself (ExprAST::Type)
+* so that the code generator doesn't need to recompute it. ExprASTVisitor<void> is for analyses that only
+* collect information from the tree (e.g. CalleeCollector.h).
+*/
+
+/**
+* Machine generated formulas nest operators as deep as they are long: the chain "a + b + c + ..." is a tree whose
+* left spine has a node per term. So nothing recurses per operator expression or the native stack runs out on a
+* million terms. The parser, type inference, code generation and the callee collector walk the operator expressions
+* (the nodes for which asUnary or asBinary isn't null) with explicit stacks, only recursing into the other nodes.
+* Deleting a tree doesn't recurse either: every node hands its operands over to a worklist (deleteExprs) instead of
+* deleting them from its destructor.
+*/
+
+class UnaryExprAST;
+class BinaryExprAST;
+
+/// SourceLocation - Where a node starts in the source (1-based). Line 0 means unknown.
+struct SourceLocation {
+	unsigned Line = 0;
+	unsigned Column = 0;
+};
+
 /// ExprAST - Base class for all expression nodes.
 class ExprAST {
 public:
 	virtual ~ExprAST() {}
 
+	// Filled in by the type inference pass. type_unknown until then.
+	ValueType Type = type_unknown;
+
+	// Set by the parser, used for debug line info.
+	SourceLocation Loc;
+
 	virtual Value* accept(ExprASTVisitor<Value*>* v) = 0;
+	virtual ValueType accept(ExprASTVisitor<ValueType>* v) = 0;
+	virtual void accept(ExprASTVisitor<void>* v) = 0;
+
+	virtual const UnaryExprAST* asUnary() const { return nullptr; }
+	virtual const BinaryExprAST* asBinary() const { return nullptr; }
+
+	// Moves the node's operands to Operands, leaving it without any.
+	virtual void releaseOperands(vector<const ExprAST*>& Operands) {}
 };
 
-/// NumberExprAST - Expression class for numeric literals like "1.0".
+/// deleteExprs - Deletes expressions and everything below them, with a worklist rather than recursion.
+inline void deleteExprs(ArrayRef<const ExprAST*> Exprs)
+{
+	vector<const ExprAST*> Worklist;
+	for (auto Expr : Exprs)
+		if (Expr)
+			Worklist.push_back(Expr);
+
+	while (!Worklist.empty()) {
+		ExprAST* Expr = const_cast<ExprAST*>(Worklist.back());
+		Worklist.pop_back();
+		Expr->releaseOperands(Worklist);
+		delete Expr;
+	}
+}
+
+/// NumberExprAST - Expression class for numeric literals like "1.0" or "1.0:f32".
+/// An unannotated literal starts out as type_unknown and takes the type of its context.
 class NumberExprAST : public ExprAST {
 public:
-	NumberExprAST(double Val) : Val(Val) {}
+	NumberExprAST(double Val, ValueType AnnotatedType = type_unknown) : Val(Val), AnnotatedType(AnnotatedType) {
+		Type = AnnotatedType;
+	}
 
 	double Val;
 
+	ValueType AnnotatedType;
+
 	Value* accept(ExprASTVisitor<Value*>* v) { return v->visit(this); }
+	ValueType accept(ExprASTVisitor<ValueType>* v) { return v->visit(this); }
+	void accept(ExprASTVisitor<void>* v) { v->visit(this); }
 };
 
 /// VariableExprAST - Expression class for referencing a variable, like "a".
@@ -63,6 +131,35 @@ public:
 	string Name;
 
 	Value* accept(ExprASTVisitor<Value*>* v) { return v->visit(this); }
+	ValueType accept(ExprASTVisitor<ValueType>* v) { return v->visit(this); }
+	void accept(ExprASTVisitor<void>* v) { v->visit(this); }
+};
+
+/// UnaryExprAST - Expression class for a user defined unary operator, like "!x".
+class UnaryExprAST : public ExprAST {
+public:
+	UnaryExprAST(char Opcode, const ExprAST* Operand)
+		: Opcode(Opcode), Operand(Operand) {}
+
+	char Opcode;
+
+	const ExprAST* Operand;
+
+	Value* accept(ExprASTVisitor<Value*>* v) { return v->visit(this); }
+	ValueType accept(ExprASTVisitor<ValueType>* v) { return v->visit(this); }
+	void accept(ExprASTVisitor<void>* v) { v->visit(this); }
+
+	const UnaryExprAST* asUnary() const { return this; }
+
+	void releaseOperands(vector<const ExprAST*>& Operands) {
+		if (Operand)
+			Operands.push_back(Operand);
+		Operand = nullptr;
+	}
+
+	~UnaryExprAST() {
+		deleteExprs({ Operand });
+	}
 };
 
 /// BinaryExprAST - Expression class for a binary operator.
@@ -73,15 +170,30 @@ public:
 
 	char Op;
 
+	// The type both operands are converted to before the operation. Differs from Type for comparisons,
+	// which always produce a bool.
+	ValueType OperandType = type_unknown;
+
 	// Pointers to left and right hand statements
 	const ExprAST* LHS;
 	const ExprAST* RHS;
 
 	Value* accept(ExprASTVisitor<Value*>* v) { return v->visit(this); }
+	ValueType accept(ExprASTVisitor<ValueType>* v) { return v->visit(this); }
+	void accept(ExprASTVisitor<void>* v) { v->visit(this); }
+
+	const BinaryExprAST* asBinary() const { return this; }
+
+	void releaseOperands(vector<const ExprAST*>& Operands) {
+		if (LHS)
+			Operands.push_back(LHS);
+		if (RHS)
+			Operands.push_back(RHS);
+		LHS = RHS = nullptr;
+	}
 
 	~BinaryExprAST() {
-		delete LHS;
-		delete RHS;
+		deleteExprs({ LHS, RHS });
 	}
 };
 
@@ -96,22 +208,152 @@ public:
 	vector<const ExprAST*> Args;
 
 	Value* accept(ExprASTVisitor<Value*>* v) { return v->visit(this); }
+	ValueType accept(ExprASTVisitor<ValueType>* v) { return v->visit(this); }
+	void accept(ExprASTVisitor<void>* v) { v->visit(this); }
+
+	void releaseOperands(vector<const ExprAST*>& Operands) {
+		for (auto Arg : Args)
+			if (Arg)
+				Operands.push_back(Arg);
+		Args.clear();
+	}
+
+	~CallExprAST() {
+		deleteExprs(Args);
+	}
+};
+
+/// IndexExprAST - Expression class for loading an element of a pointer argument, like "a[i]".
+class IndexExprAST : public ExprAST {
+public:
+	IndexExprAST(string Name, const ExprAST* Index)
+		: Name(Name), Index(Index) {}
+
+	string Name;
+
+	const ExprAST* Index;
+
+	Value* accept(ExprASTVisitor<Value*>* v) { return v->visit(this); }
+	ValueType accept(ExprASTVisitor<ValueType>* v) { return v->visit(this); }
+	void accept(ExprASTVisitor<void>* v) { v->visit(this); }
+
+	void releaseOperands(vector<const ExprAST*>& Operands) {
+		if (Index)
+			Operands.push_back(Index);
+		Index = nullptr;
+	}
+
+	~IndexExprAST() {
+		deleteExprs({ Index });
+	}
+};
+
+/// IndexAssignExprAST - Expression class for storing to an element of a pointer argument, like "a[i] = v".
+/// Evaluates to the stored value.
+class IndexAssignExprAST : public ExprAST {
+public:
+	IndexAssignExprAST(string Name, const ExprAST* Index, const ExprAST* Val)
+		: Name(Name), Index(Index), Val(Val) {}
+
+	string Name;
+
+	const ExprAST* Index;
+	const ExprAST* Val;
+
+	Value* accept(ExprASTVisitor<Value*>* v) { return v->visit(this); }
+	ValueType accept(ExprASTVisitor<ValueType>* v) { return v->visit(this); }
+	void accept(ExprASTVisitor<void>* v) { v->visit(this); }
+
+	void releaseOperands(vector<const ExprAST*>& Operands) {
+		if (Index)
+			Operands.push_back(Index);
+		if (Val)
+			Operands.push_back(Val);
+		Index = Val = nullptr;
+	}
+
+	~IndexAssignExprAST() {
+		deleteExprs({ Index, Val });
+	}
+};
+
+/// ParallelExprAST - Expression class for the data-parallel loops "parallelsum(i, start, end, body)", which
+/// evaluates to the sum of body over i = start .. end-1, and "parallelfor(i, start, end, body)", which evaluates
+/// body for every i (e.g. storing to a buffer) and to 0. The bounds are i64's, the loop variable is an f64 like
+/// Kaleidoscope's numbers (so "i * 0.5" isn't integer arithmetic). The iterations run on all cores (see
+/// ParallelRuntime.h), so they mustn't depend on each other.
+class ParallelExprAST : public ExprAST {
+public:
+	enum LoopKind { parallel_for, parallel_sum };
+
+	ParallelExprAST(LoopKind Kind, string VarName, const ExprAST* Start, const ExprAST* End, const ExprAST* Body)
+		: Kind(Kind), VarName(VarName), Start(Start), End(End), Body(Body) {}
+
+	LoopKind Kind;
+
+	string VarName;
+
+	const ExprAST* Start;
+	const ExprAST* End;
+	const ExprAST* Body;
+
+	Value* accept(ExprASTVisitor<Value*>* v) { return v->visit(this); }
+	ValueType accept(ExprASTVisitor<ValueType>* v) { return v->visit(this); }
+	void accept(ExprASTVisitor<void>* v) { v->visit(this); }
+
+	void releaseOperands(vector<const ExprAST*>& Operands) {
+		for (auto Operand : { Start, End, Body })
+			if (Operand)
+				Operands.push_back(Operand);
+		Start = End = Body = nullptr;
+	}
+
+	~ParallelExprAST() {
+		deleteExprs({ Start, End, Body });
+	}
 };
 
 /// PrototypeAST - This class represents the "prototype" for a function,
 /// which captures its name, and its argument names (thus implicitly the number
-/// of arguments the function takes).
+/// of arguments the function takes). Arguments without an annotation are f64. The return type is left as
+/// type_unknown when it isn't annotated, in which case it's inferred from the function body.
+/// User defined operators are prototypes named "unary" or "binary" followed by the operator character.
 class PrototypeAST {
 
 public:
-	PrototypeAST(string name, vector<string> Args)
-		: Name(name), Args(Args) {}
+	PrototypeAST(string name, vector<string> Args, vector<ValueType> ArgTypes = vector<ValueType>(),
+		ValueType ReturnType = type_unknown, bool IsOperator = false, unsigned Precedence = 0)
+		: Name(name), Args(Args), ArgTypes(ArgTypes), ReturnType(ReturnType), AnnotatedReturnType(ReturnType),
+		IsOperator(IsOperator), Precedence(Precedence) {
+		this->ArgTypes.resize(this->Args.size(), type_f64);
+	}
 
 	string Name;
 
 	vector<string> Args;
 
+	vector<ValueType> ArgTypes;
+
+	ValueType ReturnType;
+
+	// The return type as written in the source. Inference starts over from this if the function is regenerated.
+	ValueType AnnotatedReturnType;
+
+	bool IsOperator;
+
+	// Precedence if this is a binary operator.
+	unsigned Precedence;
+
+	SourceLocation Loc;
+
+	bool isUnaryOp() const { return IsOperator && Args.size() == 1; }
+	bool isBinaryOp() const { return IsOperator && Args.size() == 2; }
+
+	char getOperatorName() const { return Name[Name.size() - 1]; }
+
 	Value* accept(ExprASTVisitor<Value*>* v) { return v->visit(this); }
+	ValueType accept(ExprASTVisitor<ValueType>* v) { return v->visit(this); }
+	void accept(ExprASTVisitor<void>* v) { v->visit(this); }
 };
 
 /// FunctionAST - This class represents a function definition itself.
@@ -126,6 +368,8 @@ public:
 	const PrototypeAST* Proto;
 
 	Value* accept(ExprASTVisitor<Value*>* v) { return v->visit(this); }
+	ValueType accept(ExprASTVisitor<ValueType>* v) { return v->visit(this); }
+	void accept(ExprASTVisitor<void>* v) { v->visit(this); }
 
 	~FunctionAST() {
 		delete Body;
@@ -0,0 +1,51 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+#include <utility>
+
+/**
+* A bounded single-producer/single-consumer queue: a ring of Capacity slots with the producer's and consumer's
+* positions in atomics of their own (on separate cache lines), so neither side ever takes a lock. A full or
+* empty queue is waited on by spinning, yielding, and after a while sleeping briefly, so an idle stage of a
+* pipeline doesn't keep a core busy.
+*/
+
+template <class T, size_t Capacity> class BoundedQueue {
+	static_assert(Capacity && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+	/// push - Appends Value, waiting while the queue is full. Only one thread may push.
+	void push(T Value) {
+		size_t Back = Tail.load(std::memory_order_relaxed);
+		for (unsigned Spins = 0; Back - Head.load(std::memory_order_acquire) == Capacity; ++Spins)
+			backOff(Spins);
+		Slots[Back & (Capacity - 1)] = std::move(Value);
+		Tail.store(Back + 1, std::memory_order_release);
+	}
+
+	/// pop - Removes the oldest value, waiting while the queue is empty. Only one thread may pop.
+	T pop() {
+		size_t Front = Head.load(std::memory_order_relaxed);
+		for (unsigned Spins = 0; Tail.load(std::memory_order_acquire) == Front; ++Spins)
+			backOff(Spins);
+		T Value = std::move(Slots[Front & (Capacity - 1)]);
+		Head.store(Front + 1, std::memory_order_release);
+		return Value;
+	}
+
+private:
+	alignas(64) std::atomic<size_t> Head{ 0 };
+	alignas(64) std::atomic<size_t> Tail{ 0 };
+	T Slots[Capacity];
+
+	static void backOff(unsigned Spins) {
+		if (Spins < 64)
+			return;
+		if (Spins < 256)
+			std::this_thread::yield();
+		else
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+};
@@ -0,0 +1,47 @@
+#pragma once
+#include <string>
+#include "llvm/IR/Intrinsics.h"
+
+using namespace std;
+using namespace llvm;
+
+/**
+* Math functions that map directly onto LLVM intrinsics. Calls to these (with or without an extern declaring them)
+* are emitted as intrinsic calls rather than calls to opaque external symbols, so LLVM can constant fold, hoist and
+* vectorize them. They're overloaded on f32/f64: the overload is picked from the argument types, so sin(x) with an
+* f32 x stays in single precision. When the vectorizers widen them, the vector variants come from the vector math
+* library configured in KaleidoscopeJIT.
+*/
+
+struct BuiltinFunction {
+	const char* Name;
+	Intrinsic::ID ID;
+	unsigned NumArgs;
+};
+
+/// getBuiltinFunction - Returns the builtin with the given name, or null if Name isn't a builtin.
+inline const BuiltinFunction* getBuiltinFunction(const string& Name)
+{
+	static const BuiltinFunction Builtins[] = {
+		{ "sqrt", Intrinsic::sqrt, 1 },
+		{ "sin", Intrinsic::sin, 1 },
+		{ "cos", Intrinsic::cos, 1 },
+		{ "exp", Intrinsic::exp, 1 },
+		{ "log", Intrinsic::log, 1 },
+		{ "pow", Intrinsic::pow, 2 },
+		{ "fabs", Intrinsic::fabs, 1 },
+		{ "fma", Intrinsic::fma, 3 },
+	};
+
+	for (const BuiltinFunction& Builtin : Builtins)
+		if (Name == Builtin.Name)
+			return &Builtin;
+	return nullptr;
+}
+
+/// isBuiltinBinaryOperator - Binary operators with native code generation. Every other binary operator is user
+/// defined ("def binary| 5 (a b) ...") and is inlined at its use sites.
+inline bool isBuiltinBinaryOperator(char Op)
+{
+	return Op == '+' || Op == '-' || Op == '*' || Op == '<';
+}
@@ -0,0 +1,81 @@
+#include "stdafx.h"
+#include "CalleeCollector.h"
+#include "Builtins.h"
+
+void CalleeCollector::visit(UnaryExprAST* UnaryExpr)
+{
+	collectOperators(UnaryExpr);
+}
+
+void CalleeCollector::visit(BinaryExprAST* BinaryExpr)
+{
+	collectOperators(BinaryExpr);
+}
+
+void CalleeCollector::collectOperators(const ExprAST* Root)
+{
+	vector<const ExprAST*> Worklist{ Root };
+	while (!Worklist.empty()) {
+		const ExprAST* Expr = Worklist.back();
+		Worklist.pop_back();
+
+		if (auto UnaryExpr = Expr->asUnary()) {
+			Callees.insert(string("unary") + UnaryExpr->Opcode);
+			Worklist.push_back(UnaryExpr->Operand);
+		}
+		else if (auto BinaryExpr = Expr->asBinary()) {
+			if (!isBuiltinBinaryOperator(BinaryExpr->Op))
+				Callees.insert(string("binary") + BinaryExpr->Op);
+			Worklist.push_back(BinaryExpr->RHS);
+			Worklist.push_back(BinaryExpr->LHS);
+		}
+		else
+			const_cast<ExprAST*>(Expr)->accept(this);
+	}
+}
+
+void CalleeCollector::visit(CallExprAST* CallExpr)
+{
+	Callees.insert(CallExpr->Callee);
+	for (auto Arg : CallExpr->Args)
+		const_cast<ExprAST*>(Arg)->accept(this);
+}
+
+void CalleeCollector::visit(IndexExprAST* IndexExpr)
+{
+	const_cast<ExprAST*>(IndexExpr->Index)->accept(this);
+}
+
+void CalleeCollector::visit(IndexAssignExprAST* IndexAssignExpr)
+{
+	const_cast<ExprAST*>(IndexAssignExpr->Index)->accept(this);
+	const_cast<ExprAST*>(IndexAssignExpr->Val)->accept(this);
+}
+
+void CalleeCollector::visit(ParallelExprAST* ParallelExpr)
+{
+	const_cast<ExprAST*>(ParallelExpr->Start)->accept(this);
+	const_cast<ExprAST*>(ParallelExpr->End)->accept(this);
+	const_cast<ExprAST*>(ParallelExpr->Body)->accept(this);
+}
+
+void CalleeCollector::visit(FunctionAST* FunctionExpr)
+{
+	const_cast<ExprAST*>(FunctionExpr->Body)->accept(this);
+}
+
+void FlatCalleeCollector::visitUnary(FlatAST::NodeId Id, const FlatExpr& E)
+{
+	Callees.insert(string("unary") + E.Op);
+}
+
+void FlatCalleeCollector::visitBinary(FlatAST::NodeId Id, const FlatExpr& E)
+{
+	if (!isBuiltinBinaryOperator(E.Op))
+		Callees.insert(string("binary") + E.Op);
+}
+
+void FlatCalleeCollector::visitCall(FlatAST::NodeId Id, const FlatExpr& E)
+{
+	Callees.insert(AST.getName(Id));
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <set>
+#include <string>
+#include "AST.h"
+#include "FlatAST.h"
+
+using namespace std;
+
+/**
+* Collects the names of every function an expression refers to: called functions, and the prototypes of the user
+* defined operators it applies ("binary|", "unary!"). This is the dependency information the incremental compiler
+* uses to find the definitions that have to be regenerated after one of their callees changes.
+*/
+
+class CalleeCollector : public ExprASTVisitor<void>
+{
+public:
+	set<string> Callees;
+
+	void visit(NumberExprAST* NumberExpr) {}
+	void visit(VariableExprAST* VariableExpr) {}
+	void visit(UnaryExprAST* UnaryExpr);
+	void visit(BinaryExprAST* BinaryExpr);
+	void visit(CallExprAST* CallExpr);
+	void visit(IndexExprAST* IndexExpr);
+	void visit(IndexAssignExprAST* IndexAssignExpr);
+	void visit(ParallelExprAST* ParallelExpr);
+	void visit(PrototypeAST* PrototypeExpr) {}
+	void visit(FunctionAST* FunctionExpr);
+
+private:
+	// Walks a tree of operator expressions with an explicit stack (see AST.h).
+	void collectOperators(const ExprAST* Root);
+};
+
+/// FlatCalleeCollector - The same over a flat AST (FlatAST.h). An expression's nodes are contiguous, so this
+/// doesn't descend into operands: visitExpression(Root) goes through all of them.
+class FlatCalleeCollector : public FlatASTVisitor<FlatCalleeCollector, void>
+{
+public:
+	FlatCalleeCollector(const FlatAST& AST) : FlatASTVisitor(AST) {}
+
+	set<string> Callees;
+
+	void visitNumber(FlatAST::NodeId Id, const FlatExpr& E) {}
+	void visitVariable(FlatAST::NodeId Id, const FlatExpr& E) {}
+	void visitUnary(FlatAST::NodeId Id, const FlatExpr& E);
+	void visitBinary(FlatAST::NodeId Id, const FlatExpr& E);
+	void visitCall(FlatAST::NodeId Id, const FlatExpr& E);
+	void visitIndex(FlatAST::NodeId Id, const FlatExpr& E) {}
+	void visitIndexAssign(FlatAST::NodeId Id, const FlatExpr& E) {}
+	void visitParallel(FlatAST::NodeId Id, const FlatExpr& E) {}
+};
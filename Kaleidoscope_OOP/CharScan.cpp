@@ -0,0 +1,167 @@
+#include "stdafx.h"
+#include "CharScan.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MathExtras.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define KALEIDOSCOPE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// GCC and Clang only emit AVX2 instructions in functions compiled for it, MSVC emits them anywhere.
+#if defined(_MSC_VER) && !defined(__clang__)
+#define KALEIDOSCOPE_TARGET_AVX2
+#else
+#define KALEIDOSCOPE_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+using namespace llvm;
+
+namespace {
+
+enum CharClass { class_whitespace, class_identifier, class_digit, class_line_end };
+
+// Runs of a class are scanned while the bytes are in it, except line ends, which are scanned up to.
+bool endsRun(unsigned char C, CharClass Class)
+{
+	switch (Class) {
+	case class_whitespace:
+		return !(C == ' ' || (C >= '\t' && C <= '\r'));
+	case class_identifier:
+		return !((C >= '0' && C <= '9') || ((C | 0x20) >= 'a' && (C | 0x20) <= 'z'));
+	case class_digit:
+		return !(C >= '0' && C <= '9');
+	default:
+		return C == '\n' || C == '\r';
+	}
+}
+
+size_t scanScalar(const char* Data, size_t Pos, size_t End, CharClass Class)
+{
+	while (Pos < End && !endsRun((unsigned char)Data[Pos], Class))
+		++Pos;
+	return Pos;
+}
+
+#ifdef KALEIDOSCOPE_X86_SIMD
+
+// Lanes of V in [Lo, Hi], as an unsigned compare: (V - Lo) <= (Hi - Lo).
+inline __m128i inRange(__m128i V, char Lo, char Hi)
+{
+	__m128i Offset = _mm_sub_epi8(V, _mm_set1_epi8(Lo));
+	return _mm_cmpeq_epi8(_mm_min_epu8(Offset, _mm_set1_epi8(Hi - Lo)), Offset);
+}
+
+// Bit i is set if byte i of V ends the run.
+inline unsigned runEnds(__m128i V, CharClass Class)
+{
+	__m128i InClass;
+	switch (Class) {
+	case class_whitespace:
+		InClass = _mm_or_si128(_mm_cmpeq_epi8(V, _mm_set1_epi8(' ')), inRange(V, '\t', '\r'));
+		break;
+	case class_identifier:
+		InClass = _mm_or_si128(inRange(V, '0', '9'), inRange(_mm_or_si128(V, _mm_set1_epi8(0x20)), 'a', 'z'));
+		break;
+	case class_digit:
+		InClass = inRange(V, '0', '9');
+		break;
+	default:
+		return (unsigned)_mm_movemask_epi8(
+			_mm_or_si128(_mm_cmpeq_epi8(V, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(V, _mm_set1_epi8('\r'))));
+	}
+	return ~(unsigned)_mm_movemask_epi8(InClass) & 0xFFFF;
+}
+
+size_t scanSSE2(const char* Data, size_t Pos, size_t End, CharClass Class)
+{
+	for (; Pos + 16 <= End; Pos += 16) {
+		if (unsigned Ends = runEnds(_mm_loadu_si128((const __m128i*)(Data + Pos)), Class))
+			return Pos + countTrailingZeros(Ends);
+	}
+	return scanScalar(Data, Pos, End, Class);
+}
+
+KALEIDOSCOPE_TARGET_AVX2 inline __m256i inRange(__m256i V, char Lo, char Hi)
+{
+	__m256i Offset = _mm256_sub_epi8(V, _mm256_set1_epi8(Lo));
+	return _mm256_cmpeq_epi8(_mm256_min_epu8(Offset, _mm256_set1_epi8(Hi - Lo)), Offset);
+}
+
+KALEIDOSCOPE_TARGET_AVX2 inline unsigned runEnds(__m256i V, CharClass Class)
+{
+	__m256i InClass;
+	switch (Class) {
+	case class_whitespace:
+		InClass = _mm256_or_si256(_mm256_cmpeq_epi8(V, _mm256_set1_epi8(' ')), inRange(V, '\t', '\r'));
+		break;
+	case class_identifier:
+		InClass = _mm256_or_si256(inRange(V, '0', '9'),
+			inRange(_mm256_or_si256(V, _mm256_set1_epi8(0x20)), 'a', 'z'));
+		break;
+	case class_digit:
+		InClass = inRange(V, '0', '9');
+		break;
+	default:
+		return (unsigned)_mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_cmpeq_epi8(V, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(V, _mm256_set1_epi8('\r'))));
+	}
+	return ~(unsigned)_mm256_movemask_epi8(InClass);
+}
+
+KALEIDOSCOPE_TARGET_AVX2 size_t scanAVX2(const char* Data, size_t Pos, size_t End, CharClass Class)
+{
+	for (; Pos + 32 <= End; Pos += 32) {
+		if (unsigned Ends = runEnds(_mm256_loadu_si256((const __m256i*)(Data + Pos)), Class))
+			return Pos + countTrailingZeros(Ends);
+	}
+	return scanSSE2(Data, Pos, End, Class);
+}
+
+bool hostHasAVX2()
+{
+	static const bool HasAVX2 = []() {
+		StringMap<bool> Features;
+		return sys::getHostCPUFeatures(Features) && Features.lookup("avx2");
+	}();
+	return HasAVX2;
+}
+
+#endif
+
+size_t scan(const char* Data, size_t Pos, size_t End, CharClass Class)
+{
+#ifdef KALEIDOSCOPE_X86_SIMD
+	// Most runs are short (an identifier, a few spaces), the byte just past Pos usually decides.
+	if (Pos >= End || endsRun((unsigned char)Data[Pos], Class))
+		return Pos;
+	if (hostHasAVX2())
+		return scanAVX2(Data, Pos, End, Class);
+	return scanSSE2(Data, Pos, End, Class);
+#else
+	return scanScalar(Data, Pos, End, Class);
+#endif
+}
+
+} // end anonymous namespace
+
+size_t scanWhitespace(const char* Data, size_t Pos, size_t End)
+{
+	return scan(Data, Pos, End, class_whitespace);
+}
+
+size_t scanIdentifier(const char* Data, size_t Pos, size_t End)
+{
+	return scan(Data, Pos, End, class_identifier);
+}
+
+size_t scanDigits(const char* Data, size_t Pos, size_t End)
+{
+	return scan(Data, Pos, End, class_digit);
+}
+
+size_t scanLineEnd(const char* Data, size_t Pos, size_t End)
+{
+	return scan(Data, Pos, End, class_line_end);
+}
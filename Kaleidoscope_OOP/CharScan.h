@@ -0,0 +1,22 @@
+#pragma once
+#include <cstddef>
+
+/**
+* Finds the extent of runs of characters in a source buffer for the Lexer, 16 or 32 bytes at a time. On x86 the
+* bytes are classified with SSE2 compares (part of every x86-64 CPU) or, where the CPU has it, AVX2; the first
+* byte that ends the run is found from the comparison's bit mask. Other targets, and the last few bytes of a
+* buffer, are scanned one byte at a time. The classes match the "C" locale's isspace/isalnum/isdigit, so the
+* result is the same as the Lexer's byte-at-a-time loops.
+*/
+
+/// scanWhitespace - Offset of the first byte in [Pos, End) that isn't whitespace, or End.
+size_t scanWhitespace(const char* Data, size_t Pos, size_t End);
+
+/// scanIdentifier - Offset of the first byte in [Pos, End) that isn't [a-zA-Z0-9], or End.
+size_t scanIdentifier(const char* Data, size_t Pos, size_t End);
+
+/// scanDigits - Offset of the first byte in [Pos, End) that isn't [0-9], or End.
+size_t scanDigits(const char* Data, size_t Pos, size_t End);
+
+/// scanLineEnd - Offset of the first '\n' or '\r' in [Pos, End), or End.
+size_t scanLineEnd(const char* Data, size_t Pos, size_t End);
@@ -0,0 +1,173 @@
+#include "stdafx.h"
+#include <thread>
+#include "CompilePipeline.h"
+
+void CompilePipeline::run()
+{
+	std::thread Lex([this]() { lexStage(); });
+	std::thread Parse([this]() { parseStage(); });
+	std::thread Codegen([this]() { codegenStage(); });
+	std::thread Compile([this]() { compileStage(); });
+	executeStage();
+
+	Lex.join();
+	Parse.join();
+	Codegen.join();
+	Compile.join();
+}
+
+void CompilePipeline::lexStage()
+{
+	Lexer& Scanner = TheParser.Scanner;
+	auto Batch = make_unique<TokenBatch>();
+	while (true) {
+		LexedToken Next{ Token(tok_eof), Scanner.getOffset(), {} };
+		Next.Tok = Scanner.getToken();
+		Next.Loc.Line = Scanner.getTokenLine();
+		Next.Loc.Column = Scanner.getTokenColumn();
+
+		TokenType Type = Next.Tok.getType();
+		bool EndsBatch = Type == tok_eof || Type == tok_def || Type == tok_extern || Type == tok_import ||
+			(Type == tok_char && Next.Tok.getNumValue() == ';') || Batch->size() + 1 == MaxBatchTokens;
+		Batch->push_back(move(Next));
+		if (EndsBatch) {
+			Lexed.push(move(Batch));
+			if (Type == tok_eof)
+				break;
+			Batch = make_unique<TokenBatch>();
+		}
+	}
+}
+
+void CompilePipeline::parseStage()
+{
+	// Errors go with their item, the code generator prints them in order.
+	TheParser.BufferDiagnostics = true;
+
+	// The parser reads the lexer stage's batches. Once at the end it stays there, at tok_eof.
+	unique_ptr<TokenBatch> Batch;
+	size_t NextToken = 0;
+	TheParser.TokenSource = [&](Token& Tok, size_t& PrevEnd, SourceLocation& Loc) {
+		if (!Batch || NextToken == Batch->size()) {
+			if (Batch && Batch->back().Tok.getType() == tok_eof)
+				NextToken = Batch->size() - 1;
+			else {
+				Batch = Lexed.pop();
+				NextToken = 0;
+			}
+		}
+		LexedToken& Next = (*Batch)[NextToken++];
+		Tok = Next.Tok;
+		PrevEnd = Next.PrevEnd;
+		Loc = Next.Loc;
+	};
+
+	unsigned Imports = 0;
+	TheParser.getNextToken();
+	while (true) {
+		auto Item = make_unique<WorkItem>();
+		if (!TheParser.ParseItem(Item->Parsed))
+			break;
+
+		bool IsImport = Item->Parsed.Kind == ParsedItem::item_import && !Item->Parsed.LibraryName.empty();
+		Parsed.push(move(Item));
+
+		// The library's operators change how the rest parses.
+		if (IsImport) {
+			++Imports;
+			unique_lock<mutex> Lock(ImportMutex);
+			ImportDone.wait(Lock, [&]() { return ImportsDone >= Imports; });
+		}
+	}
+	Parsed.push(nullptr);
+
+	TheParser.TokenSource = nullptr;
+	TheParser.BufferDiagnostics = false;
+}
+
+void CompilePipeline::codegenStage()
+{
+	ASTCodeGenVisitor* CodeGen = TheParser.CodeGenVisitor;
+	uint64_t NextExpression = 0;
+
+	while (auto Item = Parsed.pop()) {
+		ParsedItem& P = Item->Parsed;
+		fputs(P.Diagnostics.c_str(), stderr);
+
+		switch (P.Kind) {
+		case ParsedItem::item_definition:
+			TheParser.HandleDefinition(P.Function);
+			break;
+		case ParsedItem::item_extern:
+			TheParser.HandleExtern(P.Extern);
+			break;
+		case ParsedItem::item_import:
+			TheParser.ImportLibrary(P.LibraryName);
+			{
+				lock_guard<mutex> Lock(ImportMutex);
+				++ImportsDone;
+			}
+			ImportDone.notify_one();
+			break;
+		case ParsedItem::item_expression:
+			if (!P.Function)
+				break;
+
+			// Executors run expressions themselves, there's nothing for the later stages to do.
+			if (CodeGen->Executors) {
+				TheParser.HandleTopLevelExpression(P.Function);
+				break;
+			}
+
+			fprintf(stderr, "Parsed a top-level expr\n");
+			if (const_cast<FunctionAST*>(P.Function)->accept(CodeGen)) {
+				Item->FunctionName = "__anon_expr." + to_string(NextExpression++);
+				CodeGen->TheModule->getFunction("__anon_expr")->setName(Item->FunctionName);
+				Item->Module = CodeGen->takeModule();
+			}
+			CodeGen->forgetFunction("__anon_expr");
+			delete P.Function;
+			P.Function = nullptr;
+			break;
+		default:
+			break;
+		}
+
+		Generated.push(move(Item));
+	}
+	Generated.push(nullptr);
+}
+
+void CompilePipeline::compileStage()
+{
+	auto& JIT = TheParser.CodeGenVisitor->JIT;
+
+	while (auto Item = Generated.pop()) {
+		if (Item->Module) {
+			Item->RT = JIT.getJITDylib().createResourceTracker();
+			JIT.ExitOnError(JIT.TheJIT->addModule(move(Item->Module), Item->RT));
+
+			// Looking the function up materializes it: optimized, compiled and linked on this thread.
+			auto Symbol = JIT.ExitOnError(JIT.TheJIT->lookup(JIT.getJITDylib(), Item->FunctionName));
+			Item->Entry = (double (*)())(intptr_t)Symbol.getAddress();
+		}
+		Compiled.push(move(Item));
+	}
+	Compiled.push(nullptr);
+}
+
+void CompilePipeline::executeStage()
+{
+	auto& JIT = TheParser.CodeGenVisitor->JIT;
+
+	while (auto Item = Compiled.pop()) {
+		if (!Item->Entry)
+			continue;
+
+		double Result = Item->Entry();
+		fprintf(stderr, "Evaluated to %f\n", Result);
+
+		// Delete the anonymous expression module from the JIT.
+		JIT.ExitOnError(Item->RT->remove());
+	}
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "BoundedQueue.h"
+#include "Parser.h"
+
+using namespace std;
+using namespace llvm;
+
+/**
+* Runs the parser's input through five stages, each on its own thread, connected by bounded lock-free queues
+* (BoundedQueue.h):
+*   1. lex: reads the input and splits it into tokens,
+*   2. parse: parses the next top-level item from those tokens,
+*   3. codegen: types it and generates (and, unless the JIT is tiered, optimizes) its IR in a context of its own,
+*      adds definitions to the JIT, and hands expressions on as ThreadSafeModules,
+*   4. compile: adds an expression's module to the JIT and looks it up, which optimizes, compiles and links it,
+*   5. execute: runs the expression, prints its result and removes it from the JIT.
+* While an expression runs the next ones are compiled, generated and parsed, so a batch of input takes about as
+* long as its slowest stage. Each stage handles items in input order, so results come out in order. Messages of
+* the earlier stages (e.g. generated IR) can come out ahead of the results of the items before them.
+*
+* Several expressions are in flight at once, so each one's function is renamed from __anon_expr to
+* __anon_expr.<n> before it leaves the code generator. Parsing can depend on an import (operators), so the parse
+* stage waits for the code generator to have imported a library before it carries on. Lexing doesn't, the lexer
+* carries on reading ahead meanwhile.
+*
+* Tokens are handed to the parser in batches, so the queue isn't touched per token. A batch ends with a token that
+* ends a top-level item or starts the next one (';', def, extern, import), so what's typed at the REPL is parsed as
+* soon as it's complete.
+*/
+
+class CompilePipeline {
+public:
+	CompilePipeline(Parser& _Parser) : TheParser(_Parser) {}
+
+	/// run - Runs all of the parser's input. Returns at its end, once every item has been executed.
+	void run();
+
+private:
+	// A token as the parser keeps track of it (see Parser::getNextToken).
+	struct LexedToken {
+		Token Tok;
+		size_t PrevEnd;
+		SourceLocation Loc;
+	};
+	typedef vector<LexedToken> TokenBatch;
+	static const size_t MaxBatchTokens = 1024;
+
+	// An item on its way through the stages. A null item ends the stream.
+	struct WorkItem {
+		ParsedItem Parsed;
+
+		// A top-level expression once it has been generated, and then compiled.
+		string FunctionName;
+		orc::ThreadSafeModule Module;
+		orc::ResourceTrackerSP RT;
+		double (*Entry)() = nullptr;
+	};
+
+	Parser& TheParser;
+	BoundedQueue<unique_ptr<TokenBatch>, 64> Lexed; // The last batch ends with tok_eof.
+	BoundedQueue<unique_ptr<WorkItem>, 64> Parsed;
+	BoundedQueue<unique_ptr<WorkItem>, 64> Generated;
+	BoundedQueue<unique_ptr<WorkItem>, 64> Compiled;
+
+	// Imports handled by the code generator, for the parse stage to wait on.
+	mutex ImportMutex;
+	condition_variable ImportDone;
+	unsigned ImportsDone = 0;
+
+	void lexStage();
+	void parseStage();
+	void codegenStage();
+	void compileStage();
+	void executeStage();
+};
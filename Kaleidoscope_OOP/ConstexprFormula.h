@@ -0,0 +1,612 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include "Operators.h"
+
+/**
+* A compile-time front end for formulas that are fixed when the host program is built. KALEIDOSCOPE_FORMULA takes a
+* Kaleidoscope definition, or a bare expression, as a string literal:
+*
+*   auto Area = KALEIDOSCOPE_FORMULA("def area(w h) w * h + 2 * (w + h)");
+*   double A = Area(3, 4);
+*
+* The string is parsed by constexpr functions while the host is compiled, with the grammar of Parser.h and the
+* standard operators of Operators.h, into an array of nodes. Every node then names a type (FormulaExpr), so the
+* formula becomes an expression template: calling it is inline arithmetic that the host compiler optimizes and
+* vectorizes like hand-written code, and nothing is lexed, parsed or JIT compiled at run time. A syntax error is
+* a compile error at a call to formulaSyntaxError, whose argument says what's wrong.
+*
+* Formulas are the pure f64 part of the language: arguments, number literals, the standard binary operators,
+* parentheses and calls to the math builtins (Builtins.h). As in generated code, '<' gives 1 or 0 and is true if
+* either side is NaN. There are no calls to other definitions, user-defined operators, indexing, parallel loops or
+* types other than f64. Literals are rounded to the nearest double, ties to even, like the Lexer rounds them, so a
+formula and the JIT'd code of the same source compute with the same constants.
+*
+* The string can't be a template argument before C++17, so the macro wraps it in a local class with constexpr
+* accessors, and the class is the template argument.
+*/
+
+#define KALEIDOSCOPE_FORMULA(Text) \
+	([] { \
+		struct FormulaSource { \
+			static constexpr const char* text() { return Text; } \
+			static constexpr unsigned size() { return sizeof(Text) - 1; } \
+		}; \
+		return ::Formula<FormulaSource>(); \
+	}())
+
+/// formulaSyntaxError - Reached while parsing a formula with a syntax error. It isn't constexpr, so reaching it
+/// stops constant evaluation and the compiler reports the call with its message.
+inline void formulaSyntaxError(const char* Message) { (void)Message; }
+
+namespace formula_detail {
+
+enum NodeKind { node_number, node_argument, node_binary, node_call };
+
+struct FormulaNode {
+	NodeKind Kind = node_number;
+	double Value = 0;      // node_number
+	unsigned Argument = 0; // node_argument
+	char Op = 0;           // node_binary
+	unsigned Builtin = 0;  // node_call, index into FormulaBuiltins
+	unsigned Operands[3] = { 0, 0, 0 }; // node_binary and node_call
+};
+
+// A formula of Size characters has fewer than Size + 1 nodes.
+template<unsigned Size>
+struct ParsedFormula {
+	FormulaNode Nodes[Size + 1] = {};
+	unsigned NumNodes = 0;
+	unsigned Root = 0;
+	unsigned NumArgs = 0;
+};
+
+struct FormulaBuiltin {
+	const char* Name;
+	unsigned NumArgs;
+};
+
+/// FormulaBigInt - An unsigned integer of up to 4096 bits, enough to round any literal exactly at compile time.
+struct FormulaBigInt {
+	uint32_t Limbs[128] = {}; // Least significant first.
+	unsigned Size = 0;        // Limbs in use, the top one is nonzero.
+
+	constexpr void mulAdd(uint32_t Mul, uint32_t Add)
+	{
+		uint64_t Carry = Add;
+		for (unsigned i = 0; i < Size; ++i) {
+			uint64_t Value = (uint64_t)Limbs[i] * Mul + Carry;
+			Limbs[i] = (uint32_t)Value;
+			Carry = Value >> 32;
+		}
+		if (Carry)
+			Limbs[Size++] = (uint32_t)Carry;
+	}
+
+	constexpr unsigned bitLength() const
+	{
+		if (!Size)
+			return 0;
+		unsigned Bits = (Size - 1) * 32;
+		for (uint32_t Top = Limbs[Size - 1]; Top; Top >>= 1)
+			++Bits;
+		return Bits;
+	}
+
+	constexpr void shiftLeft(unsigned Bits)
+	{
+		if (!Size)
+			return;
+		unsigned Words = Bits / 32;
+		Bits %= 32;
+		Limbs[Size + Words] = 0;
+		for (unsigned i = Size; i-- > 0;) {
+			if (Bits)
+				Limbs[i + Words + 1] |= Limbs[i] >> (32 - Bits);
+			Limbs[i + Words] = Limbs[i] << Bits;
+		}
+		for (unsigned i = 0; i < Words; ++i)
+			Limbs[i] = 0;
+		Size += Words + 1;
+		trim();
+	}
+
+	constexpr void shiftRightOne()
+	{
+		for (unsigned i = 0; i < Size; ++i)
+			Limbs[i] = (Limbs[i] >> 1) | (i + 1 < Size ? Limbs[i + 1] << 31 : 0);
+		trim();
+	}
+
+	constexpr bool lessThan(const FormulaBigInt& Other) const
+	{
+		if (Size != Other.Size)
+			return Size < Other.Size;
+		for (unsigned i = Size; i-- > 0;)
+			if (Limbs[i] != Other.Limbs[i])
+				return Limbs[i] < Other.Limbs[i];
+		return false;
+	}
+
+	// Other must not be larger.
+	constexpr void subtract(const FormulaBigInt& Other)
+	{
+		uint64_t Borrow = 0;
+		for (unsigned i = 0; i < Size; ++i) {
+			uint64_t Subtrahend = (i < Other.Size ? Other.Limbs[i] : 0) + Borrow;
+			Borrow = Limbs[i] < Subtrahend;
+			Limbs[i] = (uint32_t)(Limbs[i] - Subtrahend);
+		}
+		trim();
+	}
+
+	constexpr void trim()
+	{
+		while (Size && !Limbs[Size - 1])
+			--Size;
+	}
+};
+
+// Longer literals are rounded as if their remaining digits were a single nonzero one, which decides only ties.
+constexpr int MaxLiteralDigits = 800;
+
+/// roundLiteral - The double nearest to Digits * 10^Exponent, ties to even. Digits has NumDigits decimal digits
+/// without leading zeros, Truncated says nonzero digits after them were dropped.
+constexpr double roundLiteral(FormulaBigInt Digits, int NumDigits, bool Truncated, long long Exponent)
+{
+	if (!Digits.Size)
+		return 0;
+	// Beyond these the literal is at least 1e309 or less than half the smallest denormal.
+	if (NumDigits - 1 + Exponent >= 309)
+		return std::numeric_limits<double>::infinity();
+	if (NumDigits + Exponent <= -324)
+		return 0;
+
+	// The literal is Num / Den. Scale one of them by a power of two so the quotient Q has 63 or 64 bits.
+	FormulaBigInt Num = Digits, Den;
+	Den.mulAdd(1, 1);
+	for (long long i = Exponent < 0 ? -Exponent : Exponent; i > 0; i -= 9) {
+		uint32_t Power = 1;
+		for (long long j = 0; j < i && j < 9; ++j)
+			Power *= 10;
+		(Exponent < 0 ? Den : Num).mulAdd(Power, 0);
+	}
+	int Shift = 63 - ((int)Num.bitLength() - (int)Den.bitLength());
+	if (Shift > 0)
+		Num.shiftLeft(Shift);
+	else
+		Den.shiftLeft(-Shift);
+
+	// Long division, one bit of Q at a time. The literal is Q * 2^-Shift, plus a bit more if Num isn't used up.
+	uint64_t Q = 0;
+	Den.shiftLeft(63);
+	for (int Bit = 63; Bit >= 0; --Bit) {
+		if (!Num.lessThan(Den)) {
+			Num.subtract(Den);
+			Q |= 1ull << Bit;
+		}
+		Den.shiftRightOne();
+	}
+	bool Sticky = Num.Size || Truncated;
+
+	// Keep 53 bits, fewer for denormals, and round the rest to nearest even.
+	int Bits = Q >> 63 ? 64 : 63;
+	long long Exponent2 = Bits - 1 - Shift; // The literal is in [2^Exponent2, 2^(Exponent2 + 1)).
+	if (Exponent2 > 1023)
+		return std::numeric_limits<double>::infinity();
+	long long Keep = Exponent2 < -1022 ? 53 - (-1022 - Exponent2) : 53;
+	long long Drop = Bits - Keep;
+	if (Drop > 64)
+		return 0;
+	uint64_t Kept = Drop == 64 ? 0 : Q >> Drop;
+	uint64_t Rest = Drop == 64 ? Q : Q & ((1ull << Drop) - 1);
+	uint64_t Half = 1ull << (Drop - 1);
+	if (Rest > Half || (Rest == Half && (Sticky || (Kept & 1))))
+		++Kept;
+	if (Kept >> 53 && Exponent2 == 1023)
+		return std::numeric_limits<double>::infinity();
+
+	// Kept * 2^(Drop - Shift) is representable, so every step of the scaling is exact.
+	double Value = (double)Kept;
+	long long Scale = Drop - Shift;
+	for (; Scale >= 64; Scale -= 64)
+		Value *= 18446744073709551616.0;
+	for (; Scale <= -64; Scale += 64)
+		Value *= 1 / 18446744073709551616.0;
+	return Scale < 0 ? Value / (double)(1ull << -Scale) : Value * (double)(1ull << Scale);
+}
+
+// The builtins of Builtins.h, in the order of the BuiltinCall specializations below.
+constexpr FormulaBuiltin FormulaBuiltins[] = {
+	{ "sqrt", 1 }, { "sin", 1 }, { "cos", 1 }, { "exp", 1 }, { "log", 1 }, { "pow", 2 }, { "fabs", 1 }, { "fma", 3 },
+};
+
+constexpr unsigned NumFormulaBuiltins = sizeof(FormulaBuiltins) / sizeof(FormulaBuiltins[0]);
+
+/// FormulaParser - Parses a formula into nodes at compile time, the way Parser does at run time.
+///   formula    ::= ('def' identifier '(' identifier* ')')? expression ';'?
+///   expression ::= primary (binop primary)*
+///   primary    ::= number (':' 'f64')? | identifier | identifier '(' expression (',' expression)* ')'
+///                | '(' expression ')'
+template<unsigned Size>
+class FormulaParser {
+public:
+	constexpr FormulaParser(const char* Text) : Text(Text) {}
+
+	constexpr ParsedFormula<Size> parse()
+	{
+		skipSpace();
+		unsigned Start = 0, Length = 0;
+		if (isAlpha(peek())) {
+			unsigned Save = Pos;
+			parseIdentifier(Start, Length);
+			if (isKeyword(Start, Length))
+				parsePrototype();
+			else
+				Pos = Save;
+		}
+
+		Result.Root = parseExpression();
+		if (peek() == ';') {
+			++Pos;
+			skipSpace();
+		}
+		if (Pos != Size)
+			formulaSyntaxError("unexpected text after the formula");
+		return Result;
+	}
+
+private:
+	const char* Text;
+	unsigned Pos = 0;
+	ParsedFormula<Size> Result;
+
+	// Argument names, as offsets and lengths into Text.
+	unsigned ArgStart[Size + 1] = {};
+	unsigned ArgLength[Size + 1] = {};
+
+	static constexpr bool isAlpha(char C) { return (C >= 'a' && C <= 'z') || (C >= 'A' && C <= 'Z'); }
+	static constexpr bool isDigit(char C) { return C >= '0' && C <= '9'; }
+	static constexpr bool isSpace(char C) { return C == ' ' || (C >= '\t' && C <= '\r'); }
+
+	constexpr char peek(unsigned Offset = 0) const { return Pos + Offset < Size ? Text[Pos + Offset] : 0; }
+
+	constexpr void skipSpace()
+	{
+		while (Pos < Size) {
+			if (isSpace(Text[Pos]))
+				++Pos;
+			else if (Text[Pos] == '#') { // Comment until end of line.
+				while (Pos < Size && Text[Pos] != '\n' && Text[Pos] != '\r')
+					++Pos;
+			}
+			else
+				break;
+		}
+	}
+
+	constexpr bool nameIs(unsigned Start, unsigned Length, const char* Name) const
+	{
+		for (unsigned i = 0; i < Length; ++i)
+			if (Name[i] != Text[Start + i])
+				return false;
+		return Name[Length] == 0;
+	}
+
+	constexpr bool isKeyword(unsigned Start, unsigned Length) const
+	{
+		if (nameIs(Start, Length, "def"))
+			return true;
+		if (nameIs(Start, Length, "extern") || nameIs(Start, Length, "import") || nameIs(Start, Length, "binary") ||
+			nameIs(Start, Length, "unary"))
+			formulaSyntaxError("a formula is a single definition or expression");
+		return false;
+	}
+
+	constexpr void parseIdentifier(unsigned& Start, unsigned& Length)
+	{
+		if (!isAlpha(peek()))
+			formulaSyntaxError("expected an identifier");
+		Start = Pos;
+		while (isAlpha(peek()) || isDigit(peek()))
+			++Pos;
+		Length = Pos - Start;
+		skipSpace();
+	}
+
+	constexpr void expect(char C, const char* Message)
+	{
+		if (peek() != C)
+			formulaSyntaxError(Message);
+		++Pos;
+		skipSpace();
+	}
+
+	// Only f64 formulas are supported, so the only type annotation is ":f64".
+	constexpr void parseTypeAnnotation()
+	{
+		if (peek() != ':')
+			return;
+		++Pos;
+		skipSpace();
+		unsigned Start = 0, Length = 0;
+		parseIdentifier(Start, Length);
+		if (!nameIs(Start, Length, "f64"))
+			formulaSyntaxError("formulas only have f64 values");
+	}
+
+	// 'def' has been read.
+	constexpr void parsePrototype()
+	{
+		unsigned Start = 0, Length = 0;
+		parseIdentifier(Start, Length);
+		expect('(', "expected '(' in prototype");
+		while (isAlpha(peek())) {
+			parseIdentifier(Start, Length);
+			parseTypeAnnotation();
+			ArgStart[Result.NumArgs] = Start;
+			ArgLength[Result.NumArgs] = Length;
+			++Result.NumArgs;
+		}
+		expect(')', "expected ')' in prototype");
+		parseTypeAnnotation();
+	}
+
+	constexpr unsigned addNode(const FormulaNode& Node)
+	{
+		Result.Nodes[Result.NumNodes] = Node;
+		return Result.NumNodes++;
+	}
+
+	// Same grammar and rounding as the Lexer's parseNumber.
+	constexpr unsigned parseNumber()
+	{
+		FormulaBigInt Digits;
+		int NumDigits = 0;
+		bool Truncated = false;
+		long long Exponent = 0;
+		bool HasDigits = false;
+		// Digits are added to Digits nine at a time.
+		uint32_t Chunk = 0, ChunkScale = 1;
+		for (bool Fraction = false;; ++Pos) {
+			char C = peek();
+			if (C == '.' && !Fraction) {
+				Fraction = true;
+				continue;
+			}
+			if (!isDigit(C))
+				break;
+			HasDigits = true;
+			if (NumDigits < MaxLiteralDigits) {
+				if (NumDigits || C != '0') {
+					Chunk = Chunk * 10 + (C - '0');
+					ChunkScale *= 10;
+					if (ChunkScale == 1000000000) {
+						Digits.mulAdd(ChunkScale, Chunk);
+						Chunk = 0;
+						ChunkScale = 1;
+					}
+					++NumDigits;
+				}
+				if (Fraction)
+					--Exponent;
+			}
+			else {
+				Truncated |= C != '0';
+				if (!Fraction)
+					++Exponent;
+			}
+		}
+		Digits.mulAdd(ChunkScale, Chunk);
+
+		if ((peek() == 'e' || peek() == 'E') && (isDigit(peek(1)) || ((peek(1) == '+' || peek(1) == '-') &&
+			isDigit(peek(2))))) {
+			bool Negative = peek(1) == '-';
+			Pos += peek(1) == '+' || peek(1) == '-' ? 2 : 1;
+			long long Explicit = 0;
+			for (; isDigit(peek()); ++Pos)
+				if (Explicit < 100000)
+					Explicit = Explicit * 10 + (peek() - '0');
+			Exponent += Negative ? -Explicit : Explicit;
+		}
+		if (!HasDigits || isAlpha(peek()) || isDigit(peek()) || peek() == '.')
+			formulaSyntaxError("malformed number");
+
+		double Value = roundLiteral(Digits, NumDigits, Truncated, Exponent);
+		skipSpace();
+		parseTypeAnnotation();
+
+		FormulaNode Node;
+		Node.Kind = node_number;
+		Node.Value = Value;
+		return addNode(Node);
+	}
+
+	constexpr unsigned parseIdentifierExpr()
+	{
+		unsigned Start = 0, Length = 0;
+		parseIdentifier(Start, Length);
+
+		if (peek() != '(') {
+			for (unsigned i = 0; i < Result.NumArgs; ++i) {
+				if (ArgLength[i] != Length)
+					continue;
+				bool Same = true;
+				for (unsigned j = 0; j < Length; ++j)
+					Same = Same && Text[ArgStart[i] + j] == Text[Start + j];
+				if (Same) {
+					FormulaNode Node;
+					Node.Kind = node_argument;
+					Node.Argument = i;
+					return addNode(Node);
+				}
+			}
+			formulaSyntaxError("unknown variable name");
+		}
+
+		FormulaNode Node;
+		Node.Kind = node_call;
+		Node.Builtin = NumFormulaBuiltins;
+		for (unsigned i = 0; i < NumFormulaBuiltins; ++i)
+			if (nameIs(Start, Length, FormulaBuiltins[i].Name))
+				Node.Builtin = i;
+		if (Node.Builtin == NumFormulaBuiltins)
+			formulaSyntaxError("formulas can only call the math builtins");
+
+		expect('(', "expected '('");
+		unsigned NumArgs = 0;
+		if (peek() != ')') {
+			while (true) {
+				unsigned Arg = parseExpression();
+				if (NumArgs < 3)
+					Node.Operands[NumArgs] = Arg;
+				++NumArgs;
+				if (peek() == ')')
+					break;
+				expect(',', "Expected ')' or ',' in argument list");
+			}
+		}
+		expect(')', "Expected ')' or ',' in argument list");
+		if (NumArgs != FormulaBuiltins[Node.Builtin].NumArgs)
+			formulaSyntaxError("Incorrect # arguments passed");
+		return addNode(Node);
+	}
+
+	constexpr unsigned parsePrimary()
+	{
+		char C = peek();
+		if (isAlpha(C))
+			return parseIdentifierExpr();
+		if (isDigit(C) || C == '.')
+			return parseNumber();
+		if (C == '(') {
+			expect('(', "expected '('");
+			unsigned Expr = parseExpression();
+			expect(')', "expected ')'");
+			return Expr;
+		}
+		formulaSyntaxError("unknown token when expecting an expression");
+		return 0;
+	}
+
+	static constexpr int getPrecedence(char Op)
+	{
+		for (unsigned i = 0; i < sizeof(StandardBinaryOperators) / sizeof(StandardBinaryOperators[0]); ++i)
+			if (StandardBinaryOperators[i].Op == Op)
+				return StandardBinaryOperators[i].Precedence;
+		return -1;
+	}
+
+	constexpr unsigned parseBinOpRHS(int ExprPrec, unsigned LHS)
+	{
+		while (true) {
+			char Op = peek();
+			int TokPrec = getPrecedence(Op);
+			if (TokPrec < ExprPrec)
+				return LHS;
+			++Pos;
+			skipSpace();
+
+			unsigned RHS = parsePrimary();
+			if (TokPrec < getPrecedence(peek()))
+				RHS = parseBinOpRHS(TokPrec + 1, RHS);
+
+			FormulaNode Node;
+			Node.Kind = node_binary;
+			Node.Op = Op;
+			Node.Operands[0] = LHS;
+			Node.Operands[1] = RHS;
+			LHS = addNode(Node);
+		}
+	}
+
+	constexpr unsigned parseExpression() { return parseBinOpRHS(0, parsePrimary()); }
+};
+
+template<class Source>
+struct FormulaOf {
+	static constexpr ParsedFormula<Source::size()> Parsed = FormulaParser<Source::size()>(Source::text()).parse();
+};
+
+template<class Source>
+constexpr ParsedFormula<Source::size()> FormulaOf<Source>::Parsed;
+
+template<char Op> struct BinaryOperator;
+template<> struct BinaryOperator<'+'> { static double apply(double L, double R) { return L + R; } };
+template<> struct BinaryOperator<'-'> { static double apply(double L, double R) { return L - R; } };
+template<> struct BinaryOperator<'*'> { static double apply(double L, double R) { return L * R; } };
+template<> struct BinaryOperator<'<'> { static double apply(double L, double R) { return !(L >= R); } };
+
+// Calls builtin number Builtin with the values of the expressions A, B and C, as many as it takes.
+template<unsigned Builtin> struct BuiltinCall;
+#define FORMULA_BUILTIN(Index, Call) \
+	template<> struct BuiltinCall<Index> { \
+		template<class A, class B, class C> static double call(const double* Args) { return Call; } \
+	}
+FORMULA_BUILTIN(0, std::sqrt(A::eval(Args)));
+FORMULA_BUILTIN(1, std::sin(A::eval(Args)));
+FORMULA_BUILTIN(2, std::cos(A::eval(Args)));
+FORMULA_BUILTIN(3, std::exp(A::eval(Args)));
+FORMULA_BUILTIN(4, std::log(A::eval(Args)));
+FORMULA_BUILTIN(5, std::pow(A::eval(Args), B::eval(Args)));
+FORMULA_BUILTIN(6, std::fabs(A::eval(Args)));
+FORMULA_BUILTIN(7, std::fma(A::eval(Args), B::eval(Args), C::eval(Args)));
+#undef FORMULA_BUILTIN
+
+/// FormulaExpr - The type of node I of a formula, eval computes its value from the arguments.
+template<class Source, unsigned I, NodeKind Kind = FormulaOf<Source>::Parsed.Nodes[I].Kind>
+struct FormulaExpr;
+
+template<class Source, unsigned I>
+struct FormulaExpr<Source, I, node_number> {
+	static constexpr double Value = FormulaOf<Source>::Parsed.Nodes[I].Value;
+	static double eval(const double*) { return Value; }
+};
+
+template<class Source, unsigned I>
+struct FormulaExpr<Source, I, node_argument> {
+	static constexpr unsigned Argument = FormulaOf<Source>::Parsed.Nodes[I].Argument;
+	static double eval(const double* Args) { return Args[Argument]; }
+};
+
+template<class Source, unsigned I>
+struct FormulaExpr<Source, I, node_binary> {
+	using LHS = FormulaExpr<Source, FormulaOf<Source>::Parsed.Nodes[I].Operands[0]>;
+	using RHS = FormulaExpr<Source, FormulaOf<Source>::Parsed.Nodes[I].Operands[1]>;
+	static double eval(const double* Args)
+	{
+		return BinaryOperator<FormulaOf<Source>::Parsed.Nodes[I].Op>::apply(LHS::eval(Args), RHS::eval(Args));
+	}
+};
+
+template<class Source, unsigned I>
+struct FormulaExpr<Source, I, node_call> {
+	using A = FormulaExpr<Source, FormulaOf<Source>::Parsed.Nodes[I].Operands[0]>;
+	using B = FormulaExpr<Source, FormulaOf<Source>::Parsed.Nodes[I].Operands[1]>;
+	using C = FormulaExpr<Source, FormulaOf<Source>::Parsed.Nodes[I].Operands[2]>;
+	static double eval(const double* Args)
+	{
+		return BuiltinCall<FormulaOf<Source>::Parsed.Nodes[I].Builtin>::template call<A, B, C>(Args);
+	}
+};
+
+} // end namespace formula_detail
+
+/// Formula - A formula parsed at compile time, see KALEIDOSCOPE_FORMULA. Calling it with as many numbers as the
+/// definition has arguments computes its value.
+template<class Source>
+class Formula {
+	using Root = formula_detail::FormulaExpr<Source, formula_detail::FormulaOf<Source>::Parsed.Root>;
+
+public:
+	static constexpr unsigned NumArgs = formula_detail::FormulaOf<Source>::Parsed.NumArgs;
+
+	template<class... ArgTypes>
+	double operator()(ArgTypes... Args) const
+	{
+		static_assert(sizeof...(ArgTypes) == NumArgs, "Incorrect # arguments passed to the formula");
+		const double Values[sizeof...(ArgTypes) + 1] = { (double)Args... };
+		return Root::eval(Values);
+	}
+};
@@ -0,0 +1,384 @@
+#include "stdafx.h"
+#include "ExecutorPool.h"
+#include "JITRuntimeWrapper.h"
+#include "Library.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Support/Endian.h"
+#include <set>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+static const size_t MessageHeaderSize = 13;
+
+//===----------------------------------------------------------------------===//
+// ExecutorChannel
+//===----------------------------------------------------------------------===//
+
+bool ExecutorChannel::readAll(void* Buffer, size_t Size)
+{
+	char* Next = (char*)Buffer;
+	while (Size) {
+#ifdef _WIN32
+		DWORD Read = 0;
+		if (!ReadFile(In, Next, (DWORD)min<size_t>(Size, 1 << 30), &Read, nullptr) || Read == 0)
+			return false;
+#else
+		ssize_t Read = ::read(In, Next, Size);
+		if (Read < 0 && errno == EINTR)
+			continue;
+		if (Read <= 0)
+			return false;
+#endif
+		Next += Read;
+		Size -= Read;
+	}
+	return true;
+}
+
+bool ExecutorChannel::writeAll(const void* Buffer, size_t Size)
+{
+	const char* Next = (const char*)Buffer;
+	while (Size) {
+#ifdef _WIN32
+		DWORD Written = 0;
+		if (!WriteFile(Out, Next, (DWORD)min<size_t>(Size, 1 << 30), &Written, nullptr))
+			return false;
+#else
+		ssize_t Written = ::write(Out, Next, Size);
+		if (Written < 0 && errno == EINTR)
+			continue;
+		if (Written < 0)
+			return false;
+#endif
+		Next += Written;
+		Size -= Written;
+	}
+	return true;
+}
+
+bool ExecutorChannel::send(ExecutorMessageKind Kind, uint64_t Id, StringRef Payload)
+{
+	char Header[MessageHeaderSize];
+	Header[0] = Kind;
+	support::endian::write64le(Header + 1, Id);
+	support::endian::write32le(Header + 9, (uint32_t)Payload.size());
+	return writeAll(Header, MessageHeaderSize) && writeAll(Payload.data(), Payload.size());
+}
+
+bool ExecutorChannel::receive(ExecutorMessageKind& Kind, uint64_t& Id, string& Payload)
+{
+	char Header[MessageHeaderSize];
+	if (!readAll(Header, MessageHeaderSize))
+		return false;
+
+	Kind = (ExecutorMessageKind)Header[0];
+	Id = support::endian::read64le(Header + 1);
+	Payload.resize(support::endian::read32le(Header + 9));
+	return readAll(&Payload[0], Payload.size());
+}
+
+void ExecutorChannel::closeOutput()
+{
+	if (OutputClosed)
+		return;
+	OutputClosed = true;
+#ifdef _WIN32
+	CloseHandle(Out);
+#else
+	close(Out);
+#endif
+}
+
+//===----------------------------------------------------------------------===//
+// ExecutorPool
+//===----------------------------------------------------------------------===//
+
+static string writeBitcode(const Module& M)
+{
+	string Bitcode;
+	raw_string_ostream OS(Bitcode);
+	WriteBitcodeToFile(M, OS);
+	OS.flush();
+	return Bitcode;
+}
+
+bool ExecutorPool::spawn(Executor& E)
+{
+#ifdef _WIN32
+	// Pipes for the executor's stdin and stdout. Only the executor's ends are inherited.
+	SECURITY_ATTRIBUTES Inherit = { sizeof(SECURITY_ATTRIBUTES), nullptr, TRUE };
+	HANDLE ChildIn, ToChild, FromChild, ChildOut;
+	if (!CreatePipe(&ChildIn, &ToChild, &Inherit, 0))
+		return false;
+	if (!CreatePipe(&FromChild, &ChildOut, &Inherit, 0))
+		return false;
+	SetHandleInformation(ToChild, HANDLE_FLAG_INHERIT, 0);
+	SetHandleInformation(FromChild, HANDLE_FLAG_INHERIT, 0);
+
+	string CommandLine = "\"" + ExecutablePath + "\" --executor";
+	for (auto& Arg : ExecutorArgs)
+		CommandLine += " " + Arg;
+
+	STARTUPINFOA StartupInfo = {};
+	StartupInfo.cb = sizeof(StartupInfo);
+	StartupInfo.dwFlags = STARTF_USESTDHANDLES;
+	StartupInfo.hStdInput = ChildIn;
+	StartupInfo.hStdOutput = ChildOut;
+	StartupInfo.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+
+	PROCESS_INFORMATION ProcessInfo;
+	BOOL Started = CreateProcessA(nullptr, &CommandLine[0], nullptr, nullptr, TRUE, 0, nullptr, nullptr,
+		&StartupInfo, &ProcessInfo);
+	CloseHandle(ChildIn);
+	CloseHandle(ChildOut);
+	if (!Started) {
+		CloseHandle(ToChild);
+		CloseHandle(FromChild);
+		return false;
+	}
+
+	CloseHandle(ProcessInfo.hThread);
+	E.Process = ProcessInfo.hProcess;
+	E.Channel = make_unique<ExecutorChannel>(FromChild, ToChild);
+	return true;
+#else
+	int ToChild[2], FromChild[2];
+	if (pipe(ToChild) != 0)
+		return false;
+	if (pipe(FromChild) != 0) {
+		close(ToChild[0]);
+		close(ToChild[1]);
+		return false;
+	}
+
+	vector<string> Args = { ExecutablePath, "--executor" };
+	Args.insert(Args.end(), ExecutorArgs.begin(), ExecutorArgs.end());
+	vector<char*> Argv;
+	for (auto& Arg : Args)
+		Argv.push_back(&Arg[0]);
+	Argv.push_back(nullptr);
+
+	pid_t Pid = fork();
+	if (Pid == 0) {
+		dup2(ToChild[0], 0);
+		dup2(FromChild[1], 1);
+		close(ToChild[0]);
+		close(ToChild[1]);
+		close(FromChild[0]);
+		close(FromChild[1]);
+		execv(ExecutablePath.c_str(), Argv.data());
+		_exit(127);
+	}
+
+	// Our ends aren't inherited by executors started later, or those would keep the pipes open.
+	close(ToChild[0]);
+	close(FromChild[1]);
+	fcntl(ToChild[1], F_SETFD, FD_CLOEXEC);
+	fcntl(FromChild[0], F_SETFD, FD_CLOEXEC);
+	if (Pid < 0) {
+		close(ToChild[1]);
+		close(FromChild[0]);
+		return false;
+	}
+
+	E.Pid = Pid;
+	E.Channel = make_unique<ExecutorChannel>(FromChild[0], ToChild[1]);
+	return true;
+#endif
+}
+
+bool ExecutorPool::start(unsigned NumExecutors)
+{
+#ifndef _WIN32
+	// An executor that dies must not take the compiler down with it when it's written to.
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	for (unsigned i = 0; i != NumExecutors; ++i) {
+		auto E = make_unique<Executor>();
+		if (!spawn(*E)) {
+			fprintf(stderr, "Error: can't start executor %s\n", ExecutablePath.c_str());
+			return false;
+		}
+
+		Executor* Started = E.get();
+		E->ResultReader = std::thread([this, Started]() { readResults(*Started); });
+		Executors.push_back(move(E));
+	}
+	return true;
+}
+
+void ExecutorPool::readResults(Executor& E)
+{
+	ExecutorMessageKind Kind;
+	uint64_t Id;
+	string Payload;
+	while (E.Channel->receive(Kind, Id, Payload)) {
+		{
+			lock_guard<mutex> Lock(PrintMutex);
+			if (Kind == msg_result && Payload.size() == sizeof(double)) {
+				double Result;
+				memcpy(&Result, Payload.data(), sizeof(double));
+				fprintf(stderr, "Evaluated #%llu to %f\n", (unsigned long long)Id, Result);
+			}
+			else {
+				fprintf(stderr, "Error: expression #%llu: %s\n", (unsigned long long)Id, Payload.c_str());
+			}
+		}
+		--E.Outstanding;
+	}
+}
+
+void ExecutorPool::addModule(const Module& M)
+{
+	string Bitcode = writeBitcode(M);
+	for (auto& E : Executors)
+		E->Channel->send(msg_define, 0, Bitcode);
+}
+
+void ExecutorPool::importLibrary(const string& FileName)
+{
+	for (auto& E : Executors)
+		E->Channel->send(msg_import, 0, FileName);
+}
+
+uint64_t ExecutorPool::evaluate(const Module& M)
+{
+	// Least outstanding expressions first, ties go to the executor after the last one used.
+	Executor* Target = nullptr;
+	for (size_t i = 0, e = Executors.size(); i != e; ++i) {
+		Executor* Candidate = Executors[(NextExpression + i) % e].get();
+		if (!Target || Candidate->Outstanding < Target->Outstanding)
+			Target = Candidate;
+	}
+
+	uint64_t Id = NextExpression++;
+	if (!Target)
+		return Id;
+
+	++Target->Outstanding;
+	if (!Target->Channel->send(msg_evaluate, Id, writeBitcode(M))) {
+		--Target->Outstanding;
+		fprintf(stderr, "Error: executor for expression #%llu is gone\n", (unsigned long long)Id);
+	}
+	return Id;
+}
+
+void ExecutorPool::shutdown()
+{
+	// Executors finish what they were sent and exit once their input is closed. That ends the result readers.
+	for (auto& E : Executors)
+		E->Channel->closeOutput();
+
+	for (auto& E : Executors) {
+		if (E->ResultReader.joinable())
+			E->ResultReader.join();
+#ifdef _WIN32
+		WaitForSingleObject(E->Process, INFINITE);
+		CloseHandle(E->Process);
+#else
+		waitpid(E->Pid, nullptr, 0);
+#endif
+	}
+	Executors.clear();
+}
+
+//===----------------------------------------------------------------------===//
+// Executor process
+//===----------------------------------------------------------------------===//
+
+int runExecutor(const orc::KaleidoscopeJITOptions& JITOptions)
+{
+	// Keep the pipe to the compiler to ourselves: anything JIT'd code prints to stdout goes to stderr instead.
+#ifdef _WIN32
+	HANDLE In = GetStdHandle(STD_INPUT_HANDLE);
+	HANDLE Out = GetStdHandle(STD_OUTPUT_HANDLE);
+	SetStdHandle(STD_OUTPUT_HANDLE, GetStdHandle(STD_ERROR_HANDLE));
+	_dup2(2, 1);
+	ExecutorChannel Compiler(In, Out);
+#else
+	int Out = dup(1);
+	dup2(2, 1);
+	ExecutorChannel Compiler(0, Out);
+#endif
+
+	JITRuntimeWrapper JIT(JITOptions);
+	vector<unique_ptr<CompiledLibrary>> Libraries;
+	set<string> Imported;
+
+	ExecutorMessageKind Kind;
+	uint64_t Id;
+	string Payload;
+	while (Compiler.receive(Kind, Id, Payload)) {
+		if (Kind == msg_import) {
+			// The compiler sends every import statement, the library may be there already.
+			if (!Imported.insert(Payload).second)
+				continue;
+
+			auto Library = CompiledLibrary::open(Payload);
+			if (!Library)
+				continue;
+
+			vector<string> FunctionNames;
+			for (auto& Proto : Library->Prototypes)
+				FunctionNames.push_back(Proto->Name);
+			if (auto Err = JIT.TheJIT->addLazyBitcode(Library->getBitcode(), Library->Buffer, FunctionNames))
+				logAllUnhandledErrors(move(Err), errs(), "Error: ");
+			Libraries.push_back(move(Library));
+			continue;
+		}
+
+		auto Context = make_unique<LLVMContext>();
+		auto M = parseBitcodeFile(MemoryBufferRef(Payload, "module"), *Context);
+		if (!M) {
+			string Message = toString(M.takeError());
+			if (Kind == msg_evaluate)
+				Compiler.send(msg_error, Id, Message);
+			else
+				fprintf(stderr, "Error: %s\n", Message.c_str());
+			continue;
+		}
+
+		orc::ThreadSafeModule TSM(move(*M), move(Context));
+		if (Kind == msg_define) {
+			if (auto Err = JIT.TheJIT->addModule(move(TSM)))
+				logAllUnhandledErrors(move(Err), errs(), "Error: ");
+			continue;
+		}
+
+		// Evaluate the expression in its own tracker, so its code is freed again afterwards.
+		auto RT = JIT.TheJIT->getMainJITDylib().createResourceTracker();
+		if (auto Err = JIT.TheJIT->addModule(move(TSM), RT)) {
+			Compiler.send(msg_error, Id, toString(move(Err)));
+			continue;
+		}
+
+		auto ExprSymbol = JIT.TheJIT->lookup("__anon_expr");
+		if (!ExprSymbol) {
+			Compiler.send(msg_error, Id, toString(ExprSymbol.takeError()));
+			cantFail(RT->remove());
+			continue;
+		}
+
+		double (*FP)() = (double (*)())(intptr_t)ExprSymbol->getAddress();
+		double Result = FP();
+		Compiler.send(msg_result, Id, StringRef((const char*)&Result, sizeof(double)));
+
+		if (auto Err = RT->remove())
+			logAllUnhandledErrors(move(Err), errs(), "Error: ");
+	}
+	return 0;
+}
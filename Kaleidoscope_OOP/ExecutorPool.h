@@ -0,0 +1,116 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "llvm/IR/Module.h"
+#include "KaleidoscopeJIT.h"
+
+using namespace std;
+using namespace llvm;
+
+/**
+* Runs JIT'd code in a pool of local executor processes instead of the compiler's own process. The compiler keeps
+* lexing, parsing, generating and optimizing IR; the executors link and run it. Every executor is the same program
+* started with "--executor", talking to the compiler over its stdin/stdout pipes.
+*
+* LLVM 12 has no ready-made remote TargetProcessControl to build on, so the executors aren't driven at the level of
+* memory and symbol lookups. They run a KaleidoscopeJIT of their own and are sent modules as bitcode:
+*   - definitions and imports are broadcast to every executor, in order, so each has all functions,
+*   - a top-level expression goes to the executor with the fewest expressions outstanding.
+* The compiler doesn't wait for results: it carries on with the next input while the expression runs, and results
+* are printed (tagged with the expression's number) as they come back. Pipes are FIFO, so an expression always
+* reaches an executor after the definitions it uses.
+*
+* Message framing, in both directions: u8 kind, u64 id, u32 payload size, payload.
+*/
+
+enum ExecutorMessageKind : uint8_t {
+	msg_define = 1, // payload: bitcode of a module with definitions
+	msg_import = 2, // payload: file name of a precompiled library (Library.h)
+	msg_evaluate = 3, // payload: bitcode of a module defining __anon_expr, id: the expression's number
+	msg_result = 4, // payload: the double __anon_expr returned
+	msg_error = 5, // payload: error message
+};
+
+// One end of a pipe pair to another process.
+class ExecutorChannel {
+public:
+#ifdef _WIN32
+	typedef void* Handle;
+#else
+	typedef int Handle;
+#endif
+
+	ExecutorChannel(Handle In, Handle Out) : In(In), Out(Out) {}
+
+	bool send(ExecutorMessageKind Kind, uint64_t Id, StringRef Payload);
+
+	// Blocks until a message arrives. Returns false once the other side is gone.
+	bool receive(ExecutorMessageKind& Kind, uint64_t& Id, string& Payload);
+
+	// Closes the writing end, which tells the other side there's nothing more to come.
+	void closeOutput();
+
+private:
+	Handle In;
+	Handle Out;
+	bool OutputClosed = false;
+
+	bool readAll(void* Buffer, size_t Size);
+	bool writeAll(const void* Buffer, size_t Size);
+};
+
+class ExecutorPool {
+public:
+	// ExecutorArgs are passed on to every executor (e.g. the JIT options).
+	ExecutorPool(const string& ExecutablePath, vector<string> ExecutorArgs)
+		: ExecutablePath(ExecutablePath), ExecutorArgs(move(ExecutorArgs)) {}
+
+	~ExecutorPool() { shutdown(); }
+
+	/// start - Spawns NumExecutors executor processes. Returns false if any of them couldn't be started.
+	bool start(unsigned NumExecutors);
+
+	/// addModule - Sends a module with definitions to every executor.
+	void addModule(const Module& M);
+
+	/// importLibrary - Has every executor import a precompiled library.
+	void importLibrary(const string& FileName);
+
+	/// evaluate - Sends a module defining __anon_expr to the least busy executor. Returns the expression's
+	/// number, which its result is printed with.
+	uint64_t evaluate(const Module& M);
+
+	/// shutdown - Waits for all outstanding results and ends the executor processes.
+	void shutdown();
+
+private:
+	struct Executor {
+		unique_ptr<ExecutorChannel> Channel;
+		std::thread ResultReader;
+		atomic<unsigned> Outstanding{ 0 };
+#ifdef _WIN32
+		void* Process = nullptr;
+#else
+		int Pid = 0;
+#endif
+	};
+
+	string ExecutablePath;
+	vector<string> ExecutorArgs;
+	vector<unique_ptr<Executor>> Executors;
+	uint64_t NextExpression = 1;
+
+	// Result readers print from their own threads.
+	mutex PrintMutex;
+
+	bool spawn(Executor& E);
+	void readResults(Executor& E);
+};
+
+/// runExecutor - The main loop of an executor process: runs what the compiler sends over stdin, answers over
+/// stdout. Returns once the compiler closes the pipe.
+int runExecutor(const orc::KaleidoscopeJITOptions& JITOptions);
@@ -0,0 +1,263 @@
+#include "stdafx.h"
+#include "FlatAST.h"
+
+/**
+* Flattens a tree with a worklist. A node's slot is taken when it comes off the worklist, and its operands are
+* pushed last first, so the nodes end up in pre-order. Each pending operand knows where its index goes, by index
+* rather than by pointer, since adding nodes may move the arrays.
+*/
+
+class FlatASTBuilder : public ExprASTVisitor<void>
+{
+public:
+	FlatASTBuilder(FlatAST& AST) : AST(AST) {}
+
+	FlatAST::NodeId add(const ExprAST* Root) {
+		FlatAST::NodeId RootId = (FlatAST::NodeId)AST.Nodes.size();
+		Worklist.push_back({ Root, to_none, 0, 0 });
+		while (!Worklist.empty()) {
+			Pending Next = Worklist.back();
+			Worklist.pop_back();
+
+			FlatAST::NodeId Id = (FlatAST::NodeId)AST.Nodes.size();
+			if (Next.Target == to_operand)
+				AST.Nodes[Next.Index].Ops[Next.Slot] = Id;
+			else if (Next.Target == to_argument)
+				AST.CallArgs[Next.Index] = Id;
+			const_cast<ExprAST*>(Next.Expr)->accept(this);
+		}
+		return RootId;
+	}
+
+	void visit(NumberExprAST* NumberExpr) {
+		FlatExpr& Node = addNode(flat_number, NumberExpr);
+		Node.ExtraType = NumberExpr->AnnotatedType;
+		Node.Ops[0] = (uint32_t)AST.Numbers.size();
+		AST.Numbers.push_back(NumberExpr->Val);
+	}
+
+	void visit(VariableExprAST* VariableExpr) {
+		addNode(flat_variable, VariableExpr).Ops[0] = AST.internName(VariableExpr->Name);
+	}
+
+	void visit(UnaryExprAST* UnaryExpr) {
+		addNode(flat_unary, UnaryExpr).Op = UnaryExpr->Opcode;
+		pushOperand(UnaryExpr->Operand, 0);
+	}
+
+	void visit(BinaryExprAST* BinaryExpr) {
+		FlatExpr& Node = addNode(flat_binary, BinaryExpr);
+		Node.Op = BinaryExpr->Op;
+		Node.ExtraType = BinaryExpr->OperandType;
+		pushOperand(BinaryExpr->RHS, 1);
+		pushOperand(BinaryExpr->LHS, 0);
+	}
+
+	void visit(CallExprAST* CallExpr) {
+		FlatExpr& Node = addNode(flat_call, CallExpr);
+		Node.Ops[0] = AST.internName(CallExpr->Callee);
+
+		// The argument list is reserved now, the arguments fill it in as they're added.
+		uint32_t FirstArg = (uint32_t)AST.CallArgs.size();
+		Node.Ops[1] = FirstArg;
+		Node.Ops[2] = (uint32_t)CallExpr->Args.size();
+		AST.CallArgs.resize(FirstArg + CallExpr->Args.size());
+		for (size_t i = CallExpr->Args.size(); i-- != 0;)
+			Worklist.push_back({ CallExpr->Args[i], to_argument, FirstArg + (uint32_t)i, 0 });
+	}
+
+	void visit(IndexExprAST* IndexExpr) {
+		addNode(flat_index, IndexExpr).Ops[0] = AST.internName(IndexExpr->Name);
+		pushOperand(IndexExpr->Index, 1);
+	}
+
+	void visit(IndexAssignExprAST* IndexAssignExpr) {
+		addNode(flat_index_assign, IndexAssignExpr).Ops[0] = AST.internName(IndexAssignExpr->Name);
+		pushOperand(IndexAssignExpr->Val, 2);
+		pushOperand(IndexAssignExpr->Index, 1);
+	}
+
+	void visit(ParallelExprAST* ParallelExpr) {
+		FlatExpr& Node = addNode(flat_parallel, ParallelExpr);
+		Node.Op = (char)ParallelExpr->Kind;
+		Node.Ops[0] = AST.internName(ParallelExpr->VarName);
+
+		// Four operands don't fit, the body goes right after the node: it's taken off the worklist first.
+		pushOperand(ParallelExpr->End, 2);
+		pushOperand(ParallelExpr->Start, 1);
+		Worklist.push_back({ ParallelExpr->Body, to_none, 0, 0 });
+	}
+
+	// Prototypes and functions aren't expressions.
+	void visit(PrototypeAST* PrototypeExpr) {}
+	void visit(FunctionAST* FunctionExpr) {}
+
+private:
+	enum TargetKind : uint8_t { to_none, to_operand, to_argument };
+
+	struct Pending {
+		const ExprAST* Expr;
+
+		// Where the index of Expr's node goes: nowhere, Ops[Slot] of node Index, or CallArgs[Index].
+		TargetKind Target;
+		uint32_t Index;
+		uint8_t Slot;
+	};
+
+	FlatAST& AST;
+	vector<Pending> Worklist;
+
+	// The node being added is always the last one.
+	void pushOperand(const ExprAST* Operand, uint8_t Slot) {
+		Worklist.push_back({ Operand, to_operand, (uint32_t)(AST.Nodes.size() - 1), Slot });
+	}
+
+	FlatExpr& addNode(FlatExprKind Kind, const ExprAST* Expr) {
+		FlatExpr Node;
+		Node.Kind = Kind;
+		Node.Type = Expr->Type;
+		Node.Loc = Expr->Loc;
+		AST.Nodes.push_back(Node);
+		return AST.Nodes.back();
+	}
+};
+
+FlatAST::NodeId FlatAST::add(const ExprAST* Expr)
+{
+	return FlatASTBuilder(*this).add(Expr);
+}
+
+uint32_t FlatAST::internName(const string& Name)
+{
+	auto Inserted = NameIds.insert({ Name, (uint32_t)Names.size() });
+	if (Inserted.second)
+		Names.push_back(Name);
+	return Inserted.first->second;
+}
+
+unsigned FlatAST::getNumOperands(NodeId Id) const
+{
+	const FlatExpr& E = Nodes[Id];
+	switch (E.Kind) {
+	case flat_unary:
+	case flat_index:
+		return 1;
+	case flat_binary:
+	case flat_index_assign:
+		return 2;
+	case flat_call:
+		return E.Ops[2];
+	case flat_parallel:
+		return 3;
+	default:
+		return 0;
+	}
+}
+
+FlatAST::NodeId FlatAST::getEnd(NodeId Id) const
+{
+	// Every node takes the place of one pending expression and adds its operands.
+	for (size_t Pending = 1; Pending; ++Id)
+		Pending = Pending - 1 + getNumOperands(Id);
+	return Id;
+}
+
+ExprAST* FlatAST::toTree(NodeId Id) const
+{
+	// Backwards, so a node's operands have been materialized when it is.
+	NodeId End = getEnd(Id);
+	vector<ExprAST*> Trees(End - Id);
+	auto Take = [&](NodeId Operand) { return Trees[Operand - Id]; };
+	for (NodeId i = End; i-- != Id;) {
+		const FlatExpr& E = Nodes[i];
+		ExprAST* Expr;
+		switch (E.Kind) {
+		case flat_number:
+			Expr = new NumberExprAST(getNumber(i), E.ExtraType);
+			break;
+		case flat_variable: {
+			string Name = getName(i);
+			Expr = new VariableExprAST(Name);
+			break;
+		}
+		case flat_unary:
+			Expr = new UnaryExprAST(E.Op, Take(E.Ops[0]));
+			break;
+		case flat_binary: {
+			auto* BinaryExpr = new BinaryExprAST(E.Op, Take(E.Ops[0]), Take(E.Ops[1]));
+			BinaryExpr->OperandType = E.ExtraType;
+			Expr = BinaryExpr;
+			break;
+		}
+		case flat_call: {
+			vector<const ExprAST*> Args;
+			for (NodeId Arg : getArgs(i))
+				Args.push_back(Take(Arg));
+			Expr = new CallExprAST(getName(i), Args);
+			break;
+		}
+		case flat_index:
+			Expr = new IndexExprAST(getName(i), Take(E.Ops[1]));
+			break;
+		case flat_index_assign:
+			Expr = new IndexAssignExprAST(getName(i), Take(E.Ops[1]), Take(E.Ops[2]));
+			break;
+		default:
+			Expr = new ParallelExprAST((ParallelExprAST::LoopKind)E.Op, getName(i), Take(E.Ops[1]),
+				Take(E.Ops[2]), Take(i + 1));
+			break;
+		}
+
+		Expr->Type = E.Type;
+		Expr->Loc = E.Loc;
+		Trees[i - Id] = Expr;
+	}
+	return Trees[0];
+}
+
+void FlatAST::copyTypes(NodeId Id, const ExprAST* Expr)
+{
+	// The tree was materialized from Id, so every node has the kind of its flat counterpart.
+	vector<pair<NodeId, const ExprAST*>> Worklist{ { Id, Expr } };
+	while (!Worklist.empty()) {
+		NodeId i = Worklist.back().first;
+		const ExprAST* Tree = Worklist.back().second;
+		Worklist.pop_back();
+
+		FlatExpr& E = Nodes[i];
+		E.Type = Tree->Type;
+		switch (E.Kind) {
+		case flat_unary:
+			Worklist.push_back({ E.Ops[0], static_cast<const UnaryExprAST*>(Tree)->Operand });
+			break;
+		case flat_binary: {
+			auto* BinaryExpr = static_cast<const BinaryExprAST*>(Tree);
+			E.ExtraType = BinaryExpr->OperandType;
+			Worklist.push_back({ E.Ops[0], BinaryExpr->LHS });
+			Worklist.push_back({ E.Ops[1], BinaryExpr->RHS });
+			break;
+		}
+		case flat_call: {
+			auto* CallExpr = static_cast<const CallExprAST*>(Tree);
+			ArrayRef<NodeId> Args = getArgs(i);
+			for (size_t a = 0, e = Args.size(); a != e; ++a)
+				Worklist.push_back({ Args[a], CallExpr->Args[a] });
+			break;
+		}
+		case flat_index:
+			Worklist.push_back({ E.Ops[1], static_cast<const IndexExprAST*>(Tree)->Index });
+			break;
+		case flat_index_assign:
+			Worklist.push_back({ E.Ops[1], static_cast<const IndexAssignExprAST*>(Tree)->Index });
+			Worklist.push_back({ E.Ops[2], static_cast<const IndexAssignExprAST*>(Tree)->Val });
+			break;
+		case flat_parallel:
+			Worklist.push_back({ E.Ops[1], static_cast<const ParallelExprAST*>(Tree)->Start });
+			Worklist.push_back({ E.Ops[2], static_cast<const ParallelExprAST*>(Tree)->End });
+			Worklist.push_back({ i + 1, static_cast<const ParallelExprAST*>(Tree)->Body });
+			break;
+		default:
+			break;
+		}
+	}
+}
@@ -0,0 +1,170 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "llvm/ADT/ArrayRef.h"
+#include "AST.h"
+
+using namespace std;
+using namespace llvm;
+
+/**
+* A flat form of expression ASTs. Every node of the tree form (AST.h) is a heap object of its own, and a pass
+* visits it through two virtual calls (accept, then visit), so a pass over a big generated expression misses the
+* cache on about every node. Here the nodes of any number of expressions are stored in one array, in pre-order
+* (a node's operands follow it), and refer to their operands by 32-bit indices. Literal values, names and the
+* argument lists of calls are kept in arrays of their own, so a node is 32 bytes. Passes (FlatASTVisitor) switch on
+* a node's kind instead of dispatching virtually.
+*
+* An expression is a contiguous run of nodes starting at its root (see getEnd), so a pass that doesn't care about
+* the shape of the tree (e.g. FlatCalleeCollector in CalleeCollector.h) is a loop over the run, and one that does
+* can go through it backwards, meeting every node after its operands. Nothing recurses, neither flattening a tree
+* nor materializing one, so deep expressions (see AST.h) are fine.
+*
+* The existing visitors run over the flat form through an adapter: FlatAST::accept materializes a tree for the
+* visitor, and writes the types it inferred (e.g. ASTTypeInferenceVisitor) back to the flat nodes afterwards.
+*
+* The compiler doesn't use the flat form yet. The parser builds trees and every pass runs over them, so flattening
+* a tree only adds work until the parser builds flat ASTs directly and the hot passes (type inference, code
+* generation) switch over to them.
+*/
+
+enum FlatExprKind : uint8_t {
+	flat_number,
+	flat_variable,
+	flat_unary,
+	flat_binary,
+	flat_call,
+	flat_index,
+	flat_index_assign,
+	flat_parallel,
+};
+
+/// FlatExpr - A node of a flat AST. What the operands are depends on the kind:
+///   flat_number:       Ops[0] = literal (FlatAST::Numbers)
+///   flat_variable:     Ops[0] = name (FlatAST::Names)
+///   flat_unary:        Ops[0] = operand
+///   flat_binary:       Ops[0] = LHS, Ops[1] = RHS
+///   flat_call:         Ops[0] = callee name, Ops[1] = first argument in FlatAST::CallArgs, Ops[2] = argument count
+///   flat_index:        Ops[0] = name, Ops[1] = index
+///   flat_index_assign: Ops[0] = name, Ops[1] = index, Ops[2] = stored value
+///   flat_parallel:     Ops[0] = loop variable name, Ops[1] = start, Ops[2] = end, the body is the node right after
+///                      it (Id + 1), and Op is the ParallelExprAST::LoopKind
+struct FlatExpr {
+	FlatExprKind Kind;
+
+	// Opcode of a unary or binary operator, kind of a parallel loop.
+	char Op = 0;
+
+	ValueType Type = type_unknown;
+
+	// The annotated type of a number, the operand type of a binary expression (see AST.h).
+	ValueType ExtraType = type_unknown;
+
+	uint32_t Ops[3] = { 0, 0, 0 };
+
+	SourceLocation Loc;
+};
+
+class FlatAST {
+public:
+	typedef uint32_t NodeId;
+
+	vector<FlatExpr> Nodes;
+	vector<double> Numbers;
+	vector<string> Names;
+	vector<NodeId> CallArgs;
+
+	/// add - Appends a copy of an expression tree and returns its root.
+	NodeId add(const ExprAST* Expr);
+
+	const FlatExpr& operator[](NodeId Id) const { return Nodes[Id]; }
+
+	double getNumber(NodeId Id) const { return Numbers[Nodes[Id].Ops[0]]; }
+	const string& getName(NodeId Id) const { return Names[Nodes[Id].Ops[0]]; }
+
+	/// getArgs - The arguments of a call.
+	ArrayRef<NodeId> getArgs(NodeId Id) const {
+		return ArrayRef<NodeId>(CallArgs).slice(Nodes[Id].Ops[1], Nodes[Id].Ops[2]);
+	}
+
+	/// getNumOperands - How many expressions are directly below a node.
+	unsigned getNumOperands(NodeId Id) const;
+
+	/// getEnd - One past the last node of the expression at Id.
+	NodeId getEnd(NodeId Id) const;
+
+	/// toTree - Materializes the expression at Id as a tree, owned by the caller.
+	ExprAST* toTree(NodeId Id) const;
+
+	/// accept - Runs a visitor of the tree form over the expression at Id. The types it leaves on the tree's nodes
+	/// are copied back.
+	template <class ReturnType> ReturnType accept(NodeId Id, ExprASTVisitor<ReturnType>* Visitor) {
+		TreeView View(*this, Id);
+		return View.Tree->accept(Visitor);
+	}
+
+private:
+	// Interned names, by name.
+	map<string, uint32_t> NameIds;
+
+	uint32_t internName(const string& Name);
+
+	// Copies the types of a tree materialized from Id back to the flat nodes.
+	void copyTypes(NodeId Id, const ExprAST* Expr);
+
+	// A tree materialized for the length of a visit.
+	struct TreeView {
+		FlatAST& AST;
+		NodeId Id;
+		unique_ptr<ExprAST> Tree;
+
+		TreeView(FlatAST& AST, NodeId Id) : AST(AST), Id(Id), Tree(AST.toTree(Id)) {}
+		~TreeView() { AST.copyTypes(Id, Tree.get()); }
+	};
+
+	friend class FlatASTBuilder;
+};
+
+/**
+* Base of passes over a flat AST. Derived implements a visit method per node kind, taking the node's index and
+* the node. visit(Id) dispatches one node, visitExpression(Root) every node of the expression at Root in pre-order.
+*/
+
+template <class Derived, class ReturnType> class FlatASTVisitor {
+public:
+	FlatASTVisitor(const FlatAST& AST) : AST(AST) {}
+
+	ReturnType visit(FlatAST::NodeId Id) {
+		const FlatExpr& E = AST.Nodes[Id];
+		Derived* D = static_cast<Derived*>(this);
+		switch (E.Kind) {
+		case flat_number:
+			return D->visitNumber(Id, E);
+		case flat_variable:
+			return D->visitVariable(Id, E);
+		case flat_unary:
+			return D->visitUnary(Id, E);
+		case flat_binary:
+			return D->visitBinary(Id, E);
+		case flat_call:
+			return D->visitCall(Id, E);
+		case flat_index:
+			return D->visitIndex(Id, E);
+		case flat_index_assign:
+			return D->visitIndexAssign(Id, E);
+		default:
+			return D->visitParallel(Id, E);
+		}
+	}
+
+	void visitExpression(FlatAST::NodeId Root) {
+		for (FlatAST::NodeId Id = Root, End = AST.getEnd(Root); Id != End; ++Id)
+			visit(Id);
+	}
+
+protected:
+	const FlatAST& AST;
+};
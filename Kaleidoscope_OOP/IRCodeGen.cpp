@@ -1,5 +1,7 @@
 #include "stdafx.h"
 #include "IRCodeGen.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/MDBuilder.h"
 #include "Logger.h"
 
 /**
@@ -9,7 +11,14 @@
 * Again, we don't want to enforce visitors to work on only const nodes (see AST.h)
 */
 
-ASTCodeGenVisitor::ASTCodeGenVisitor() {
+// Instructions call-site specializations (see specializeCall) may add to a module.
+static const int MaxSpecializedInstructions = 4096;
+
+ASTCodeGenVisitor::ASTCodeGenVisitor(const orc::KaleidoscopeJITOptions& JITOptions) : JIT(JITOptions) {
+	InitializeModuleAndPassManager();
+}
+
+ASTCodeGenVisitor::ASTCodeGenVisitor(const JITRuntimeWrapper& JIT) : JIT(JIT) {
 	InitializeModuleAndPassManager();
 }
 
@@ -19,6 +28,119 @@ void ASTCodeGenVisitor::InitializeModuleAndPassManager() {
 	TheModule->setDataLayout(JIT.TheJIT->getDataLayout());
 	Builder = new IRBuilder<>(*TheContext);
 	IROptimizer = new Optimizer(TheModule, TheContext);
+
+	Specializations.clear();
+	SpecializationBudget = MaxSpecializedInstructions;
+
+	DBuilder = nullptr;
+	DebugCU = nullptr;
+	if (!DebugSourceFile.empty()) {
+		TheModule->addModuleFlag(Module::Warning, "Debug Info Version", DEBUG_METADATA_VERSION);
+		DBuilder = new DIBuilder(*TheModule);
+		DebugCU = DBuilder->createCompileUnit(dwarf::DW_LANG_C, DBuilder->createFile(DebugSourceFile, "."),
+			"Kaleidoscope Compiler", true, "", 0);
+	}
+}
+
+void ASTCodeGenVisitor::enableDebugInfo(const string& SourceFileName) {
+	DebugSourceFile = SourceFileName;
+	DiscardModule();
+}
+
+void ASTCodeGenVisitor::finalizeDebugInfo() {
+	if (DBuilder)
+		DBuilder->finalize();
+}
+
+void ASTCodeGenVisitor::AddModuleToJIT(orc::ResourceTrackerSP RT) {
+	// With an executor pool the code runs in the executors, they get the module instead.
+	if (Executors) {
+		finalizeDebugInfo();
+		Executors->addModule(*TheModule);
+		DiscardModule();
+		return;
+	}
+
+	JIT.ExitOnError(JIT.TheJIT->addModule(takeModule(), RT ? RT : JIT.RT));
+}
+
+orc::ThreadSafeModule ASTCodeGenVisitor::takeModule() {
+	finalizeDebugInfo();
+	delete DBuilder;
+	delete IROptimizer;
+	delete Builder;
+
+	auto TSM = orc::ThreadSafeModule(
+		move(unique_ptr<Module>(TheModule)),
+		move(unique_ptr<LLVMContext>(TheContext))
+	);
+
+	InitializeModuleAndPassManager();
+	return TSM;
+}
+
+void ASTCodeGenVisitor::DiscardModule() {
+	delete DBuilder;
+	delete IROptimizer;
+	delete Builder;
+	delete TheModule;
+	delete TheContext;
+	InitializeModuleAndPassManager();
+}
+
+void ASTCodeGenVisitor::forgetFunction(const string& Name) {
+	FunctionProtos.erase(Name);
+	OperatorDefinitions.erase(Name);
+	FunctionDefinitions.erase(Name);
+}
+
+const FunctionAST* ASTCodeGenVisitor::getDefinition(const string& Name) const {
+	auto DI = FunctionDefinitions.find(Name);
+	if (DI != FunctionDefinitions.end())
+		return DI->second;
+	auto OI = OperatorDefinitions.find(Name);
+	return OI != OperatorDefinitions.end() ? OI->second : nullptr;
+}
+
+const CompiledLibrary* ASTCodeGenVisitor::importLibrary(const string& FileName) {
+	// Importing a library again is a no-op.
+	for (auto& Imported : Libraries)
+		if (Imported->FileName == FileName)
+			return Imported.get();
+
+	auto Library = CompiledLibrary::open(FileName);
+	if (!Library)
+		return nullptr;
+
+	vector<string> FunctionNames;
+	for (auto& Proto : Library->Prototypes) {
+		if (FunctionProtos.count(Proto->Name) || getBuiltinFunction(Proto->Name)) {
+			fprintf(stderr, "Error: %s (imported from %s) is already defined\n", Proto->Name.c_str(), FileName.c_str());
+			return nullptr;
+		}
+		FunctionNames.push_back(Proto->Name);
+	}
+
+	// The bitcode isn't even parsed here, the JIT does that once one of the functions is looked up.
+	JIT.ExitOnError(JIT.TheJIT->addLazyBitcode(Library->getBitcode(), Library->Buffer, FunctionNames,
+		JIT.RT));
+
+	for (auto& Proto : Library->Prototypes)
+		FunctionProtos[Proto->Name] = Proto.get();
+
+	Libraries.push_back(move(Library));
+	return Libraries.back().get();
+}
+
+bool ASTCodeGenVisitor::writeLibrary(const string& FileName, const vector<const PrototypeAST*>& Prototypes) {
+	if (verifyModule(*TheModule, &errs()))
+		return false;
+
+	finalizeDebugInfo();
+
+	// Libraries are optimized once when they're built, like the JIT would optimize them.
+	JIT.TheJIT->optimizeModule(*TheModule);
+	return CompiledLibrary::write(FileName, *TheModule, Prototypes);
 }
 
 void ASTCodeGenVisitor::PrintIR() {
@@ -26,8 +148,12 @@ void ASTCodeGenVisitor::PrintIR() {
 	TheModule->print(errs(), nullptr);
 }
 
-Function* ASTCodeGenVisitor::getFunction(string Name)
+Function* ASTCodeGenVisitor::getFunction(string Name, ValueType OverloadType)
 {
+	// Builtin math functions are intrinsics rather than external symbols, so LLVM knows what they compute.
+	if (auto* Builtin = getBuiltinFunction(Name))
+		return Intrinsic::getDeclaration(TheModule, Builtin->ID, getLLVMType(OverloadType));
+
 	// First, see if the function has already been added to the current module.
 	if (auto* F = TheModule->getFunction(Name))
 		return F;
@@ -42,13 +168,138 @@ Function* ASTCodeGenVisitor::getFunction(string Name)
 	return nullptr;
 }
 
+Type* ASTCodeGenVisitor::getLLVMType(ValueType ValType)
+{
+	if (isPointerType(ValType))
+		return PointerType::getUnqual(getLLVMType(getElementType(ValType)));
+
+	switch (ValType) {
+	case type_bool:
+		return Type::getInt1Ty(*TheContext);
+	case type_i64:
+		return Type::getInt64Ty(*TheContext);
+	case type_f32:
+		return Type::getFloatTy(*TheContext);
+	default:
+		return Type::getDoubleTy(*TheContext);
+	}
+}
+
+DIType* ASTCodeGenVisitor::getDebugType(ValueType ValType)
+{
+	if (isPointerType(ValType))
+		return DBuilder->createPointerType(getDebugType(getElementType(ValType)), 64);
+
+	switch (ValType) {
+	case type_bool:
+		return DBuilder->createBasicType("bool", 8, dwarf::DW_ATE_boolean);
+	case type_i64:
+		return DBuilder->createBasicType("i64", 64, dwarf::DW_ATE_signed);
+	case type_f32:
+		return DBuilder->createBasicType("float", 32, dwarf::DW_ATE_float);
+	default:
+		return DBuilder->createBasicType("double", 64, dwarf::DW_ATE_float);
+	}
+}
+
+void ASTCodeGenVisitor::emitSubprogram(Function* F, const PrototypeAST* Proto)
+{
+	// A specialization is described with the prototype it was specialized from.
+	SmallVector<ValueType, 8> Types{ Proto->ReturnType };
+	Types.append(Proto->ArgTypes.begin(), Proto->ArgTypes.end());
+	emitSubprogram(F, Proto->Loc.Line, Types);
+}
+
+void ASTCodeGenVisitor::emitSubprogram(Function* F, unsigned Line, ArrayRef<ValueType> ValueTypes)
+{
+	if (!DBuilder || F->getSubprogram())
+		return;
+
+	SmallVector<Metadata*, 8> Types;
+	for (ValueType Type : ValueTypes)
+		Types.push_back(getDebugType(Type));
+
+	DIFile* Unit = DebugCU->getFile();
+	auto SPFlags = DISubprogram::SPFlagDefinition;
+	if (F->hasLocalLinkage())
+		SPFlags |= DISubprogram::SPFlagLocalToUnit;
+	DISubprogram* SP = DBuilder->createFunction(Unit, F->getName(), StringRef(), Unit, Line,
+		DBuilder->createSubroutineType(DBuilder->getOrCreateTypeArray(Types)), Line,
+		DINode::FlagPrototyped, SPFlags);
+	F->setSubprogram(SP);
+}
+
+void ASTCodeGenVisitor::emitLocation(const ExprAST* Expr)
+{
+	if (!DBuilder)
+		return;
+
+	// Outside of a function (there's no subprogram to put the location in) nothing is attributed.
+	Function* F = Builder->GetInsertBlock() ? Builder->GetInsertBlock()->getParent() : nullptr;
+	if (!F || !F->getSubprogram())
+		return;
+	Builder->SetCurrentDebugLocation(
+		DILocation::get(*TheContext, Expr->Loc.Line, Expr->Loc.Column, F->getSubprogram()));
+}
+
+Value* ASTCodeGenVisitor::convertValue(Value* V, ValueType To)
+{
+	return convertValue(V, getLLVMType(To));
+}
+
+Value* ASTCodeGenVisitor::convertValue(Value* V, Type* DestTy)
+{
+	Type* SrcTy = V->getType();
+	if (SrcTy == DestTy)
+		return V;
+
+	if (SrcTy->isPointerTy() || DestTy->isPointerTy()) {
+		LogError("Pointers can only be indexed or passed to arguments of the same pointer type");
+		return nullptr;
+	}
+
+	// Anything converts to bool by comparing against zero.
+	if (DestTy->isIntegerTy(1)) {
+		if (SrcTy->isFloatingPointTy())
+			return Builder->CreateFCmpONE(V, ConstantFP::get(SrcTy, 0.0), "tobool");
+		return Builder->CreateICmpNE(V, ConstantInt::get(SrcTy, 0), "tobool");
+	}
+
+	if (SrcTy->isFloatingPointTy() && DestTy->isFloatingPointTy())
+		return Builder->CreateFPCast(V, DestTy, "fpcast");
+
+	// Bools convert to 0/1, i64's are signed.
+	if (SrcTy->isIntegerTy() && DestTy->isFloatingPointTy()) {
+		if (SrcTy->isIntegerTy(1))
+			return Builder->CreateUIToFP(V, DestTy, "booltmp");
+		return Builder->CreateSIToFP(V, DestTy, "sitofp");
+	}
+
+	if (SrcTy->isIntegerTy() && DestTy->isIntegerTy())
+		return Builder->CreateZExt(V, DestTy, "zexttmp");
+
+	return Builder->CreateFPToSI(V, DestTy, "fptosi");
+}
+
 Value* ASTCodeGenVisitor::visit(NumberExprAST* NumberExpr)
 {
-	return ConstantFP::get(*TheContext, APFloat(NumberExpr->Val));
+	emitLocation(NumberExpr);
+	switch (NumberExpr->Type) {
+	case type_bool:
+		return ConstantInt::get(Type::getInt1Ty(*TheContext), NumberExpr->Val != 0);
+	case type_i64:
+		return ConstantInt::get(Type::getInt64Ty(*TheContext), (int64_t)NumberExpr->Val, true);
+	case type_f32:
+		return ConstantFP::get(Type::getFloatTy(*TheContext), NumberExpr->Val);
+	default:
+		return ConstantFP::get(*TheContext, APFloat(NumberExpr->Val));
+	}
 }
 
 Value* ASTCodeGenVisitor::visit(VariableExprAST* VariableExpr)
 {
+	emitLocation(VariableExpr);
+
 	// Look this variable up in the function.
 	Value* V = NamedValues[VariableExpr->Name];
 	if (!V)
@@ -56,25 +307,156 @@ Value* ASTCodeGenVisitor::visit(VariableExprAST* VariableExpr)
 	return V;
 }
 
+Value* ASTCodeGenVisitor::emitOperator(const string& Name, vector<Value*> OperandsV)
+{
+	// Operators are normally inlined, but one that is used within its own body (or whose definition failed
+	// to generate) is called like a regular function.
+	auto OI = OperatorDefinitions.find(Name);
+	if (OI == OperatorDefinitions.end() || InliningOperators.count(Name)) {
+		Function* OperatorF = getFunction(Name);
+		if (!OperatorF) {
+			LogError("Unknown operator");
+			return nullptr;
+		}
+
+		for (unsigned i = 0, e = OperandsV.size(); i != e; ++i) {
+			OperandsV[i] = convertValue(OperandsV[i], OperatorF->getFunctionType()->getParamType(i));
+			if (!OperandsV[i])
+				return nullptr;
+		}
+		return Builder->CreateCall(OperatorF, OperandsV, "optmp");
+	}
+
+	// Inline the body: generate it in place with its parameters bound to the operand values. The body was
+	// already type annotated when the operator was defined.
+	const PrototypeAST* Proto = OI->second->Proto;
+	map<string, Value*> CallerValues;
+	CallerValues.swap(NamedValues);
+	for (unsigned i = 0, e = OperandsV.size(); i != e; ++i) {
+		Value* OperandV = convertValue(OperandsV[i], Proto->ArgTypes[i]);
+		if (!OperandV) {
+			NamedValues.swap(CallerValues);
+			return nullptr;
+		}
+		NamedValues[Proto->Args[i]] = OperandV;
+	}
+
+	InliningOperators.insert(Name);
+	Value* Result = const_cast<ExprAST*>(OI->second->Body)->accept(this);
+	InliningOperators.erase(Name);
+	NamedValues.swap(CallerValues);
+
+	if (!Result)
+		return nullptr;
+	return convertValue(Result, Proto->ReturnType);
+}
+
+/**
+* Operator expressions are generated by emitOperatorTree, which keeps the ones whose operands are still being
+* generated on an explicit stack rather than recursing (see AST.h). Other expressions, the leaves of the tree, are
+* generated by their visit methods.
+*/
+
+Value* ASTCodeGenVisitor::visit(UnaryExprAST* UnaryExpr)
+{
+	return emitOperatorTree(UnaryExpr);
+}
+
 Value* ASTCodeGenVisitor::visit(BinaryExprAST* BinaryExpr)
 {
-	Value* L = const_cast<ExprAST*>(BinaryExpr->LHS)->accept(this);
-	Value* R = const_cast<ExprAST*>(BinaryExpr->RHS)->accept(this);
+	return emitOperatorTree(BinaryExpr);
+}
+
+Value* ASTCodeGenVisitor::emitOperatorTree(const ExprAST* Root)
+{
+	// An operator expression whose operands are being generated. Their values are at the top of Values.
+	struct PendingOperator {
+		const ExprAST* Expr;
+		string Name; // Of a user defined operator, empty for builtin ones.
+		const ExprAST* Operands[2];
+		unsigned NumOperands;
+		unsigned NextOperand;
+		DebugLoc OperatorLoc; // Restored after the operands moved it.
+	};
+	vector<PendingOperator> Pending;
+	vector<Value*> Values;
+
+	auto enter = [&](const ExprAST* Expr) {
+		PendingOperator P = { Expr, "", { nullptr, nullptr }, 0, 0, DebugLoc() };
+		if (auto UnaryExpr = Expr->asUnary()) {
+			P.Name = string("unary") + UnaryExpr->Opcode;
+			P.Operands[P.NumOperands++] = UnaryExpr->Operand;
+		}
+		else if (auto BinaryExpr = Expr->asBinary()) {
+			if (!isBuiltinBinaryOperator(BinaryExpr->Op))
+				P.Name = string("binary") + BinaryExpr->Op;
+			P.Operands[P.NumOperands++] = BinaryExpr->LHS;
+			P.Operands[P.NumOperands++] = BinaryExpr->RHS;
+		}
+		else {
+			Values.push_back(const_cast<ExprAST*>(Expr)->accept(this));
+			return;
+		}
+
+		emitLocation(Expr);
+		P.OperatorLoc = Builder->getCurrentDebugLocation();
+		Pending.push_back(move(P));
+	};
+
+	enter(Root);
+	while (!Pending.empty()) {
+		PendingOperator& P = Pending.back();
+
+		// User defined operators give up at the first operand that fails, builtin ones generate both.
+		bool Failed = P.NextOperand && !P.Name.empty() && !Values.back();
+		if (!Failed && P.NextOperand < P.NumOperands) {
+			enter(P.Operands[P.NextOperand++]);
+			continue;
+		}
+
+		vector<Value*> OperandsV(Values.end() - P.NextOperand, Values.end());
+		Values.resize(Values.size() - P.NextOperand);
+
+		Value* Result = nullptr;
+		if (!Failed && !P.Name.empty()) {
+			Builder->SetCurrentDebugLocation(P.OperatorLoc);
+			Result = emitOperator(P.Name, OperandsV);
+		}
+		else if (P.Name.empty() && OperandsV[0] && OperandsV[1])
+			Result = emitBinaryOperator(P.Expr->asBinary(), OperandsV[0], OperandsV[1]);
+
+		Pending.pop_back();
+		Values.push_back(Result);
+	}
+	return Values.back();
+}
+
+Value* ASTCodeGenVisitor::emitBinaryOperator(const BinaryExprAST* BinaryExpr, Value* L, Value* R)
+{
+	// The operands moved the location, the operation itself is at the operator.
+	emitLocation(BinaryExpr);
+
+	// Bring both sides to the operand type picked by type inference.
+	L = convertValue(L, BinaryExpr->OperandType);
+	R = convertValue(R, BinaryExpr->OperandType);
 	if (!L || !R)
 		return nullptr;
+	bool IsFloat = isFloatingPointType(BinaryExpr->OperandType) || BinaryExpr->OperandType == type_unknown;
 
 	switch (BinaryExpr->Op) {
 	case '+':
-		return Builder->CreateFAdd(L, R, "addtmp");
+		return IsFloat ? Builder->CreateFAdd(L, R, "addtmp") : Builder->CreateAdd(L, R, "addtmp");
 	case '-':
-		return Builder->CreateFSub(L, R, "subtmp");
+		return IsFloat ? Builder->CreateFSub(L, R, "subtmp") : Builder->CreateSub(L, R, "subtmp");
 	case '*':
-		return Builder->CreateFMul(L, R, "multmp");
+		return IsFloat ? Builder->CreateFMul(L, R, "multmp") : Builder->CreateMul(L, R, "multmp");
 	case '<':
-		L = Builder->CreateFCmpULT(L, R, "cmptmp");
-		// Convert bool 0/1 to double 0.0 or 1.0
-		return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext),
-			"booltmp");
+		// Comparisons produce an i1 (bool). It's converted to whatever type its user needs.
+		if (IsFloat)
+			return Builder->CreateFCmpULT(L, R, "cmptmp");
+		if (BinaryExpr->OperandType == type_bool)
+			return Builder->CreateICmpULT(L, R, "cmptmp");
+		return Builder->CreateICmpSLT(L, R, "cmptmp");
 	default:
 		LogError("invalid binary operator");
 		return nullptr;
@@ -83,8 +465,10 @@ Value* ASTCodeGenVisitor::visit(BinaryExprAST* BinaryExpr)
 
 Value* ASTCodeGenVisitor::visit(CallExprAST* CallExpr)
 {
-	// Look up the name in the global module table.
-	Function* CalleeF = getFunction(CallExpr->Callee);
+	emitLocation(CallExpr);
+
+	// Look up the name in the global module table. Builtins are overloaded on the type picked by type inference.
+	Function* CalleeF = getFunction(CallExpr->Callee, CallExpr->Type);
 	if (!CalleeF) {
 		LogError("Unknown function referenced");
 		return nullptr;
@@ -98,21 +482,504 @@ Value* ASTCodeGenVisitor::visit(CallExprAST* CallExpr)
 
 	vector<Value*> ArgsV;
 	for (unsigned i = 0, e = CallExpr->Args.size(); i != e; ++i) {
-		ArgsV.push_back(const_cast<ExprAST*>(CallExpr->Args[i])->accept(this));
+		Value* ArgV = const_cast<ExprAST*>(CallExpr->Args[i])->accept(this);
+		if (!ArgV)
+			return nullptr;
+		ArgsV.push_back(convertValue(ArgV, CalleeF->getFunctionType()->getParamType(i)));
 		if (!ArgsV.back())
 			return nullptr;
 	}
 
+	// Calls passing constants go to a copy of the callee specialized on them.
+	auto DI = FunctionDefinitions.find(CallExpr->Callee);
+	if (DI != FunctionDefinitions.end() && FunctionProtos[CallExpr->Callee] == DI->second->Proto) {
+		if (Function* Specialized = specializeCall(DI->second, ArgsV))
+			CalleeF = Specialized;
+	}
+
+	emitLocation(CallExpr);
 	return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
 }
 
+/**
+* Call-site specialization: formulas often call general helpers with literal arguments (e.g. "poly(x, 3, 0.5)"),
+* and the callee is compiled in a module of its own, where LLVM can't see the constants. So the callee's body is
+* generated again, into an internal function of the caller's module, with the constant parameters bound to their
+* values instead of arguments. That is the way user defined operators are inlined (emitOperator), and the body
+* keeps the types inferred when the callee was defined. The IRBuilder folds whatever the constants make constant,
+* calls in the body whose arguments became constants are specialized in turn, and the optimizer does the rest.
+*
+* The constants are the argument values after conversion to the parameter types, so a constant computed by the
+* caller (e.g. "f(2 * 3)") counts as much as a literal. A specialization is reused for every call in the module
+* with the same callee and constants, and a module stops specializing once its specializations add up to
+* MaxSpecializedInstructions instructions.
+*/
+
+static bool isConstantArgument(Value* V)
+{
+	return isa<ConstantFP>(V) || isa<ConstantInt>(V);
+}
+
+Function* ASTCodeGenVisitor::specializeCall(const FunctionAST* Callee, vector<Value*>& ArgsV)
+{
+	const PrototypeAST* Proto = Callee->Proto;
+	if (SpecializationBudget <= 0 || SpecializingFunctions.count(Proto->Name))
+		return nullptr;
+
+	// The cache key has the bits of every constant argument, and "-" for the others.
+	string Key = Proto->Name;
+	vector<Value*> Remaining;
+	for (Value* ArgV : ArgsV) {
+		Key += ',';
+		if (auto* C = dyn_cast<ConstantFP>(ArgV))
+			Key += utohexstr(C->getValueAPF().bitcastToAPInt().getZExtValue());
+		else if (auto* C = dyn_cast<ConstantInt>(ArgV))
+			Key += utohexstr(C->getZExtValue());
+		else {
+			Key += '-';
+			Remaining.push_back(ArgV);
+		}
+	}
+	if (Remaining.size() == ArgsV.size())
+		return nullptr;
+
+	Function* F = Specializations[Key];
+	if (!F) {
+		vector<Type*> ParamTypes;
+		for (Value* ArgV : Remaining)
+			ParamTypes.push_back(ArgV->getType());
+		F = Function::Create(FunctionType::get(getLLVMType(Proto->ReturnType), ParamTypes, false),
+			Function::InternalLinkage, Proto->Name + ".spec", TheModule);
+
+		// Bind the parameters: constants to their values, the others to the specialization's arguments.
+		map<string, Value*> CallerValues;
+		CallerValues.swap(NamedValues);
+		auto ArgI = F->arg_begin();
+		for (unsigned i = 0, e = ArgsV.size(); i != e; ++i) {
+			if (isConstantArgument(ArgsV[i])) {
+				NamedValues[Proto->Args[i]] = ArgsV[i];
+				continue;
+			}
+			ArgI->setName(Proto->Args[i]);
+			if (ArgI->getType()->isPointerTy())
+				addPointerAttributes(*ArgI);
+			NamedValues[Proto->Args[i]] = &*ArgI++;
+		}
+
+		IRBuilderBase::InsertPointGuard CallerPosition(*Builder);
+		Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "entry", F));
+		Builder->SetCurrentDebugLocation(DebugLoc());
+		emitSubprogram(F, Proto);
+
+		SpecializingFunctions.insert(Proto->Name);
+		Value* RetVal = const_cast<ExprAST*>(Callee->Body)->accept(this);
+		SpecializingFunctions.erase(Proto->Name);
+		if (RetVal)
+			RetVal = convertValue(RetVal, F->getReturnType());
+		NamedValues.swap(CallerValues);
+
+		// The callee compiled, so this is unlikely. The call goes to the callee itself then.
+		if (!RetVal) {
+			Builder->ClearInsertionPoint();
+			F->eraseFromParent();
+			Specializations.erase(Key);
+			return nullptr;
+		}
+
+		Builder->CreateRet(RetVal);
+		verifyFunction(*F);
+		if (!JIT.TheJIT->isTiered())
+			IROptimizer->optimize(F);
+
+		Specializations[Key] = F;
+		SpecializationBudget -= F->getInstructionCount();
+	}
+
+	ArgsV = move(Remaining);
+	return F;
+}
+
+/**
+* Fused kernels: formulas evaluated over the same rows would each be a pass over the input columns. A fused kernel,
+* void kernel(i8** Inputs, i8** Outputs, i64 Rows), makes one pass for all of them. Each row's inputs are loaded
+* once, the bodies of the formulas are generated in place with their parameters bound to the loaded values (the way
+* operators are inlined), and then all the results are stored. The formulas end up in the same block, so GVN
+* computes their common subexpressions once.
+*
+* Parameters are matched to input columns by name: fusing "def f(x y)" and "def g(y z)" reads the columns x, y and
+* z, in order of first appearance. An input column holds values of its parameter's type and output column j values
+* of formula j's return type. Pointer parameters have no column to come from, so those formulas can't be fused.
+*
+* Output columns must not overlap the input columns or each other. Every column gets an alias scope of its own, and
+* its loads or stores are marked as not aliasing the columns written, so LLVM knows a row's stores don't change the
+* inputs of the next row: it can keep the loop's loads ahead of its stores and vectorize it without runtime checks.
+*/
+
+Function* ASTCodeGenVisitor::emitFusedKernel(const string& Name, const vector<string>& Formulas,
+	vector<string>& InputColumns)
+{
+	if (FunctionProtos.count(Name) || getBuiltinFunction(Name) || FusedKernels.count(Name) ||
+		TheModule->getFunction(Name)) {
+		fprintf(stderr, "Error: %s is already defined\n", Name.c_str());
+		return nullptr;
+	}
+
+	// Collect the formulas' definitions and the columns they read.
+	vector<const FunctionAST*> Definitions;
+	vector<ValueType> InputTypes;
+	InputColumns.clear();
+	for (auto& Formula : Formulas) {
+		auto DI = FunctionDefinitions.find(Formula);
+		if (DI == FunctionDefinitions.end() || FunctionProtos[Formula] != DI->second->Proto) {
+			fprintf(stderr, "Error: %s is not a function defined here, it can't be fused\n", Formula.c_str());
+			return nullptr;
+		}
+
+		const PrototypeAST* Proto = DI->second->Proto;
+		for (unsigned i = 0, e = Proto->Args.size(); i != e; ++i) {
+			if (isPointerType(Proto->ArgTypes[i])) {
+				fprintf(stderr, "Error: %s has a pointer argument, it can't be fused\n", Formula.c_str());
+				return nullptr;
+			}
+
+			auto CI = find(InputColumns.begin(), InputColumns.end(), Proto->Args[i]);
+			if (CI == InputColumns.end()) {
+				InputColumns.push_back(Proto->Args[i]);
+				InputTypes.push_back(Proto->ArgTypes[i]);
+			}
+			else if (InputTypes[CI - InputColumns.begin()] != Proto->ArgTypes[i]) {
+				fprintf(stderr, "Error: the fused functions disagree on the type of %s\n", Proto->Args[i].c_str());
+				return nullptr;
+			}
+		}
+		Definitions.push_back(DI->second);
+	}
+
+	Type* Int8PtrPtrTy = PointerType::getUnqual(Type::getInt8PtrTy(*TheContext));
+	Type* Int64Ty = Type::getInt64Ty(*TheContext);
+	Function* F = Function::Create(
+		FunctionType::get(Type::getVoidTy(*TheContext), { Int8PtrPtrTy, Int8PtrPtrTy, Int64Ty }, false),
+		Function::ExternalLinkage, Name, TheModule);
+	auto ArgI = F->arg_begin();
+	Argument* InputsArg = &*ArgI++;
+	Argument* OutputsArg = &*ArgI++;
+	Argument* RowsArg = &*ArgI;
+	InputsArg->setName("inputs");
+	OutputsArg->setName("outputs");
+	RowsArg->setName("rows");
+	for (Argument* ColumnsArg : { InputsArg, OutputsArg }) {
+		ColumnsArg->addAttr(Attribute::NoAlias);
+		ColumnsArg->addAttr(Attribute::NoCapture);
+	}
+
+	IRBuilderBase::InsertPointGuard CallerPosition(*Builder);
+	BasicBlock* Entry = BasicBlock::Create(*TheContext, "entry", F);
+	BasicBlock* Loop = BasicBlock::Create(*TheContext, "loop", F);
+	BasicBlock* Exit = BasicBlock::Create(*TheContext, "exit", F);
+	Builder->SetInsertPoint(Entry);
+	Builder->SetCurrentDebugLocation(DebugLoc());
+
+	// The column pointers, typed after their values.
+	auto loadColumns = [&](Argument* ColumnsArg, ArrayRef<ValueType> Types, const char* ColumnName) {
+		vector<Value*> Columns;
+		for (unsigned i = 0, e = Types.size(); i != e; ++i) {
+			Value* Column = Builder->CreateLoad(Type::getInt8PtrTy(*TheContext),
+				Builder->CreateConstInBoundsGEP1_64(Type::getInt8PtrTy(*TheContext), ColumnsArg, i), ColumnName);
+			Columns.push_back(Builder->CreateBitCast(Column, PointerType::getUnqual(getLLVMType(Types[i])), ColumnName));
+		}
+		return Columns;
+	};
+	vector<ValueType> OutputTypes;
+	for (auto Definition : Definitions)
+		OutputTypes.push_back(Definition->Proto->ReturnType);
+	vector<Value*> InputPtrs = loadColumns(InputsArg, InputTypes, "input");
+	vector<Value*> OutputPtrs = loadColumns(OutputsArg, OutputTypes, "output");
+
+	// A scope per column. Loads don't alias any output column, stores no column but their own.
+	MDBuilder MDB(*TheContext);
+	MDNode* Domain = MDB.createAnonymousAliasScopeDomain(Name);
+	vector<Metadata*> InputScopes, OutputScopes;
+	for (auto& Column : InputColumns)
+		InputScopes.push_back(MDB.createAnonymousAliasScope(Domain, Column));
+	for (auto& Formula : Formulas)
+		OutputScopes.push_back(MDB.createAnonymousAliasScope(Domain, Formula));
+	auto setScopes = [&](Instruction* Access, Metadata* Scope, ArrayRef<Metadata*> NoAlias) {
+		Access->setMetadata(LLVMContext::MD_alias_scope, MDNode::get(*TheContext, Scope));
+		Access->setMetadata(LLVMContext::MD_noalias, MDNode::get(*TheContext, NoAlias));
+	};
+	Builder->CreateCondBr(Builder->CreateICmpSLT(ConstantInt::get(Int64Ty, 0), RowsArg, "nonempty"), Loop, Exit);
+
+	// loop: Row = phi [0, entry], [Row + 1, latch]
+	Builder->SetInsertPoint(Loop);
+	PHINode* Row = Builder->CreatePHI(Int64Ty, 2, "row");
+	Row->addIncoming(ConstantInt::get(Int64Ty, 0), Entry);
+
+	map<string, Value*> RowValues;
+	for (unsigned i = 0, e = InputColumns.size(); i != e; ++i) {
+		LoadInst* Load = Builder->CreateLoad(getLLVMType(InputTypes[i]),
+			Builder->CreateInBoundsGEP(getLLVMType(InputTypes[i]), InputPtrs[i], Row), InputColumns[i]);
+		setScopes(Load, InputScopes[i], OutputScopes);
+		RowValues[InputColumns[i]] = Load;
+	}
+
+	// Every formula sees the row values under its parameter names. The bodies keep the types inferred when
+	// the formulas were defined.
+	map<string, Value*> CallerValues;
+	CallerValues.swap(NamedValues);
+	vector<Value*> Results;
+	for (auto Definition : Definitions) {
+		NamedValues.clear();
+		for (auto& Arg : Definition->Proto->Args)
+			NamedValues[Arg] = RowValues[Arg];
+
+		Value* Result = const_cast<ExprAST*>(Definition->Body)->accept(this);
+		if (Result)
+			Result = convertValue(Result, Definition->Proto->ReturnType);
+		if (!Result)
+			break;
+		Results.push_back(Result);
+	}
+	NamedValues.swap(CallerValues);
+
+	if (Results.size() != Definitions.size()) {
+		Builder->ClearInsertionPoint();
+		F->eraseFromParent();
+		return nullptr;
+	}
+
+	for (unsigned i = 0, e = Results.size(); i != e; ++i) {
+		StoreInst* Store =
+			Builder->CreateStore(Results[i], Builder->CreateInBoundsGEP(getLLVMType(OutputTypes[i]), OutputPtrs[i], Row));
+		vector<Metadata*> Others(InputScopes);
+		for (unsigned j = 0; j != e; ++j)
+			if (j != i)
+				Others.push_back(OutputScopes[j]);
+		setScopes(Store, OutputScopes[i], Others);
+	}
+
+	Value* NextRow = Builder->CreateAdd(Row, ConstantInt::get(Int64Ty, 1), "nextrow");
+	Row->addIncoming(NextRow, Builder->GetInsertBlock());
+	Builder->CreateCondBr(Builder->CreateICmpSLT(NextRow, RowsArg, "loopcond"), Loop, Exit);
+
+	Builder->SetInsertPoint(Exit);
+	Builder->CreateRetVoid();
+
+	verifyFunction(*F);
+	if (!JIT.TheJIT->isTiered())
+		IROptimizer->optimize(F);
+
+	FusedKernels.insert(Name);
+	return F;
+}
+
+Value* ASTCodeGenVisitor::getElementAddress(const string& Name, const ExprAST* Index, ValueType ElementType)
+{
+	Value* Ptr = NamedValues[Name];
+	if (!Ptr) {
+		LogError("Unknown variable name");
+		return nullptr;
+	}
+	if (!Ptr->getType()->isPointerTy()) {
+		LogError("Only pointer arguments can be indexed");
+		return nullptr;
+	}
+
+	Value* IndexV = const_cast<ExprAST*>(Index)->accept(this);
+	if (!IndexV)
+		return nullptr;
+	IndexV = convertValue(IndexV, type_i64);
+	if (!IndexV)
+		return nullptr;
+
+	// The caller guarantees the index is within the buffer it passed in, so the GEP is inbounds, and since the
+	// argument points at the buffer's first element the index isn't negative. Saying so lets LLVM widen the index
+	// without sign extending it and compute its range, e.g. for loops whose counter is converted from a double.
+	if (!isa<ConstantInt>(IndexV))
+		Builder->CreateAssumption(Builder->CreateICmpSGE(IndexV, ConstantInt::get(IndexV->getType(), 0), "nonneg"));
+	return Builder->CreateInBoundsGEP(getLLVMType(ElementType), Ptr, IndexV, "elemptr");
+}
+
+void ASTCodeGenVisitor::addPointerAttributes(Argument& Arg)
+{
+	Arg.addAttr(Attribute::NoAlias);
+	Arg.addAttr(Attribute::NoCapture);
+
+	// A typed host buffer (e.g. a double*) is aligned for its elements.
+	Type* ElementTy = cast<PointerType>(Arg.getType())->getElementType();
+	Arg.addAttr(Attribute::getWithAlignment(*TheContext, TheModule->getDataLayout().getABITypeAlign(ElementTy)));
+}
+
+Value* ASTCodeGenVisitor::visit(IndexExprAST* IndexExpr)
+{
+	emitLocation(IndexExpr);
+	Value* Addr = getElementAddress(IndexExpr->Name, IndexExpr->Index, IndexExpr->Type);
+	if (!Addr)
+		return nullptr;
+
+	emitLocation(IndexExpr);
+
+	return Builder->CreateLoad(getLLVMType(IndexExpr->Type), Addr, "elemtmp");
+}
+
+Value* ASTCodeGenVisitor::visit(IndexAssignExprAST* IndexAssignExpr)
+{
+	emitLocation(IndexAssignExpr);
+	Value* Addr = getElementAddress(IndexAssignExpr->Name, IndexAssignExpr->Index, IndexAssignExpr->Type);
+	if (!Addr)
+		return nullptr;
+
+	Value* Val = const_cast<ExprAST*>(IndexAssignExpr->Val)->accept(this);
+	if (!Val)
+		return nullptr;
+	Val = convertValue(Val, IndexAssignExpr->Type);
+	if (!Val)
+		return nullptr;
+
+	emitLocation(IndexAssignExpr);
+
+	Builder->CreateStore(Val, Addr);
+	return Val;
+}
+
+/**
+* A parallel loop's body is outlined into a chunk function, double chunk(i8* env, i64 begin, i64 end), that runs
+* the iterations [begin, end) in order and returns the sum of the body's values (0 for a parallelfor). The body
+* can use every value in scope where the loop is (arguments, and the parameters of inlined operators and
+* specializations), so all of them are stored into an environment struct on the caller's stack, which the chunk
+* function loads them from. The optimizer drops the loads of what the body doesn't use. The parallel runtime
+* runs the chunk function over the loop's range on all cores (see ParallelRuntime.h).
+*/
+
+Value* ASTCodeGenVisitor::visit(ParallelExprAST* ParallelExpr)
+{
+	emitLocation(ParallelExpr);
+	Value* StartV = const_cast<ExprAST*>(ParallelExpr->Start)->accept(this);
+	Value* EndV = StartV ? const_cast<ExprAST*>(ParallelExpr->End)->accept(this) : nullptr;
+	if (StartV)
+		StartV = convertValue(StartV, type_i64);
+	if (EndV)
+		EndV = convertValue(EndV, type_i64);
+	if (!StartV || !EndV)
+		return nullptr;
+
+	// The loop variable hides a value of the same name. Unknown variables looked up before are left out.
+	vector<pair<string, Value*>> Captured;
+	vector<Type*> CapturedTypes;
+	for (auto& Named : NamedValues) {
+		if (!Named.second || Named.first == ParallelExpr->VarName)
+			continue;
+		Captured.push_back(Named);
+		CapturedTypes.push_back(Named.second->getType());
+	}
+	StructType* EnvTy = StructType::get(*TheContext, CapturedTypes);
+
+	Function* ChunkF = emitParallelChunk(ParallelExpr, Captured, EnvTy);
+	if (!ChunkF)
+		return nullptr;
+
+	// The environment is allocated in the entry block, a loop in a chunk function reuses it for every iteration.
+	Function* TheFunction = Builder->GetInsertBlock()->getParent();
+	IRBuilder<> EntryBuilder(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
+	AllocaInst* Env = EntryBuilder.CreateAlloca(EnvTy, nullptr, "parallel.env");
+
+	emitLocation(ParallelExpr);
+	for (unsigned i = 0, e = Captured.size(); i != e; ++i)
+		Builder->CreateStore(Captured[i].second, Builder->CreateStructGEP(EnvTy, Env, i));
+
+	Type* Int8PtrTy = Type::getInt8PtrTy(*TheContext);
+	Type* Int64Ty = Type::getInt64Ty(*TheContext);
+	FunctionCallee RunLoop = TheModule->getOrInsertFunction("__kaleidoscope_parallel",
+		FunctionType::get(Type::getDoubleTy(*TheContext), { Int8PtrTy, Int8PtrTy, Int64Ty, Int64Ty }, false));
+	return Builder->CreateCall(RunLoop, { Builder->CreateBitCast(ChunkF, Int8PtrTy),
+		Builder->CreateBitCast(Env, Int8PtrTy), StartV, EndV }, "paralleltmp");
+}
+
+Function* ASTCodeGenVisitor::emitParallelChunk(ParallelExprAST* ParallelExpr,
+	const vector<pair<string, Value*>>& Captured, StructType* EnvTy)
+{
+	Type* DoubleTy = Type::getDoubleTy(*TheContext);
+	Type* Int64Ty = Type::getInt64Ty(*TheContext);
+	Function* Caller = Builder->GetInsertBlock()->getParent();
+	Function* ChunkF = Function::Create(
+		FunctionType::get(DoubleTy, { Type::getInt8PtrTy(*TheContext), Int64Ty, Int64Ty }, false),
+		Function::InternalLinkage, Caller->getName() + ".parallel", TheModule);
+	auto ArgI = ChunkF->arg_begin();
+	Argument* EnvArg = &*ArgI++;
+	Argument* BeginArg = &*ArgI++;
+	Argument* EndArg = &*ArgI;
+	EnvArg->setName("env");
+	BeginArg->setName("begin");
+	EndArg->setName("end");
+
+	IRBuilderBase::InsertPointGuard CallerPosition(*Builder);
+	BasicBlock* Entry = BasicBlock::Create(*TheContext, "entry", ChunkF);
+	BasicBlock* Loop = BasicBlock::Create(*TheContext, "loop", ChunkF);
+	BasicBlock* Exit = BasicBlock::Create(*TheContext, "exit", ChunkF);
+	Builder->SetInsertPoint(Entry);
+	Builder->SetCurrentDebugLocation(DebugLoc());
+	emitSubprogram(ChunkF, ParallelExpr->Loc.Line, { type_f64, type_bool_ptr, type_i64, type_i64 }); // env as a byte*
+
+	// Load the captured values.
+	map<string, Value*> CallerValues;
+	CallerValues.swap(NamedValues);
+	Value* Env = Builder->CreateBitCast(EnvArg, PointerType::getUnqual(EnvTy), "env");
+	for (unsigned i = 0, e = Captured.size(); i != e; ++i)
+		NamedValues[Captured[i].first] = Builder->CreateLoad(Captured[i].second->getType(),
+			Builder->CreateStructGEP(EnvTy, Env, i), Captured[i].first);
+	Builder->CreateCondBr(Builder->CreateICmpSLT(BeginArg, EndArg, "nonempty"), Loop, Exit);
+
+	// loop: Var = phi [begin, entry], [Var + 1, latch]; Sum = phi [0, entry], [Sum + Body, latch]
+	// The body sees the counter as a double.
+	Builder->SetInsertPoint(Loop);
+	PHINode* Var = Builder->CreatePHI(Int64Ty, 2, "counter");
+	PHINode* Sum = Builder->CreatePHI(DoubleTy, 2, "sum");
+	Var->addIncoming(BeginArg, Entry);
+	Sum->addIncoming(ConstantFP::get(DoubleTy, 0.0), Entry);
+	NamedValues[ParallelExpr->VarName] = Builder->CreateSIToFP(Var, DoubleTy, ParallelExpr->VarName);
+
+	Value* BodyV = const_cast<ExprAST*>(ParallelExpr->Body)->accept(this);
+	if (BodyV && ParallelExpr->Kind == ParallelExprAST::parallel_sum)
+		BodyV = convertValue(BodyV, DoubleTy);
+	NamedValues.swap(CallerValues);
+	if (!BodyV) {
+		Builder->ClearInsertionPoint();
+		ChunkF->eraseFromParent();
+		return nullptr;
+	}
+
+	Value* NextSum = Sum;
+	if (ParallelExpr->Kind == ParallelExprAST::parallel_sum)
+		NextSum = Builder->CreateFAdd(Sum, BodyV, "nextsum");
+	Value* NextVar = Builder->CreateAdd(Var, ConstantInt::get(Int64Ty, 1), "nextvar");
+	BasicBlock* Latch = Builder->GetInsertBlock();
+	Var->addIncoming(NextVar, Latch);
+	Sum->addIncoming(NextSum, Latch);
+	Builder->CreateCondBr(Builder->CreateICmpSLT(NextVar, EndArg, "loopcond"), Loop, Exit);
+
+	Builder->SetInsertPoint(Exit);
+	PHINode* Result = Builder->CreatePHI(DoubleTy, 2, "result");
+	Result->addIncoming(ConstantFP::get(DoubleTy, 0.0), Entry);
+	Result->addIncoming(NextSum, Latch);
+	Builder->CreateRet(Result);
+
+	verifyFunction(*ChunkF);
+	if (!JIT.TheJIT->isTiered())
+		IROptimizer->optimize(ChunkF);
+	return ChunkF;
+}
+
 Value* ASTCodeGenVisitor::visit(PrototypeAST* ProtypeExpr)
 {
-	// Make the function type:  double(double,double) etc.
-	vector<Type*> Doubles(ProtypeExpr->Args.size(),
-		Type::getDoubleTy(*TheContext));
+	// An extern of a builtin math function (e.g. "extern sin(x)") declares the intrinsic instead.
+	if (getBuiltinFunction(ProtypeExpr->Name))
+		return getFunction(ProtypeExpr->Name, ProtypeExpr->ReturnType == type_f32 ? type_f32 : type_f64);
+
+	// Make the function type from the annotated (or inferred) types: e.g. float(float,i64).
+	vector<Type*> ArgTypes;
+	for (ValueType ArgType : ProtypeExpr->ArgTypes)
+		ArgTypes.push_back(getLLVMType(ArgType));
 	FunctionType* FT =
-		FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
+		FunctionType::get(getLLVMType(ProtypeExpr->ReturnType), ArgTypes, false);
 
 	Function* F =
 		Function::Create(FT, Function::ExternalLinkage, ProtypeExpr->Name, TheModule);
@@ -122,15 +989,34 @@ Value* ASTCodeGenVisitor::visit(PrototypeAST* ProtypeExpr)
 	for (auto& Arg : F->args())
 		Arg.setName(ProtypeExpr->Args[Idx++]);
 
+	// Pointer arguments are host buffers. Each one is assumed not to overlap any other pointer argument
+	// (like C's restrict), is never captured and is aligned for its elements, which lets LLVM keep loads in
+	// registers across stores and vectorize loops over them. Buffers don't carry their length, so nothing says
+	// how many bytes are dereferenceable: a function may be handed an empty buffer it never indexes.
+	for (auto& Arg : F->args()) {
+		if (Arg.getType()->isPointerTy())
+			addPointerAttributes(Arg);
+	}
+
 	return F;
 }
 
 Value* ASTCodeGenVisitor::visit(FunctionAST* FunctionExpr)
 {
+	if (getBuiltinFunction(FunctionExpr->Proto->Name)) {
+		LogError("Builtin math functions can't be redefined");
+		return nullptr;
+	}
+
 	// Transfer ownership of the prototype to the FunctionProtos map, but keep a
 	// reference to it for use below.
 	auto& P = FunctionExpr->Proto;
 	FunctionProtos[FunctionExpr->Proto->Name] = FunctionExpr->Proto;
+
+	// Annotate the body with types (and infer the return type if it wasn't given) before generating code.
+	ASTTypeInferenceVisitor TypeInference(FunctionProtos);
+	FunctionExpr->accept(&TypeInference);
+
 	Function* TheFunction = getFunction(FunctionExpr->Proto->Name);
 	if (!TheFunction)
 		return nullptr;
@@ -139,25 +1025,41 @@ Value* ASTCodeGenVisitor::visit(FunctionAST* FunctionExpr)
 	BasicBlock* BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
 	Builder->SetInsertPoint(BB);
 
+	// With debug info the function gets a subprogram, which the expressions' locations are scoped to.
+	Builder->SetCurrentDebugLocation(DebugLoc());
+	emitSubprogram(TheFunction, P);
+
 	// Record the function arguments in the NamedValues map.
 	NamedValues.clear();
 	for (auto& Arg : TheFunction->args())
 		NamedValues[string(Arg.getName())] = &Arg;
 
-	if (Value* RetVal = const_cast<ExprAST*>(FunctionExpr->Body)->accept(this)) {
+	Value* RetVal = const_cast<ExprAST*>(FunctionExpr->Body)->accept(this);
+	if (RetVal)
+		RetVal = convertValue(RetVal, TheFunction->getReturnType());
+
+	if (RetVal) {
 		// Finish off the function.
 		Builder->CreateRet(RetVal);
 
 		// Validate the generated code, checking for consistency.
 		verifyFunction(*TheFunction);
 
-		// Optimize the function.
-		IROptimizer->optimize(TheFunction);
+		// Optimize the function, unless the JIT does it once the function is hot.
+		if (!JIT.TheJIT->isTiered())
+			IROptimizer->optimize(TheFunction);
+
+		// The AST is also kept so later uses of operators can be inlined, and calls specialized.
+		if (P->IsOperator)
+			OperatorDefinitions[P->Name] = FunctionExpr;
+		else
+			FunctionDefinitions[P->Name] = FunctionExpr;
 
 		return TheFunction;
 	}
 
 	// Error reading body, remove function.
+	Builder->SetCurrentDebugLocation(DebugLoc());
 	TheFunction->eraseFromParent();
 	return nullptr;
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DIBuilder.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
@@ -11,9 +12,14 @@
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/Support/Error.h"
+#include <set>
 #include "AST.h"
+#include "Builtins.h"
+#include "TypeInference.h"
 #include "Optimizer.h"
 #include "JITRuntimeWrapper.h"
+#include "Library.h"
+#include "ExecutorPool.h"
 
 /**
 * Changes made by justice: We use a visitor pattern for code generation as opposed to an overridden abstract method.
@@ -25,10 +31,18 @@
 
 using namespace llvm;
 
+/// FusedKernel - The native signature of a fused kernel (see ASTCodeGenVisitor::emitFusedKernel). Inputs and
+/// Outputs point to one column (an array of Rows values) per input and per formula. Output columns must not overlap
+/// any other column.
+typedef void FusedKernel(void* const* Inputs, void* const* Outputs, int64_t Rows);
+
 class ASTCodeGenVisitor : public ExprASTVisitor<Value*>
 {
 public:
-	ASTCodeGenVisitor();
+	ASTCodeGenVisitor(const orc::KaleidoscopeJITOptions& JITOptions = {});
+
+	// A code generator adding its code through an existing JIT, e.g. into a session (see SessionManager.h).
+	ASTCodeGenVisitor(const JITRuntimeWrapper& JIT);
 
 	// Publicly needed CodeGen elements for JIT execution
 	LLVMContext* TheContext;
@@ -36,31 +50,146 @@ public:
 	JITRuntimeWrapper JIT;
 	map<string, const PrototypeAST*> FunctionProtos;
 
+	// When set, modules are sent to these executor processes instead of being added to the JIT (see
+	// ExecutorPool.h).
+	ExecutorPool* Executors = nullptr;
+
 	Value* visit(NumberExprAST* NumberExpr);
 	Value* visit(VariableExprAST* VariableExpr);
+	Value* visit(UnaryExprAST* UnaryExpr);
 	Value* visit(BinaryExprAST* BinaryExprAST);
 	Value* visit(CallExprAST* CallExprAST);
+	Value* visit(IndexExprAST* IndexExpr);
+	Value* visit(IndexAssignExprAST* IndexAssignExpr);
+	Value* visit(ParallelExprAST* ParallelExpr);
 	Value* visit(PrototypeAST* PrototypeAST);
 	Value* visit(FunctionAST* FunctionAST);
 
 	// public function for reinitializing a new module for JIT'ing (needed by the parser)
 	void InitializeModuleAndPassManager();
 
+	// Emits DWARF line info (attributed to SourceFileName) in all modules from here on, so profilers can map
+	// JIT'd code back to source lines. The current module is started over, so call it before generating code.
+	void enableDebugInfo(const string& SourceFileName);
+
+	// Finishes the current module's debug info. Must be called before the module leaves the code generator,
+	// AddModuleToJIT and writeLibrary do so themselves.
+	void finalizeDebugInfo();
+
+	// Hands the current module over to the JIT (tracked by RT, or JIT.RT) and starts a new one.
+	void AddModuleToJIT(orc::ResourceTrackerSP RT = nullptr);
+
+	// Throws the current module away (after it has been sent elsewhere) and starts a new one.
+	void DiscardModule();
+
+	// Hands the current module out, with its context and debug info finished, and starts a new one.
+	orc::ThreadSafeModule takeModule();
+
+	// Drops everything known about a function (its prototype, and its definition if it's an operator) so the
+	// AST it came from can be freed.
+	void forgetFunction(const string& Name);
+
+	// The AST of a function or operator defined by the code generator, null for externs and imported functions.
+	const FunctionAST* getDefinition(const string& Name) const;
+
+	// Makes the functions of a precompiled library available (see Library.h). Only their prototypes are
+	// registered, the code is compiled lazily when they're first called. Returns null (after logging) on error.
+	const CompiledLibrary* importLibrary(const string& FileName);
+
+	// Optimizes the current module and writes it as a precompiled library exporting the given functions.
+	bool writeLibrary(const string& FileName, const vector<const PrototypeAST*>& Prototypes);
+
+	// Generates a kernel, Name, into the current module that evaluates the functions named in Formulas over
+	// every row of a set of input columns in a single pass (see IRCodeGen.cpp). InputColumns is set to the
+	// parameter names in the order the kernel takes their columns. Returns null (after logging) on error.
+	Function* emitFusedKernel(const string& Name, const vector<string>& Formulas, vector<string>& InputColumns);
+
 	// public method for pretty-printing code-gen
 	void PrintIR(); 
 
-	// public function for keeping track of Prototypes across IR modules.
-	Function* getFunction(string Name);
+	// public function for keeping track of Prototypes across IR modules. Builtin math functions resolve to
+	// the LLVM intrinsic overloaded on OverloadType (see Builtins.h).
+	Function* getFunction(string Name, ValueType OverloadType = type_f64);
 
 	~ASTCodeGenVisitor() {
-		delete TheContext;
-		delete TheModule;
-		delete Builder;
+		delete DBuilder;
 		delete IROptimizer;
+		delete Builder;
+		// The module belongs to the context, so goes first.
+		delete TheModule;
+		delete TheContext;
 	}
 
 private:
 	IRBuilder<>* Builder;
 	Optimizer* IROptimizer;
 	map<string, Value*> NamedValues;
+
+	// Debug info for the current module, only when enabled. DebugSourceFile is empty otherwise.
+	string DebugSourceFile;
+	DIBuilder* DBuilder = nullptr;
+	DICompileUnit* DebugCU = nullptr;
+
+	// Imported libraries. They own the prototypes registered in FunctionProtos.
+	vector<unique_ptr<CompiledLibrary>> Libraries;
+
+	// Definitions of user defined operators by prototype name ("binary|"), for inlining at their use sites.
+	// Operators whose bodies are currently being inlined are tracked so recursive operators become calls.
+	map<string, const FunctionAST*> OperatorDefinitions;
+	set<string> InliningOperators;
+
+	// Definitions of the other functions by name, for specializing calls that pass constants (see
+	// specializeCall). The specializations in the current module are cached by callee and constant arguments.
+	// The functions being specialized are tracked so recursion ends in a call, and the instructions that
+	// specializations may still add to the module bound its growth.
+	map<string, const FunctionAST*> FunctionDefinitions;
+	map<string, Function*> Specializations;
+	set<string> SpecializingFunctions;
+	int SpecializationBudget = 0;
+
+	// Names of the fused kernels generated so far. Kernels have no prototype, the host calls them.
+	set<string> FusedKernels;
+
+	// Returns a copy of Callee specialized on the arguments of ArgsV that are constants, which are removed from
+	// ArgsV. Returns null (and leaves ArgsV alone) when none are, or the module has no budget left for it.
+	Function* specializeCall(const FunctionAST* Callee, vector<Value*>& ArgsV);
+
+	// Emits a tree of operator expressions, with an explicit stack (see AST.h).
+	Value* emitOperatorTree(const ExprAST* Root);
+
+	// Emits a user defined operator applied to the values of its operands, inlined where possible.
+	Value* emitOperator(const string& Name, vector<Value*> OperandsV);
+
+	// Emits a builtin binary operator applied to the values of its operands.
+	Value* emitBinaryOperator(const BinaryExprAST* BinaryExpr, Value* L, Value* R);
+
+	// Maps a Kaleidoscope value type onto its LLVM type. Unknown types are treated as double.
+	Type* getLLVMType(ValueType ValType);
+
+	// Emits the conversion of a value to another type (no-op if it already has that type).
+	// Returns null (after logging) for conversions between pointers and scalars.
+	Value* convertValue(Value* V, Type* DestTy);
+	Value* convertValue(Value* V, ValueType To);
+
+	// Debug info type for a Kaleidoscope value type.
+	DIType* getDebugType(ValueType ValType);
+
+	// Gives F a debug info subprogram for Proto (or a function at Line with the given return and argument
+	// types), if debug info is enabled and it doesn't have one yet.
+	void emitSubprogram(Function* F, const PrototypeAST* Proto);
+	void emitSubprogram(Function* F, unsigned Line, ArrayRef<ValueType> Types);
+
+	// Outlines the body of a parallel loop into a chunk function for the parallel runtime (see
+	// ParallelRuntime.h), taking the values in Captured from an environment struct of type EnvTy.
+	Function* emitParallelChunk(ParallelExprAST* ParallelExpr, const vector<pair<string, Value*>>& Captured,
+		StructType* EnvTy);
+
+	// Attributes the instructions emitted from here on to where Expr starts in the source.
+	void emitLocation(const ExprAST* Expr);
+
+	// Emits the address of Name[Index] for the indexed load/store expressions.
+	Value* getElementAddress(const string& Name, const ExprAST* Index, ValueType ElementType);
+
+	// Marks a pointer argument with what the language guarantees about host buffers (see visit(PrototypeAST*)).
+	void addPointerAttributes(Argument& Arg);
 };
\ No newline at end of file
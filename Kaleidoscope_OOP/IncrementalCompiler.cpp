@@ -0,0 +1,349 @@
+#include "stdafx.h"
+#include <functional>
+#include "IncrementalCompiler.h"
+#include "CalleeCollector.h"
+#include "llvm/Support/xxhash.h"
+
+vector<StringRef> IncrementalCompiler::splitTopLevelChunks(const string& Source)
+{
+	vector<StringRef> Chunks;
+	Lexer Scanner(Source);
+
+	// 'def', 'extern' and 'import' can't appear inside an expression, so they always start a new top-level item.
+	// A ';' ends one.
+	size_t ChunkStart = 0;
+	bool AfterSemicolon = false;
+	for (Token Tok = Scanner.getToken(); Tok.getType() != tok_eof; Tok = Scanner.getToken()) {
+		size_t Start = Scanner.getTokenStart();
+		bool Boundary = AfterSemicolon || Tok.getType() == tok_def || Tok.getType() == tok_extern ||
+			Tok.getType() == tok_import;
+		if (Boundary && Start > ChunkStart) {
+			Chunks.push_back(StringRef(Source).slice(ChunkStart, Start));
+			ChunkStart = Start;
+		}
+		AfterSemicolon = Tok.getType() == tok_char && Tok.getNumValue() == ';';
+	}
+
+	if (ChunkStart < Source.size())
+		Chunks.push_back(StringRef(Source).substr(ChunkStart));
+	return Chunks;
+}
+
+void IncrementalCompiler::parseChunk(StringRef Chunk, size_t ChunkIndex, unsigned FirstLine,
+	vector<SourceItem>& Items)
+{
+	Parser& P = TheParser;
+	P.Scanner = Lexer(Chunk.str(), FirstLine);
+	P.getNextToken();
+
+	while (P.CurTok.getType() != tok_eof) {
+		// ignore top-level semicolons.
+		if (P.CurTok.getType() == tok_char && P.CurTok.getNumValue() == ';') {
+			P.getNextToken();
+			continue;
+		}
+
+		// Imports take effect right away and stay in effect (importing a library again does nothing).
+		if (P.CurTok.getType() == tok_import) {
+			P.HandleImport();
+			continue;
+		}
+
+		size_t Start = P.Scanner.getTokenStart();
+		SourceItem Item;
+		Item.Chunk = ChunkIndex;
+		switch (P.CurTok.getType()) {
+		case tok_def:
+			Item.Info.Kind = item_definition;
+			Item.Function = P.ParseDefinition();
+			break;
+		case tok_extern:
+			Item.Info.Kind = item_extern;
+			Item.Extern = P.ParseExtern();
+			break;
+		default:
+			Item.Info.Kind = item_expression;
+			Item.Function = P.ParseTopLevelExpr();
+			break;
+		}
+
+		if (!Item.Function && !Item.Extern) {
+			// Skip token for error recovery.
+			P.getNextToken();
+			continue;
+		}
+
+		// Items are identified by the hash of their own text, so edits elsewhere in the chunk don't touch them.
+		Item.Info.Hash = xxHash64(Chunk.slice(Start, P.PrevTokEnd));
+		if (Item.Extern) {
+			Item.Info.Name = Item.Extern->Name;
+		}
+		else {
+			Item.Info.Name = Item.Function->Proto->Name;
+
+			CalleeCollector Collector;
+			const_cast<FunctionAST*>(Item.Function)->accept(&Collector);
+			Item.Info.Callees = move(Collector.Callees);
+		}
+		Items.push_back(move(Item));
+	}
+}
+
+void IncrementalCompiler::deleteItem(SourceItem& Item)
+{
+	delete Item.Function;
+	delete Item.Extern;
+	Item.Function = nullptr;
+	Item.Extern = nullptr;
+}
+
+void IncrementalCompiler::update(const string& Source)
+{
+	ASTCodeGenVisitor* CodeGen = TheParser.CodeGenVisitor;
+
+	// Find the items of the new source. Chunks that were in the last version aren't parsed, their items are
+	// known already.
+	vector<StringRef> Chunks = splitTopLevelChunks(Source);
+	vector<unsigned> ChunkLines;
+	vector<uint64_t> ChunkHashes;
+	vector<bool> ChunkParsed(Chunks.size(), false);
+	vector<SourceItem> Items;
+	for (size_t i = 0, e = Chunks.size(); i != e; ++i) {
+		ChunkLines.push_back(i ? ChunkLines[i - 1] + (unsigned)Chunks[i - 1].count('\n') : 1);
+		ChunkHashes.push_back(xxHash64(Chunks[i]));
+
+		auto CI = ChunkItems.find(ChunkHashes[i]);
+		if (CI == ChunkItems.end()) {
+			parseChunk(Chunks[i], i, ChunkLines[i], Items);
+			ChunkParsed[i] = true;
+			continue;
+		}
+
+		for (auto& Info : CI->second) {
+			SourceItem Item;
+			Item.Info = Info;
+			Item.Chunk = i;
+			Items.push_back(move(Item));
+		}
+	}
+
+	// The last item with a given name is the one that counts, like in the REPL.
+	map<string, SourceItem*> NewDefinitions, NewExterns;
+	for (auto& Item : Items) {
+		if (Item.Info.Kind == item_definition)
+			NewDefinitions[Item.Info.Name] = &Item;
+		else if (Item.Info.Kind == item_extern)
+			NewExterns[Item.Info.Name] = &Item;
+	}
+
+	// Definitions and externs that were added, edited or removed.
+	set<string> Changed;
+	for (auto& ND : NewDefinitions) {
+		auto DI = Definitions.find(ND.first);
+		if (DI == Definitions.end() || DI->second.Hash != ND.second->Info.Hash)
+			Changed.insert(ND.first);
+	}
+	for (auto& D : Definitions)
+		if (!NewDefinitions.count(D.first))
+			Changed.insert(D.first);
+	for (auto& NE : NewExterns) {
+		auto EI = Externs.find(NE.first);
+		if (EI == Externs.end() || EI->second.Hash != NE.second->Info.Hash)
+			Changed.insert(NE.first);
+	}
+	for (auto& E : Externs)
+		if (!NewExterns.count(E.first))
+			Changed.insert(E.first);
+
+	// Every definition that calls something changed, directly or through other definitions, is dirty too.
+	map<string, vector<string>> Callers;
+	for (auto& ND : NewDefinitions)
+		for (auto& Callee : ND.second->Info.Callees)
+			Callers[Callee].push_back(ND.first);
+
+	set<string> Dirty = Changed;
+	vector<string> Worklist(Changed.begin(), Changed.end());
+	while (!Worklist.empty()) {
+		string Name = Worklist.back();
+		Worklist.pop_back();
+		for (auto& Caller : Callers[Name])
+			if (Dirty.insert(Caller).second)
+				Worklist.push_back(Caller);
+	}
+
+	auto NeedsEvaluation = [&](const ItemInfo& Info) {
+		if (!Expressions.count(Info.Hash))
+			return true;
+		for (auto& Callee : Info.Callees)
+			if (Dirty.count(Callee))
+				return true;
+		return false;
+	};
+
+	// Chunks that weren't parsed but hold something to compile or evaluate have to be parsed after all. This
+	// only happens for expressions calling dirty definitions, and for duplicate definitions.
+	set<size_t> Reparse;
+	for (auto& Item : Items) {
+		if (ChunkParsed[Item.Chunk])
+			continue;
+		if (Item.Info.Kind == item_expression && NeedsEvaluation(Item.Info))
+			Reparse.insert(Item.Chunk);
+		if (Item.Info.Kind != item_expression && Changed.count(Item.Info.Name))
+			Reparse.insert(Item.Chunk);
+	}
+	for (size_t Chunk : Reparse) {
+		vector<SourceItem> Parsed;
+		parseChunk(Chunks[Chunk], Chunk, ChunkLines[Chunk], Parsed);
+
+		// The chunk's text is unchanged, so it parses to the same items as last time.
+		size_t Next = 0;
+		for (auto& Item : Items) {
+			if (Item.Chunk != Chunk || Next == Parsed.size())
+				continue;
+			Item.Function = Parsed[Next].Function;
+			Item.Extern = Parsed[Next].Extern;
+			Parsed[Next].Function = nullptr;
+			Parsed[Next].Extern = nullptr;
+			++Next;
+		}
+		for (auto& Item : Parsed)
+			deleteItem(Item);
+	}
+
+	// Take the dirty definitions out of the JIT, and forget about the ones that are gone from the source.
+	for (auto& Name : Dirty) {
+		auto DI = Definitions.find(Name);
+		if (DI != Definitions.end() && DI->second.RT)
+			CodeGen->JIT.ExitOnError(DI->second.RT->remove());
+	}
+	for (auto DI = Definitions.begin(); DI != Definitions.end();) {
+		if (NewDefinitions.count(DI->first)) {
+			++DI;
+			continue;
+		}
+		CodeGen->forgetFunction(DI->first);
+		delete DI->second.AST;
+		DI = Definitions.erase(DI);
+	}
+	for (auto EI = Externs.begin(); EI != Externs.end();) {
+		if (NewExterns.count(EI->first)) {
+			++EI;
+			continue;
+		}
+		CodeGen->forgetFunction(EI->first);
+		delete EI->second.AST;
+		EI = Externs.erase(EI);
+	}
+
+	// Declare new and edited externs.
+	for (auto& NE : NewExterns) {
+		const PrototypeAST* Extern = NE.second->Extern;
+		if (!Changed.count(NE.first) || !Extern || !const_cast<PrototypeAST*>(Extern)->accept(CodeGen))
+			continue;
+
+		// FunctionProtos owns the prototype from here on.
+		CodeGen->FunctionProtos[NE.first] = Extern;
+		auto EI = Externs.find(NE.first);
+		if (EI != Externs.end())
+			delete EI->second.AST;
+		Externs[NE.first] = { NE.second->Info.Hash, Extern };
+		NE.second->Extern = nullptr;
+	}
+
+	// Compile the dirty definitions callees first, so the return types of the callees are known (if they are
+	// inferred) when their callers are generated. Mutually recursive definitions are compiled in source order.
+	vector<SourceItem*> Order;
+	set<string> Ordered;
+	function<void(SourceItem*)> OrderDefinition = [&](SourceItem* Item) {
+		if (!Ordered.insert(Item->Info.Name).second)
+			return;
+		for (auto& Callee : Item->Info.Callees) {
+			auto ND = NewDefinitions.find(Callee);
+			if (ND != NewDefinitions.end() && Dirty.count(Callee))
+				OrderDefinition(ND->second);
+		}
+		Order.push_back(Item);
+	};
+	for (auto& Item : Items)
+		if (Item.Info.Kind == item_definition && NewDefinitions[Item.Info.Name] == &Item && Dirty.count(Item.Info.Name))
+			OrderDefinition(&Item);
+
+	// Swap the ASTs of edited definitions in first, so every caller sees the new prototypes. The old ASTs are
+	// freed once nothing refers to them anymore.
+	vector<const FunctionAST*> Replaced;
+	for (SourceItem* Item : Order) {
+		CompiledDefinition& Definition = Definitions[Item->Info.Name];
+		if (Definition.AST && Definition.Hash == Item->Info.Hash)
+			continue;
+
+		CodeGen->forgetFunction(Item->Info.Name);
+		Replaced.push_back(Definition.AST);
+		Definition.AST = Item->Function;
+		Definition.Hash = Item->Info.Hash;
+		CodeGen->FunctionProtos[Item->Info.Name] = Item->Function->Proto;
+		Item->Function = nullptr;
+	}
+
+	unsigned Compiled = 0;
+	for (SourceItem* Item : Order) {
+		CompiledDefinition& Definition = Definitions[Item->Info.Name];
+		Definition.RT = nullptr;
+		if (!const_cast<FunctionAST*>(Definition.AST)->accept(CodeGen))
+			continue;
+
+		Definition.RT = CodeGen->JIT.getJITDylib().createResourceTracker();
+		CodeGen->AddModuleToJIT(Definition.RT);
+		++Compiled;
+	}
+
+	for (auto AST : Replaced)
+		delete AST;
+
+	// Evaluate the top-level expressions that are new or depend on something that was regenerated.
+	set<uint64_t> NewExpressions;
+	unsigned Evaluated = 0;
+	for (auto& Item : Items) {
+		if (Item.Info.Kind != item_expression)
+			continue;
+		NewExpressions.insert(Item.Info.Hash);
+		if (!Item.Function || !NeedsEvaluation(Item.Info))
+			continue;
+
+		double Result;
+		if (TheParser.EvaluateTopLevelExpression(Item.Function, Result))
+			fprintf(stderr, "Evaluated to %f\n", Result);
+		CodeGen->forgetFunction("__anon_expr");
+		++Evaluated;
+	}
+
+	// Remember this version of the source for the next update.
+	Expressions = move(NewExpressions);
+	// A chunk that appears several times in the source is recorded once, from its first occurrence.
+	map<uint64_t, size_t> FirstChunk;
+	for (size_t i = 0, e = Chunks.size(); i != e; ++i)
+		FirstChunk.insert({ ChunkHashes[i], i });
+
+	ChunkItems.clear();
+	for (auto& Chunk : FirstChunk)
+		ChunkItems[Chunk.first];
+	for (auto& Item : Items)
+		if (FirstChunk[ChunkHashes[Item.Chunk]] == Item.Chunk)
+			ChunkItems[ChunkHashes[Item.Chunk]].push_back(Item.Info);
+
+	for (auto& Item : Items)
+		deleteItem(Item);
+
+	fprintf(stderr, "Updated: %u definition(s) compiled, %u expression(s) evaluated\n", Compiled, Evaluated);
+}
+
+IncrementalCompiler::~IncrementalCompiler()
+{
+	for (auto& D : Definitions) {
+		TheParser.CodeGenVisitor->forgetFunction(D.first);
+		delete D.second.AST;
+	}
+	for (auto& E : Externs) {
+		TheParser.CodeGenVisitor->forgetFunction(E.first);
+		delete E.second.AST;
+	}
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "llvm/ADT/StringRef.h"
+#include "Parser.h"
+
+using namespace std;
+using namespace llvm;
+
+/**
+* The incremental compiler keeps a whole source file compiled in the JIT across edits. Every call to update()
+* gets the full new text of the file, but only the parts that changed are parsed, generated and materialized again.
+*
+* The source is split into chunks at top-level boundaries ('def', 'extern', 'import' and after ';'), which only
+* needs the lexer. Chunks whose text hashes the same as in the previous version aren't parsed again, their items
+* are known from last time. Each item (definition, extern or top-level expression) is hashed on its own source
+* text, and a definition is changed when its hash is. Every definition lives in the JIT under its own
+* ResourceTracker, so it can be removed and replaced on its own.
+*
+* A definition also has to be regenerated when any of its callees changed, since it was typed, inlined (operators)
+* and linked against the old version. The callees of every item are recorded (CalleeCollector.h), and the set of
+* changed definitions is closed over the reverse of that graph. Top-level expressions are evaluated when they are
+* new or changed, or call a regenerated definition. Definitions are always compiled before expressions are
+* evaluated, so an expression may use a definition that appears later in the file.
+*/
+
+class IncrementalCompiler {
+public:
+	IncrementalCompiler(Parser& _Parser) : TheParser(_Parser) {}
+
+	/// update - Brings the JIT up to date with a new version of the source.
+	void update(const string& Source);
+
+	~IncrementalCompiler();
+
+private:
+	enum ItemKind { item_definition, item_extern, item_expression };
+
+	// What's remembered about a top-level item between updates.
+	struct ItemInfo {
+		ItemKind Kind;
+		string Name; // Function name of a definition or extern.
+		uint64_t Hash; // Hash of the item's source text.
+		set<string> Callees;
+	};
+
+	// A top-level item of the current version of the source. The ASTs are only there if its chunk was parsed.
+	struct SourceItem {
+		ItemInfo Info;
+		size_t Chunk;
+		const FunctionAST* Function = nullptr;
+		const PrototypeAST* Extern = nullptr;
+	};
+
+	// A definition that is in the JIT, and the extern prototypes known to the code generator.
+	struct CompiledDefinition {
+		uint64_t Hash;
+		const FunctionAST* AST;
+		orc::ResourceTrackerSP RT;
+	};
+
+	struct DeclaredExtern {
+		uint64_t Hash;
+		const PrototypeAST* AST;
+	};
+
+	Parser& TheParser;
+
+	// Items of every chunk of the last version of the source, by the chunk's hash.
+	map<uint64_t, vector<ItemInfo>> ChunkItems;
+
+	map<string, CompiledDefinition> Definitions;
+	map<string, DeclaredExtern> Externs;
+
+	// Hashes of the top-level expressions in the last version of the source.
+	set<uint64_t> Expressions;
+
+	// Splits a source buffer into chunks at top-level boundaries, using only the lexer.
+	static vector<StringRef> splitTopLevelChunks(const string& Source);
+
+	// Parses a chunk into its items (appended to Items). FirstLine is the line the chunk starts at, for debug info.
+	void parseChunk(StringRef Chunk, size_t ChunkIndex, unsigned FirstLine, vector<SourceItem>& Items);
+
+	// Frees the ASTs of an item that weren't handed over to the compiler state.
+	static void deleteItem(SourceItem& Item);
+};
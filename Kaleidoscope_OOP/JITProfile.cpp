@@ -0,0 +1,216 @@
+#include "stdafx.h"
+#include "JITProfile.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/ProfileData/ProfileCommon.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+
+// First line of a profile file.
+static const char ProfileHeader[] = "kaleidoscope-profile 1";
+
+// The conditional branches of a function, in the order their counters are in.
+static vector<BranchInst*> getConditionalBranches(Function& F)
+{
+	vector<BranchInst*> Branches;
+	for (auto& BB : F) {
+		auto* Branch = dyn_cast<BranchInst>(BB.getTerminator());
+		if (Branch && Branch->isConditional())
+			Branches.push_back(Branch);
+	}
+	return Branches;
+}
+
+unique_ptr<JITProfile> JITProfile::createGenerator(const string& FileName)
+{
+	return unique_ptr<JITProfile>(new JITProfile(FileName, true));
+}
+
+unique_ptr<JITProfile> JITProfile::load(const string& FileName)
+{
+	auto File = MemoryBuffer::getFile(FileName);
+	if (!File) {
+		fprintf(stderr, "Error: can't read profile %s\n", FileName.c_str());
+		return nullptr;
+	}
+
+	line_iterator Line(**File);
+	if (Line.is_at_eof() || *Line != ProfileHeader) {
+		fprintf(stderr, "Error: %s isn't a profile (or was written by another version)\n", FileName.c_str());
+		return nullptr;
+	}
+
+	unique_ptr<JITProfile> Profile(new JITProfile(FileName, false));
+	InstrProfSummaryBuilder SummaryBuilder(ProfileSummaryBuilder::DefaultCutoffs);
+	for (++Line; !Line.is_at_eof(); ++Line) {
+		SmallVector<StringRef, 16> Fields;
+		Line->split(Fields, ' ', -1, false);
+
+		auto Counts = make_unique<FunctionCounts>();
+		uint64_t NumCounters = 0;
+		bool Valid = Fields.size() >= 4 && !Fields[1].getAsInteger(16, Counts->Hash) &&
+			!Fields[2].getAsInteger(10, NumCounters) && NumCounters == Fields.size() - 3 && NumCounters % 2 == 1;
+		Counts->Name = Fields.empty() ? "" : Fields[0].str();
+		Counts->Counters.resize(Valid ? NumCounters : 0);
+		for (unsigned i = 0; Valid && i < NumCounters; ++i)
+			Valid = !Fields[3 + i].getAsInteger(10, Counts->Counters[i]);
+		if (!Valid) {
+			fprintf(stderr, "Error: profile %s is malformed at line %lld\n", FileName.c_str(),
+				(long long)Line.line_number());
+			return nullptr;
+		}
+
+		// Like the counters of an instrumented LLVM profile, the first one counts the calls.
+		SummaryBuilder.addRecord(InstrProfRecord(Counts->Counters));
+		Profile->FunctionsByKey.insert({ { Counts->Name, Counts->Hash }, Counts.get() });
+		Profile->Functions.push_back(move(Counts));
+	}
+
+	Profile->Summary = SummaryBuilder.getSummary();
+	return Profile;
+}
+
+JITProfile::~JITProfile()
+{
+	if (Generator)
+		write();
+}
+
+uint64_t JITProfile::hashFunction(const Function& F)
+{
+	// The opcodes and operand counts of the instructions, block by block. That covers the branch structure the
+	// counters follow, and tells most other edits apart as well.
+	string Shape;
+	raw_string_ostream OS(Shape);
+	for (auto& BB : F) {
+		OS << '{';
+		for (auto& I : BB) {
+			if (isa<DbgInfoIntrinsic>(I))
+				continue;
+			OS << I.getOpcode() << '/' << I.getNumOperands() << ' ';
+		}
+		OS << '}';
+	}
+	return xxHash64(OS.str());
+}
+
+const JITProfile::FunctionCounts* JITProfile::find(StringRef Name, uint64_t Hash) const
+{
+	auto FI = FunctionsByKey.find({ Name.str(), Hash });
+	return FI == FunctionsByKey.end() ? nullptr : FI->second;
+}
+
+void JITProfile::addModule(Module& M)
+{
+	lock_guard<mutex> Lock(Mutex);
+
+	for (auto& F : M) {
+		if (F.isDeclaration())
+			continue;
+
+		uint64_t Hash = hashFunction(F);
+		if (Generator) {
+			auto Counts = make_unique<FunctionCounts>();
+			Counts->Name = F.getName().str();
+			Counts->Hash = Hash;
+			Counts->Counters.resize(1 + 2 * getConditionalBranches(F).size());
+			instrument(F, *Counts);
+			Functions.push_back(move(Counts));
+		}
+		else if (auto* Counts = find(F.getName(), Hash))
+			annotate(F, *Counts);
+	}
+
+	if (!Generator)
+		M.setProfileSummary(Summary->getMD(M.getContext()), ProfileSummary::PSK_Instr);
+}
+
+void JITProfile::instrument(Function& F, FunctionCounts& Counts)
+{
+	LLVMContext& Ctx = F.getContext();
+	Type* Int64Ty = Type::getInt64Ty(Ctx);
+
+	// The counters are in this process, so the code addresses them directly.
+	auto getCounter = [&](unsigned i) {
+		return ConstantExpr::getIntToPtr(ConstantInt::get(Int64Ty, (uint64_t)(uintptr_t)&Counts.Counters[i]),
+			PointerType::getUnqual(Int64Ty));
+	};
+	auto increment = [&](IRBuilder<>& B, unsigned i, Value* By) {
+		Value* Counter = getCounter(i);
+		B.CreateStore(B.CreateAdd(B.CreateLoad(Int64Ty, Counter), By), Counter);
+	};
+
+	vector<BranchInst*> Branches = getConditionalBranches(F);
+
+	IRBuilder<> B(&*F.getEntryBlock().getFirstInsertionPt());
+	increment(B, 0, B.getInt64(1));
+
+	// Both edges of a branch are counted before it, without adding blocks: taken += c, not taken += !c.
+	for (unsigned i = 0, e = Branches.size(); i != e; ++i) {
+		B.SetInsertPoint(Branches[i]);
+		Value* Taken = B.CreateZExt(Branches[i]->getCondition(), Int64Ty);
+		increment(B, 1 + 2 * i, Taken);
+		increment(B, 2 + 2 * i, B.CreateSub(B.getInt64(1), Taken));
+	}
+}
+
+void JITProfile::annotate(Function& F, const FunctionCounts& Counts)
+{
+	// The hash can miss an edit, and the file can be edited by hand: counts recorded for another number of branches
+	// don't fit.
+	vector<BranchInst*> Branches = getConditionalBranches(F);
+	if (Counts.Counters.size() != 1 + 2 * Branches.size()) {
+		fprintf(stderr, "Error: profile %s has %u counters for %s, which needs %u; compiling it without them\n",
+			FileName.c_str(), (unsigned)Counts.Counters.size(), Counts.Name.c_str(),
+			(unsigned)(1 + 2 * Branches.size()));
+		return;
+	}
+
+	F.setEntryCount(Function::ProfileCount(Counts.Counters[0], Function::PCT_Real));
+
+	MDBuilder MDB(F.getContext());
+	for (unsigned i = 0, e = Branches.size(); i != e; ++i) {
+		// Branch weights are 32-bit, larger counts are scaled down keeping their ratio.
+		uint64_t Taken = Counts.Counters[1 + 2 * i], NotTaken = Counts.Counters[2 + 2 * i];
+		uint64_t Scale = max(Taken, NotTaken) / UINT32_MAX + 1;
+		Branches[i]->setMetadata(LLVMContext::MD_prof,
+			MDB.createBranchWeights((uint32_t)(Taken / Scale), (uint32_t)(NotTaken / Scale)));
+	}
+}
+
+bool JITProfile::write()
+{
+	lock_guard<mutex> Lock(Mutex);
+
+	// A function compiled more than once (e.g. evaluated expressions, which are all named __anon_expr) adds up.
+	map<pair<string, uint64_t>, vector<uint64_t>> Merged;
+	for (auto& Counts : Functions) {
+		auto& Total = Merged[{ Counts->Name, Counts->Hash }];
+		Total.resize(Counts->Counters.size());
+		for (unsigned i = 0, e = Total.size(); i != e; ++i)
+			Total[i] += Counts->Counters[i];
+	}
+
+	error_code EC;
+	raw_fd_ostream OS(FileName, EC, sys::fs::OF_Text);
+	if (EC) {
+		fprintf(stderr, "Error: can't write profile %s: %s\n", FileName.c_str(), EC.message().c_str());
+		return false;
+	}
+
+	OS << ProfileHeader << '\n';
+	for (auto& Entry : Merged) {
+		OS << Entry.first.first << ' ' << format_hex_no_prefix(Entry.first.second, 16) << ' ' << Entry.second.size();
+		for (uint64_t Count : Entry.second)
+			OS << ' ' << Count;
+		OS << '\n';
+	}
+	return true;
+}
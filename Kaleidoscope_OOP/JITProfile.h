@@ -0,0 +1,88 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/ProfileSummary.h"
+
+using namespace std;
+using namespace llvm;
+
+/**
+* Profile guided optimization of JIT'd code. An instrumented run counts how often every JIT'd function is called and
+* which way each of its conditional branches goes, and writes the counts to a profile file when the JIT shuts down.
+* A later run over the same sources reads the file and attaches the counts to the IR before the JIT's module pipeline
+* optimizes it: an entry count on every function, branch weights on its branches, and a profile summary on the module
+* saying which counts are hot. LLVM derives the frequency of every block, and so of every call site, from those. The
+* inliner then favours hot call sites, block placement lays out the hot paths contiguously, and the loop passes and
+* vectorizers weigh loops by their trip counts. Modules with a profile are optimized with the O3 pipeline, where those
+* passes are. The code generator's per-function cleanup (Optimizer.h) has run before the counts are attached, but none
+* of its passes read profiles.
+*
+* Counts are only used for the IR they were recorded for. They're keyed by the function's name and a hash of its
+* instructions, so an edited definition is compiled without a profile until it has a new one. With tiered compilation
+* the code generator skips its cleanup, so a profile recorded tiered only fits tiered runs, and the other way round.
+* The counters live in this process and instrumented code increments them at their addresses. The increments aren't
+* atomic, so parallel loops can lose a few counts, which doesn't matter for a profile.
+*
+* The file is text, a line per function: "name hash count counter...". Counter 0 is the number of calls, then come
+* the taken and not taken counts of every conditional branch, in block order.
+*/
+
+class JITProfile {
+public:
+	/// createGenerator - A profile that instruments code and writes its counts to FileName when it's destroyed.
+	static unique_ptr<JITProfile> createGenerator(const string& FileName);
+
+	/// load - Reads a profile written by a generator. Null (after logging) if it can't be read.
+	static unique_ptr<JITProfile> load(const string& FileName);
+
+	~JITProfile();
+
+	/// isGenerator - Whether the profile is being recorded, rather than used.
+	bool isGenerator() const { return Generator; }
+
+	/// addModule - Instruments the functions of a module for the generator, or attaches their counts otherwise.
+	/// Must be called on the module the code generator handed over, before the JIT's module pipeline runs.
+	void addModule(Module& M);
+
+	/// write - Writes the counts recorded so far to the profile file. Returns false (after logging) on error.
+	bool write();
+
+private:
+	struct FunctionCounts {
+		string Name;
+		uint64_t Hash = 0;
+		vector<uint64_t> Counters; // Sized once, instrumented code holds their addresses.
+	};
+
+	JITProfile(const string& FileName, bool Generator) : FileName(FileName), Generator(Generator) {}
+
+	string FileName;
+	bool Generator;
+
+	// Modules are added from the threads that materialize them.
+	mutex Mutex;
+	vector<unique_ptr<FunctionCounts>> Functions;
+
+	// For a loaded profile: its functions by name and hash.
+	map<pair<string, uint64_t>, const FunctionCounts*> FunctionsByKey;
+
+	// For a loaded profile: the summary of all its counts, which every module gets.
+	unique_ptr<ProfileSummary> Summary;
+
+	// Identifies the IR of a function, ignoring debug info.
+	static uint64_t hashFunction(const Function& F);
+
+	// Makes F count its calls and branches into Counts.
+	void instrument(Function& F, FunctionCounts& Counts);
+
+	// Attaches the counts recorded for F.
+	void annotate(Function& F, const FunctionCounts& Counts);
+
+	const FunctionCounts* find(StringRef Name, uint64_t Hash) const;
+};
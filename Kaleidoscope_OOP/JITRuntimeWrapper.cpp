@@ -1,12 +1,13 @@
 #include "stdafx.h"
 #include "JITRuntimeWrapper.h"
 
-JITRuntimeWrapper::JITRuntimeWrapper()
+JITRuntimeWrapper::JITRuntimeWrapper(const orc::KaleidoscopeJITOptions& Options)
 {
 	// Initialize JIT Runtime for interpretation. Based on the ORC engine.
 	InitializeNativeTarget();
 	InitializeNativeTargetAsmPrinter();
 	InitializeNativeTargetAsmParser();
 
-	TheJIT = ExitOnError(orc::KaleidoscopeJIT::Create());
+	TheJIT = ExitOnError(orc::KaleidoscopeJIT::Create(Options));
+	RT = TheJIT->getMainJITDylib().getDefaultResourceTracker();
 }
@@ -10,9 +10,29 @@ using namespace llvm;
 
 class JITRuntimeWrapper {
 public:
-	JITRuntimeWrapper();
+	JITRuntimeWrapper(const orc::KaleidoscopeJITOptions& Options = {});
 
-	unique_ptr<orc::KaleidoscopeJIT> TheJIT;
+	// Wraps an existing JIT, adding code to and looking it up in RT's JITDylib. Sessions share a JIT this way (see
+	// SessionManager.h).
+	JITRuntimeWrapper(shared_ptr<orc::KaleidoscopeJIT> JIT, orc::ResourceTrackerSP RT)
+		: TheJIT(move(JIT)), RT(move(RT)) {}
+
+	shared_ptr<orc::KaleidoscopeJIT> TheJIT;
+
+	// Tracks the code added without a tracker of its own. Its JITDylib is the JIT's main one, unless this wraps a
+	// session.
+	orc::ResourceTrackerSP RT;
+
+	orc::JITDylib& getJITDylib() { return RT->getJITDylib(); }
+
+	/// getFunction - Looks up a JIT'd function and casts it to a native function pointer. Kaleidoscope types map
+	/// to f64 -> double, f32 -> float, i64 -> int64_t, bool -> bool and pointers to pointers of those, e.g.
+	///   def sum2(a:f64* i:i64) a[i] + a[i+1]   =>   getFunction<double(double*, int64_t)>("sum2")
+	/// Pointer arguments are used in place, so host buffers are never copied.
+	template <typename Signature> Signature* getFunction(StringRef Name) {
+		auto Symbol = ExitOnError(TheJIT->lookup(getJITDylib(), Name));
+		return (Signature*)(intptr_t)Symbol.getAddress();
+	}
 
 	 ExitOnError ExitOnError;
 };
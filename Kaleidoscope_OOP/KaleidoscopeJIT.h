@@ -14,6 +14,11 @@
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
 #include "llvm/ADT/StringRef.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/JITLink/EHFrameSupport.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
@@ -22,22 +27,143 @@
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
 #include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/TPCIndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/TargetProcessControl.h"
-#include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Vectorize.h"
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include "JITProfile.h"
+#include "ParallelRuntime.h"
+#include "PerfListeners.h"
+#include "SlabMemoryManager.h"
 
 namespace llvm {
     namespace orc {
 
-        class KaleidoscopeJIT {
+        // Provides the functions of a precompiled library from its bitcode. The symbols are known up front
+        // (from the library's prototype index), the bitcode is only parsed once one of them is looked up. The
+        // module is then handed to the compile-on-demand layer, so only the functions actually called get
+        // compiled.
+        class LazyBitcodeMaterializationUnit : public MaterializationUnit {
+        public:
+            LazyBitcodeMaterializationUnit(SymbolFlagsMap Symbols,
+                std::map<SymbolStringPtr, std::string> FunctionNames, MemoryBufferRef Bitcode,
+                std::shared_ptr<MemoryBuffer> Owner, IRLayer& Layer)
+                : MaterializationUnit(std::move(Symbols), nullptr), FunctionNames(std::move(FunctionNames)),
+                Bitcode(Bitcode), Owner(std::move(Owner)), Layer(Layer) {}
+
+            StringRef getName() const override { return "LazyBitcodeMaterializationUnit"; }
+
+            void materialize(std::unique_ptr<MaterializationResponsibility> R) override {
+                auto Ctx = std::make_unique<LLVMContext>();
+                auto M = parseBitcodeFile(Bitcode, *Ctx);
+                if (!M) {
+                    R->getExecutionSession().reportError(M.takeError());
+                    R->failMaterialization();
+                    return;
+                }
+
+                // Functions that were overridden in the JITDylib are only declared, so callers within the
+                // library link against the overriding definition.
+                for (auto& F : **M)
+                    if (Discarded.count(F.getName().str()))
+                        F.deleteBody();
+
+                Layer.emit(std::move(R), ThreadSafeModule(std::move(*M), std::move(Ctx)));
+            }
+
+        private:
+            // Function names in the bitcode by (mangled) symbol.
+            std::map<SymbolStringPtr, std::string> FunctionNames;
+            MemoryBufferRef Bitcode;
+            std::shared_ptr<MemoryBuffer> Owner;
+            IRLayer& Layer;
+            std::set<std::string> Discarded;
+
+            void discard(const JITDylib& JD, const SymbolStringPtr& Name) override {
+                Discarded.insert(FunctionNames[Name]);
+            }
+        };
+
+        // How the JIT links and materializes code.
+        struct KaleidoscopeJITOptions {
+            enum LinkerKind { RuntimeDyld, JITLink };
+
+            // RuntimeDyld allocates through the slab memory manager (SlabMemoryManager.h) and uses the large
+            // code model. JITLink lays out each object as one graph, so it can use the small code model with
+            // PC-relative calls, building GOT entries and stubs only for references that need them. It isn't
+            // available for COFF (Windows) in this LLVM version; RuntimeDyld is used there instead.
+            LinkerKind Linker = RuntimeDyld;
+
+            // Threads materializing (compiling and linking) modules concurrently. 0 materializes on the thread
+            // that looks up the symbols.
+            unsigned NumLinkThreads = 0;
+
+            // Tell perf about JIT'd functions (see PerfListeners.h). PerfMap writes /tmp/perf-<pid>.map with
+            // either linker. JITDump writes a jitdump file, with RuntimeDyld only, if LLVM was built with perf
+            // support.
+            bool PerfMap = false;
+            bool JITDump = false;
+
+            // Tiered compilation: definitions are first compiled without optimization (fast isel, no IR
+            // passes) and count their calls. After TierUpCalls calls a function is recompiled at O3 on a
+            // background thread and callers are switched over to it through the function's stub.
+            bool Tiered = false;
+            unsigned TierUpCalls = 1000;
+
+            // Profile guided optimization (see JITProfile.h). With ProfileGenerate set, JIT'd code counts its
+            // calls and branches and the counts are written to that file when the JIT is destroyed. With
+            // ProfileUse set, the counts from that file guide the optimization of the code compiled for them.
+            std::string ProfileGenerate;
+            std::string ProfileUse;
+        };
+
+        class KaleidoscopeJIT;
+
+        // A function compiled at the cheap tier. Its address is baked into the function's call counting code,
+        // which hands it to the JIT once the function is hot. It's freed along with the function's code, when
+        // its resource tracker is removed, or after the recompile queued for it if that's later.
+        struct TieredFunction : std::enable_shared_from_this<TieredFunction> {
+            KaleidoscopeJIT* JIT;
+            std::string Name;
+
+            // The stubs of the function's JITDylib, which callers go through.
+            IndirectStubsManager* Stubs;
+
+            // Bitcode of the unoptimized module the function was defined in, shared by the module's functions.
+            // Dropped once the function has been recompiled.
+            std::shared_ptr<SmallVector<char, 0>> Source;
+            ResourceTrackerSP RT;
+
+            // Set by the first call past the threshold, so the function is only recompiled once.
+            std::atomic<bool> TierUpRequested{ false };
+
+            // Set, under the JIT's TieredMutex, when the function's tracker or JITDylib is removed. A recompile
+            // still queued for it then does nothing, and one under way leaves the stub alone.
+            bool Removed = false;
+        };
+
+        class KaleidoscopeJIT : private ResourceManager {
         private:
             std::unique_ptr<TargetProcessControl> TPC;
             std::unique_ptr<ExecutionSession> ES;
@@ -46,13 +172,50 @@ namespace llvm {
             DataLayout DL;
             MangleAndInterner Mangle;
 
-            RTDyldObjectLinkingLayer ObjectLayer;
+            // Used by the optimizer for the target's cost model and vector math library mapping.
+            std::unique_ptr<TargetMachine> TM;
+            TargetLibraryInfoImpl::VectorLibrary VecLib;
+
+            // All JIT'd objects share the pool's slabs (see SlabMemoryManager.h).
+            JITMemoryPool MemoryPool;
+
+            std::unique_ptr<ThreadPool> LinkThreads;
+
+            // Registered with the linking layer, so they're declared before it.
+            std::unique_ptr<JITEventListener> PerfMapListener;
+
+            std::unique_ptr<ObjectLayer> LinkingLayer;
             IRCompileLayer CompileLayer;
             IRTransformLayer OptimizeLayer;
             CompileOnDemandLayer CODLayer;
 
+            // The cheap tier: compiles at CodeGenOpt::None, without running the IR optimizer.
+            IRCompileLayer FastCompileLayer;
+
+            // The builtins (the parallel runtime, the tier-up callback) and the process's symbols (the math library),
+            // which every other JITDylib links against.
+            JITDylib& BuiltinsJD;
+
             JITDylib& MainJD;
 
+            // JITDylibs of removed sessions (see SessionManager.h), cleared for the next session to use. This LLVM
+            // can't remove a JITDylib from the execution session.
+            std::vector<JITDylib*> FreeSessionJDs;
+            unsigned NumSessionJDs = 0;
+
+            bool Tiered;
+            unsigned TierUpCalls;
+
+            // The stubs callers of tiered functions go through, per JITDylib since stubs are named after their
+            // function. They point at the cheap version first and are updated once the optimized one is ready.
+            std::map<JITDylib*, std::unique_ptr<IndirectStubsManager>> TieredStubs;
+            std::unique_ptr<ThreadPool> TierUpThreads;
+            std::mutex TieredMutex;
+            std::map<ResourceKey, std::vector<std::shared_ptr<TieredFunction>>> TieredFunctions;
+
+            // Set when a profile is recorded or used.
+            std::unique_ptr<JITProfile> Profile;
+
             static void handleLazyCallThroughError() {
                 errs() << "LazyCallThrough error: Could not find function body";
                 exit(1);
@@ -62,31 +225,66 @@ namespace llvm {
             KaleidoscopeJIT(std::unique_ptr<TargetProcessControl> TPC,
                 std::unique_ptr<ExecutionSession> ES,
                 std::unique_ptr<TPCIndirectionUtils> TPCIU,
-                JITTargetMachineBuilder JTMB, DataLayout DL)
+                JITTargetMachineBuilder JTMB, DataLayout DL,
+                std::unique_ptr<TargetMachine> TM,
+                TargetLibraryInfoImpl::VectorLibrary VecLib,
+                const KaleidoscopeJITOptions& Options)
                 : TPC(std::move(TPC)), ES(std::move(ES)), TPCIU(std::move(TPCIU)),
                 DL(std::move(DL)), Mangle(*this->ES, this->DL),
-                ObjectLayer(*this->ES,
-                    []() { return std::make_unique<SectionMemoryManager>(); }),
-                CompileLayer(*this->ES, ObjectLayer,
-                    std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
-                OptimizeLayer(*this->ES, CompileLayer, optimizeModule),
+                TM(std::move(TM)), VecLib(VecLib),
+                LinkingLayer(createLinkingLayer(Options)),
+                CompileLayer(*this->ES, *LinkingLayer, std::make_unique<ConcurrentIRCompiler>(JTMB)),
+                OptimizeLayer(*this->ES, CompileLayer,
+                    [this](ThreadSafeModule TSM, const MaterializationResponsibility& R) {
+                        return optimizeModule(std::move(TSM), R);
+                    }),
                 CODLayer(*this->ES, OptimizeLayer,
                     this->TPCIU->getLazyCallThroughManager(),
                     [this] { return this->TPCIU->createIndirectStubsManager(); }),
-                MainJD(this->ES->createBareJITDylib("<main>")) {
-                MainJD.addGenerator(
+                FastCompileLayer(*this->ES, *LinkingLayer,
+                    std::make_unique<ConcurrentIRCompiler>(withOptLevel(std::move(JTMB), CodeGenOpt::None))),
+                BuiltinsJD(this->ES->createBareJITDylib("<builtins>")),
+                MainJD(this->ES->createBareJITDylib("<main>")),
+                Tiered(Options.Tiered), TierUpCalls(std::max(Options.TierUpCalls, 1u)) {
+                if (Options.NumLinkThreads)
+                    dispatchMaterializationOnThreads(Options.NumLinkThreads);
+                if (!Options.ProfileGenerate.empty())
+                    Profile = JITProfile::createGenerator(Options.ProfileGenerate);
+                else if (!Options.ProfileUse.empty())
+                    Profile = JITProfile::load(Options.ProfileUse);
+                if (Tiered) {
+                    TierUpThreads = std::make_unique<ThreadPool>(hardware_concurrency(1));
+                    this->ES->registerResourceManager(*this);
+
+                    // The cheap versions call back into the JIT when they get hot.
+                    cantFail(BuiltinsJD.define(absoluteSymbols({ { Mangle("__kaleidoscope_tier_up"),
+                        JITEvaluatedSymbol(pointerToJITTargetAddress(&tierUpCallback),
+                            JITSymbolFlags::Exported | JITSymbolFlags::Callable) } })));
+                }
+                // Parallel loops run on the parallel runtime (see ParallelRuntime.h).
+                cantFail(BuiltinsJD.define(absoluteSymbols({ { Mangle("__kaleidoscope_parallel"),
+                    JITEvaluatedSymbol(pointerToJITTargetAddress(&ParallelRuntime::runLoop),
+                        JITSymbolFlags::Exported | JITSymbolFlags::Callable) } })));
+                BuiltinsJD.addGenerator(
                     cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
                         DL.getGlobalPrefix())));
+                MainJD.addToLinkOrder(BuiltinsJD);
             }
 
             ~KaleidoscopeJIT() {
+                if (TierUpThreads)
+                    TierUpThreads->wait();
+                if (LinkThreads)
+                    LinkThreads->wait();
                 if (auto Err = ES->endSession())
                     ES->reportError(std::move(Err));
+                if (Tiered)
+                    ES->deregisterResourceManager(*this);
                 if (auto Err = TPCIU->cleanup())
                     ES->reportError(std::move(Err));
             }
 
-            static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
+            static Expected<std::unique_ptr<KaleidoscopeJIT>> Create(KaleidoscopeJITOptions Options = {}) {
                 auto SSP = std::make_shared<SymbolStringPool>();
                 auto TPC = SelfTargetProcessControl::Create(SSP);
                 if (!TPC)
@@ -104,52 +302,511 @@ namespace llvm {
                 if (auto Err = setUpInProcessLCTMReentryViaTPCIU(**TPCIU))
                     return std::move(Err);
 
-                JITTargetMachineBuilder JTMB((*TPC)->getTargetTriple());
+                // Code runs in this process, so target the host CPU (and its vector extensions).
+                auto JTMB = JITTargetMachineBuilder::detectHost();
+                if (!JTMB)
+                    return JTMB.takeError();
 
-                auto DL = JTMB.getDefaultDataLayoutForTarget();
+                if (Options.Linker == KaleidoscopeJITOptions::JITLink) {
+                    if (JTMB->getTargetTriple().isOSBinFormatCOFF()) {
+                        errs() << "JITLink doesn't support COFF, using RuntimeDyld\n";
+                        Options.Linker = KaleidoscopeJITOptions::RuntimeDyld;
+                    }
+                    else {
+                        // JITLink keeps each object together and adds GOT/PLT stubs where needed, so code
+                        // can use the small code model instead of 64-bit absolute addresses everywhere.
+                        JTMB->setCodeModel(CodeModel::Small);
+                        JTMB->setRelocationModel(Reloc::PIC_);
+                    }
+                }
+
+                auto DL = JTMB->getDefaultDataLayoutForTarget();
                 if (!DL)
                     return DL.takeError();
 
+                auto TM = JTMB->createTargetMachine();
+                if (!TM)
+                    return TM.takeError();
+
+                auto VecLib = loadVectorMathLibrary((*TM)->getTargetTriple());
+
                 return std::make_unique<KaleidoscopeJIT>(std::move(*TPC), std::move(ES),
-                    std::move(*TPCIU), std::move(JTMB),
-                    std::move(*DL));
+                    std::move(*TPCIU), std::move(*JTMB),
+                    std::move(*DL), std::move(*TM), VecLib, Options);
             }
 
             const DataLayout& getDataLayout() const { return DL; }
 
             JITDylib& getMainJITDylib() { return MainJD; }
 
+            // A JITDylib of its own for a session (see SessionManager.h), linked against the builtins only, so it
+            // neither sees nor clashes with the definitions of the main JITDylib or of other sessions.
+            JITDylib& createSessionJITDylib() {
+                if (!FreeSessionJDs.empty()) {
+                    JITDylib* JD = FreeSessionJDs.back();
+                    FreeSessionJDs.pop_back();
+                    return *JD;
+                }
+                JITDylib& JD = ES->createBareJITDylib("<session " + std::to_string(NumSessionJDs++) + ">");
+                JD.addToLinkOrder(BuiltinsJD);
+                return JD;
+            }
+
+            // Takes a session's JITDylib back once the session is gone. Whatever is still defined in it, or in
+            // the JITDylib the compile-on-demand layer emitted its functions into, is removed.
+            Error releaseSessionJITDylib(JITDylib& JD) {
+                if (auto Err = JD.clear())
+                    return Err;
+                if (auto* ImplJD = ES->getJITDylibByName((JD.getName() + ".impl").str()))
+                    if (auto Err = ImplJD->clear())
+                        return Err;
+
+                if (Tiered) {
+                    // Clearing the JITDylib removed its trackers and with them most of its functions (see
+                    // handleRemoveResources). Any left now go with the stubs, marked removed under the same lock
+                    // so no recompile still running for them touches the stubs once they're freed.
+                    std::vector<std::shared_ptr<TieredFunction>> Released;
+                    {
+                        std::lock_guard<std::mutex> Lock(TieredMutex);
+                        auto SI = TieredStubs.find(&JD);
+                        if (SI != TieredStubs.end()) {
+                            for (auto I = TieredFunctions.begin(); I != TieredFunctions.end();) {
+                                auto& Records = I->second;
+                                auto Kept = std::partition(Records.begin(), Records.end(),
+                                    [&](const std::shared_ptr<TieredFunction>& Record) {
+                                        return Record->Stubs != SI->second.get();
+                                    });
+                                for (auto R = Kept; R != Records.end(); ++R)
+                                    (*R)->Removed = true;
+                                std::move(Kept, Records.end(), std::back_inserter(Released));
+                                Records.erase(Kept, Records.end());
+                                I = Records.empty() ? TieredFunctions.erase(I) : std::next(I);
+                            }
+                            TieredStubs.erase(SI);
+                        }
+                    }
+                    // Freed here, outside the lock, as in handleRemoveResources.
+                }
+                FreeSessionJDs.push_back(&JD);
+                return Error::success();
+            }
+
+            JITMemoryPool& getMemoryPool() { return MemoryPool; }
+
+            // With tiered compilation modules are optimized by the JIT once they're hot, code generators don't
+            // need to optimize them up front.
+            bool isTiered() const { return Tiered; }
+
             Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
                 if (!RT)
                     RT = MainJD.getDefaultResourceTracker();
 
+                // Instrument or annotate the code generator's IR before the module pipeline optimizes it. The code
+                // generator has cleaned its functions up already (unless tiered), in the run that recorded the
+                // profile as well, so their hashes agree.
+                if (Profile)
+                    TSM.withModuleDo([this](Module& M) { Profile->addModule(M); });
+
+                if (Tiered)
+                    return addTieredModule(std::move(TSM), RT);
                 return OptimizeLayer.add(RT, std::move(TSM));
             }
 
+            // Adds the functions of a precompiled library (see Library.h) without parsing its bitcode. Owner
+            // keeps the (memory mapped) bitcode alive until it's been materialized.
+            Error addLazyBitcode(MemoryBufferRef Bitcode, std::shared_ptr<MemoryBuffer> Owner,
+                ArrayRef<std::string> FunctionNames, ResourceTrackerSP RT = nullptr) {
+                if (!RT)
+                    RT = MainJD.getDefaultResourceTracker();
+
+                SymbolFlagsMap Symbols;
+                std::map<SymbolStringPtr, std::string> Names;
+                for (auto& Name : FunctionNames) {
+                    auto Symbol = Mangle(Name);
+                    Symbols[Symbol] = JITSymbolFlags::Exported | JITSymbolFlags::Callable;
+                    Names[Symbol] = Name;
+                }
+
+                return RT->getJITDylib().define(
+                    std::make_unique<LazyBitcodeMaterializationUnit>(std::move(Symbols), std::move(Names),
+                        Bitcode, std::move(Owner), CODLayer), RT);
+            }
+
+            // Compiles a module to an object file as the JIT would, optimized and with the code model of the
+            // linker in use, without adding it. Adding the object with addObjectFile then only links it.
+            Expected<std::unique_ptr<MemoryBuffer>> compileToObject(Module& M) {
+                optimizeModule(M);
+                return SimpleCompiler(*TM)(M);
+            }
+
+            // Adds an object file, linked once one of its symbols is looked up.
+            Error addObjectFile(std::unique_ptr<MemoryBuffer> Obj, ResourceTrackerSP RT = nullptr) {
+                if (!RT)
+                    RT = MainJD.getDefaultResourceTracker();
+                return LinkingLayer->add(RT, std::move(Obj));
+            }
+
             Expected<JITEvaluatedSymbol> lookup(StringRef Name) {
-                return ES->lookup({ &MainJD }, Mangle(Name.str()));
+                return lookup(MainJD, Name);
+            }
+
+            Expected<JITEvaluatedSymbol> lookup(JITDylib& JD, StringRef Name) {
+                return ES->lookup({ &JD }, Mangle(Name.str()));
+            }
+
+            // Looks several symbols up at once, so the modules defining them are materialized together (on the
+            // link threads, if there are any). The addresses are in the order of Names.
+            Expected<std::vector<JITTargetAddress>> lookupAll(ArrayRef<std::string> Names) {
+                return lookupAll(MainJD, Names);
+            }
+
+            Expected<std::vector<JITTargetAddress>> lookupAll(JITDylib& JD, ArrayRef<std::string> Names) {
+                SymbolLookupSet Symbols;
+                for (auto& Name : Names)
+                    Symbols.add(Mangle(Name));
+
+                auto Result = ES->lookup(makeJITDylibSearchOrder(&JD), std::move(Symbols));
+                if (!Result)
+                    return Result.takeError();
+
+                std::vector<JITTargetAddress> Addresses;
+                for (auto& Name : Names)
+                    Addresses.push_back((*Result)[Mangle(Name)].getAddress());
+                return Addresses;
+            }
+
+            // Runs the JIT's optimization pipeline over a module outside of the JIT (for precompiled libraries).
+            void optimizeModule(Module& M) {
+                // Create a function pass manager.
+                auto FPM = std::make_unique<legacy::FunctionPassManager>(&M);
+
+                // Give the passes the target's cost model, and tell them which math functions have
+                // vector variants so the vectorizers can widen calls to the math intrinsics.
+                TargetLibraryInfoImpl TLII(TM->getTargetTriple());
+                TLII.addVectorizableFunctionsFromVecLib(VecLib);
+                FPM->add(new TargetLibraryInfoWrapperPass(TLII));
+                FPM->add(createTargetTransformInfoWrapperPass(TM->getTargetIRAnalysis()));
+
+                // Add some optimizations.
+                FPM->add(createInstructionCombiningPass());
+                FPM->add(createReassociatePass());
+                FPM->add(createGVNPass());
+                FPM->add(createCFGSimplificationPass());
+                FPM->add(createLoopVectorizePass());
+                FPM->add(createSLPVectorizerPass());
+                FPM->doInitialization();
+
+                // Run the optimizations over all functions in the module.
+                for (auto& F : M)
+                    FPM->run(F);
             }
 
         private:
-            static Expected<ThreadSafeModule>
-                optimizeModule(ThreadSafeModule TSM, const MaterializationResponsibility& R) {
-                TSM.withModuleDo([](Module& M) {
-                    // Create a function pass manager.
-                    auto FPM = std::make_unique<legacy::FunctionPassManager>(&M);
-
-                    // Add some optimizations.
-                    FPM->add(createInstructionCombiningPass());
-                    FPM->add(createReassociatePass());
-                    FPM->add(createGVNPass());
-                    FPM->add(createCFGSimplificationPass());
-                    FPM->doInitialization();
-
-                    // Run the optimizations over all functions in the module being added to
-                    // the JIT.
-                    for (auto& F : M)
-                        FPM->run(F);
+            // The O3 pipeline the hot tier is recompiled with: inlining, loop and SLP vectorization, and the
+            // target's own additions.
+            void optimizeModuleAggressively(Module& M) {
+                PassManagerBuilder PMB;
+                PMB.OptLevel = 3;
+                PMB.SizeLevel = 0;
+                PMB.Inliner = createFunctionInliningPass(3, 0, false);
+                PMB.LoopVectorize = true;
+                PMB.SLPVectorize = true;
+
+                // The builder owns the library info.
+                auto* TLII = new TargetLibraryInfoImpl(TM->getTargetTriple());
+                TLII->addVectorizableFunctionsFromVecLib(VecLib);
+                PMB.LibraryInfo = TLII;
+                TM->adjustPassManager(PMB);
+
+                legacy::FunctionPassManager FPM(&M);
+                FPM.add(createTargetTransformInfoWrapperPass(TM->getTargetIRAnalysis()));
+                PMB.populateFunctionPassManager(FPM);
+
+                legacy::PassManager MPM;
+                MPM.add(createTargetTransformInfoWrapperPass(TM->getTargetIRAnalysis()));
+                PMB.populateModulePassManager(MPM);
+
+                FPM.doInitialization();
+                for (auto& F : M)
+                    FPM.run(F);
+                FPM.doFinalization();
+                MPM.run(M);
+            }
+
+            static JITTargetMachineBuilder withOptLevel(JITTargetMachineBuilder JTMB, CodeGenOpt::Level Level) {
+                JTMB.setCodeGenOptLevel(Level);
+                return JTMB;
+            }
+
+            // Compiles a module at the cheap tier. Every function defined in it is renamed to <name>$tier0 and
+            // counts its calls, and <name> becomes a lazy reexport of it through a stub of its JITDylib. Calls
+            // within the module, recursive ones included, go to <name> as well, so they reach the optimized version
+            // once the stub is pointed at it. Top-level expressions run once, they're compiled cheaply without any
+            // of that, and internal functions (call-site specializations) are only called from within the module,
+            // they're recompiled along with their callers.
+            Error addTieredModule(ThreadSafeModule TSM, ResourceTrackerSP RT) {
+                JITDylib& JD = RT->getJITDylib();
+                IndirectStubsManager* Stubs;
+                {
+                    std::lock_guard<std::mutex> Lock(TieredMutex);
+                    auto& JDStubs = TieredStubs[&JD];
+                    if (!JDStubs)
+                        JDStubs = TPCIU->createIndirectStubsManager();
+                    Stubs = JDStubs.get();
+                }
+
+                SymbolAliasMap Reexports;
+                TSM.withModuleDo([&](Module& M) {
+                    // The unoptimized IR is kept for the recompile, before it gets instrumented.
+                    auto Source = std::make_shared<SmallVector<char, 0>>();
+                    raw_svector_ostream OS(*Source);
+                    WriteBitcodeToFile(M, OS);
+
+                    std::vector<Function*> Functions;
+                    for (auto& F : M) {
+                        if (!F.isDeclaration() && !F.hasLocalLinkage() && !F.getName().startswith("__anon_expr"))
+                            Functions.push_back(&F);
+                    }
+
+                    std::lock_guard<std::mutex> Lock(TieredMutex);
+                    for (Function* FP : Functions) {
+                        Function& F = *FP;
+                        auto Record = std::make_shared<TieredFunction>();
+                        Record->JIT = this;
+                        Record->Name = F.getName().str();
+                        Record->Stubs = Stubs;
+                        Record->Source = Source;
+                        Record->RT = RT;
+                        instrumentCalls(F, *Record);
+
+                        F.setName(Record->Name + "$tier0");
+                        Function* Stub = Function::Create(F.getFunctionType(), GlobalValue::ExternalLinkage,
+                            Record->Name, M);
+                        F.replaceAllUsesWith(Stub);
+                        Reexports[Mangle(Record->Name)] = SymbolAliasMapEntry(Mangle(Record->Name + "$tier0"),
+                            JITSymbolFlags::Exported | JITSymbolFlags::Callable);
+                        TieredFunctions[RT->getKeyUnsafe()].push_back(std::move(Record));
+                    }
+                });
+
+                if (auto Err = FastCompileLayer.add(RT, std::move(TSM)))
+                    return Err;
+                if (Reexports.empty())
+                    return Error::success();
+
+                return JD.define(lazyReexports(TPCIU->getLazyCallThroughManager(), *Stubs, JD,
+                    std::move(Reexports)), RT);
+            }
+
+            // Prepends a call counter to F. The call that brings it to TierUpCalls hands Record to the JIT.
+            // The counter isn't atomic: concurrent calls may lose counts, but the threshold is still crossed by
+            // exactly one computed value, so the hand-over happens.
+            void instrumentCalls(Function& F, TieredFunction& Record) {
+                Module& M = *F.getParent();
+                LLVMContext& Ctx = M.getContext();
+                Type* Int64Ty = Type::getInt64Ty(Ctx);
+                Type* Int8PtrTy = Type::getInt8PtrTy(Ctx);
+
+                auto* Counter = new GlobalVariable(M, Int64Ty, false, GlobalValue::InternalLinkage,
+                    ConstantInt::get(Int64Ty, 0), F.getName() + "$calls");
+                FunctionCallee TierUp = M.getOrInsertFunction("__kaleidoscope_tier_up",
+                    FunctionType::get(Type::getVoidTy(Ctx), { Int8PtrTy }, false));
+
+                BasicBlock* Body = &F.getEntryBlock();
+                BasicBlock* Count = BasicBlock::Create(Ctx, "tierup.count", &F, Body);
+                BasicBlock* Hot = BasicBlock::Create(Ctx, "tierup.hot", &F, Body);
+
+                IRBuilder<> B(Count);
+                Value* Calls = B.CreateAdd(B.CreateLoad(Int64Ty, Counter), B.getInt64(1));
+                B.CreateStore(Calls, Counter);
+                B.CreateCondBr(B.CreateICmpEQ(Calls, B.getInt64(TierUpCalls)), Hot, Body);
+
+                B.SetInsertPoint(Hot);
+                B.CreateCall(TierUp, { ConstantExpr::getIntToPtr(B.getInt64(pointerToJITTargetAddress(&Record)),
+                    Int8PtrTy) });
+                B.CreateBr(Body);
+            }
+
+            // As a ResourceManager of the execution session, the JIT frees the tiered functions of a tracker when
+            // the tracker is removed (along with the code that refers to them), and keeps them when it's merged.
+            // Recompiles queued for the tracker's functions aren't waited for: they hold on to their records, and
+            // find them marked removed.
+            Error handleRemoveResources(ResourceKey K) override {
+                std::vector<std::shared_ptr<TieredFunction>> Removed;
+                {
+                    std::lock_guard<std::mutex> Lock(TieredMutex);
+                    auto I = TieredFunctions.find(K);
+                    if (I != TieredFunctions.end()) {
+                        Removed = std::move(I->second);
+                        TieredFunctions.erase(I);
+                    }
+                    for (auto& Record : Removed)
+                        Record->Removed = true;
+                }
+                // Released here, outside the lock: dropping a tracker's last reference may hand its resources on,
+                // which calls handleTransferResources.
+                return Error::success();
+            }
+
+            void handleTransferResources(ResourceKey DstK, ResourceKey SrcK) override {
+                std::lock_guard<std::mutex> Lock(TieredMutex);
+                auto I = TieredFunctions.find(SrcK);
+                if (I == TieredFunctions.end())
+                    return;
+                auto& Dst = TieredFunctions[DstK];
+                for (auto& Record : I->second)
+                    Dst.push_back(std::move(Record));
+                TieredFunctions.erase(I);
+            }
+
+            // Called from JIT'd code, so it only queues the recompile.
+            static void tierUpCallback(TieredFunction* Record) {
+                if (Record->TierUpRequested.exchange(true))
+                    return;
+                KaleidoscopeJIT* JIT = Record->JIT;
+                std::shared_ptr<TieredFunction> Queued = Record->shared_from_this();
+                JIT->TierUpThreads->async([JIT, Queued]() { JIT->recompileHot(*Queued); });
+            }
+
+            // Whether the function has been removed (or replaced). Its tracker is defunct before its record is
+            // marked.
+            bool isRemoved(TieredFunction& Record) {
+                std::lock_guard<std::mutex> Lock(TieredMutex);
+                return Record.Removed || Record.RT->isDefunct();
+            }
+
+            // Compiling or looking up into a tracker that's been removed fails, which isn't worth reporting.
+            void reportTierUpError(TieredFunction& Record, Error Err) {
+                if (isRemoved(Record))
+                    consumeError(std::move(Err));
+                else
+                    ES->reportError(std::move(Err));
+            }
+
+            // Recompiles a hot function at O3 and points its stub at the result.
+            void recompileHot(TieredFunction& Record) {
+                if (isRemoved(Record))
+                    return;
+
+                auto Ctx = std::make_unique<LLVMContext>();
+                auto M = parseBitcodeFile(MemoryBufferRef(StringRef(Record.Source->data(), Record.Source->size()),
+                    Record.Name), *Ctx);
+                Record.Source.reset();
+                if (!M) {
+                    ES->reportError(M.takeError());
+                    return;
+                }
+
+                // The other functions of the module are only kept for inlining, calls that aren't inlined go to
+                // their stubs.
+                std::string HotName = Record.Name + "$tier1";
+                for (auto& F : **M) {
+                    if (F.isDeclaration() || F.hasLocalLinkage())
+                        continue;
+                    if (F.getName() == Record.Name)
+                        F.setName(HotName);
+                    else
+                        F.setLinkage(GlobalValue::AvailableExternallyLinkage);
+                }
+                optimizeModuleAggressively(**M);
+
+                if (auto Err = CompileLayer.add(Record.RT, ThreadSafeModule(std::move(*M), std::move(Ctx)))) {
+                    reportTierUpError(Record, std::move(Err));
+                    return;
+                }
+                auto Hot = ES->lookup({ &Record.RT->getJITDylib() }, Mangle(HotName));
+                if (!Hot) {
+                    reportTierUpError(Record, Hot.takeError());
+                    return;
+                }
+
+                // Under the lock the record is marked removed with, so a stub that has been freed, or already
+                // points at a redefinition, is left alone.
+                std::lock_guard<std::mutex> Lock(TieredMutex);
+                if (Record.Removed || Record.RT->isDefunct())
+                    return;
+                if (auto Err = Record.Stubs->updatePointer(*Mangle(Record.Name), Hot->getAddress()))
+                    ES->reportError(std::move(Err));
+            }
+
+            std::unique_ptr<ObjectLayer> createLinkingLayer(const KaleidoscopeJITOptions& Options) {
+                PerfMapWriter* PerfMap = Options.PerfMap ? PerfMapWriter::get() : nullptr;
+
+                if (Options.Linker == KaleidoscopeJITOptions::JITLink) {
+                    auto Layer = std::make_unique<ObjectLinkingLayer>(*ES, TPC->getMemMgr());
+                    Layer->addPlugin(std::make_unique<EHFrameRegistrationPlugin>(
+                        *ES, std::make_unique<jitlink::InProcessEHFrameRegistrar>()));
+                    if (PerfMap)
+                        Layer->addPlugin(std::make_unique<PerfMapLinkPlugin>(*PerfMap));
+                    if (Options.JITDump)
+                        errs() << "Warning: jitdump output needs the RuntimeDyld linker (--linker=rtdyld)\n";
+                    return std::move(Layer);
+                }
+
+                auto Layer = std::make_unique<RTDyldObjectLinkingLayer>(*ES,
+                    [this]() { return MemoryPool.createMemoryManager(); });
+                Layer->setNotifyLoaded([this](MaterializationResponsibility& R,
+                    const object::ObjectFile& Obj, const RuntimeDyld::LoadedObjectInfo& Info) {
+                        MemoryPool.notifyLoaded(R, Obj, Info);
                     });
+                if (PerfMap) {
+                    PerfMapListener = std::make_unique<PerfMapEventListener>(*PerfMap);
+                    Layer->registerJITEventListener(*PerfMapListener);
+                }
+                if (Options.JITDump) {
+                    // LLVM owns this listener, it lives as long as the process.
+                    if (auto* JITDumpListener = JITEventListener::createPerfJITEventListener())
+                        Layer->registerJITEventListener(*JITDumpListener);
+                    else
+                        errs() << "Warning: jitdump output isn't available, LLVM was built without perf support\n";
+                }
+                return std::move(Layer);
+            }
 
+            // Hands materialization (compiling, optimizing and linking a module) to a thread pool, so
+            // independent modules, e.g. the functions of a lazily compiled library, are built in parallel.
+            void dispatchMaterializationOnThreads(unsigned NumThreads) {
+                LinkThreads = std::make_unique<ThreadPool>(hardware_concurrency(NumThreads));
+                ES->setDispatchMaterialization(
+                    [this](std::unique_ptr<MaterializationUnit> MU,
+                        std::unique_ptr<MaterializationResponsibility> MR) {
+                        // ThreadPool tasks are std::functions, which can't hold move-only captures.
+                        LinkThreads->async([UnownedMU = MU.release(), UnownedMR = MR.release()]() {
+                            std::unique_ptr<MaterializationUnit> MU(UnownedMU);
+                            std::unique_ptr<MaterializationResponsibility> MR(UnownedMR);
+                            MU->materialize(std::move(MR));
+                        });
+                    });
+            }
+
+            // Loads the platform's vector math library into the process so the vector variants of the math
+            // intrinsics (see Builtins.h) can be resolved. Returns NoLibrary if there isn't one.
+            static TargetLibraryInfoImpl::VectorLibrary loadVectorMathLibrary(const Triple& TT) {
+                if (!TT.isX86())
+                    return TargetLibraryInfoImpl::NoLibrary;
+
+#ifdef _WIN32
+                const char* LibName = "svml_dispmd.dll";
+                auto Lib = TargetLibraryInfoImpl::SVML;
+#else
+                const char* LibName = "libmvec.so.1";
+                auto Lib = TargetLibraryInfoImpl::LIBMVEC_X86;
+#endif
+                // LoadLibraryPermanently returns true on failure.
+                if (sys::DynamicLibrary::LoadLibraryPermanently(LibName))
+                    return TargetLibraryInfoImpl::NoLibrary;
+                return Lib;
+            }
+
+            Expected<ThreadSafeModule>
+                optimizeModule(ThreadSafeModule TSM, const MaterializationResponsibility& R) {
+                // With a profile to go by, the inliner and the loop passes are worth running.
+                TSM.withModuleDo([this](Module& M) {
+                    if (Profile && !Profile->isGenerator())
+                        optimizeModuleAggressively(M);
+                    else
+                        optimizeModule(M);
+                });
                 return std::move(TSM);
             }
         };
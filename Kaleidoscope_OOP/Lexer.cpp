@@ -1,5 +1,12 @@
 #include "stdafx.h"
+#include <cstring>
 #include "Lexer.h"
+#include "CharScan.h"
+#include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/Error.h"
+
+using namespace llvm;
 
 /**
 * Changes made by justice: getToken() returns a Token object which wraps the enumeration in an object with a public
@@ -7,24 +14,162 @@
 * objects are encapsulated properly.
 */
 
+namespace {
+
+struct Keyword {
+	const char* Name;
+	size_t Length;
+	TokenType Type;
+};
+
+// The keywords by a perfect hash of their first character and length, see lookupKeyword.
+const Keyword Keywords[8] = {
+	{ nullptr, 0, tok_identifier },
+	{ "extern", 6, tok_extern },
+	{ "def", 3, tok_def },
+	{ nullptr, 0, tok_identifier },
+	{ nullptr, 0, tok_identifier },
+	{ "import", 6, tok_import },
+	{ "binary", 6, tok_binary },
+	{ "unary", 5, tok_unary },
+};
+
+// The keyword token for an identifier, or tok_identifier if it isn't one. Only one keyword can match, so a
+// single compare decides.
+TokenType lookupKeyword(const string& Identifier)
+{
+	const Keyword& K = Keywords[((unsigned char)Identifier[0] + 2 * Identifier.size()) & 7];
+	if (K.Length == Identifier.size() && memcmp(K.Name, Identifier.data(), K.Length) == 0)
+		return K.Type;
+	return tok_identifier;
+}
+
+// Powers of ten that are exact doubles.
+const double ExactPowersOf10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// Parses the number at the start of Text:
+//   number   ::= [0-9]+ ('.' [0-9]*)? exponent? | '.' [0-9]+ exponent?
+//   exponent ::= [eE] [+-]? [0-9]+
+// into Value, rounded to the nearest double. Returns the length of the number, or 0 if Text doesn't start with one.
+//
+// The first 19 significant digits are gathered into an integer. When that's all of them, the integer is exact as a
+// double (at most 2^53) and the power of ten is too (at most 10^22), one multiply or divide rounds the result
+// correctly, which covers nearly all literals. Anything else is left to APFloat, which is exact but much slower.
+size_t parseNumber(StringRef Text, double& Value)
+{
+	const char* Data = Text.data();
+	size_t Pos = 0;
+	uint64_t Mantissa = 0;
+	int Significant = 0; // Digits in Mantissa, not counting leading zeros.
+	bool Truncated = false; // Nonzero digits didn't fit in Mantissa.
+	int64_t Exponent = 0;
+
+	auto addDigits = [&](size_t DigitsEnd, bool Fraction) {
+		for (; Pos < DigitsEnd; ++Pos) {
+			unsigned Digit = Data[Pos] - '0';
+			if (Significant < 19) {
+				Mantissa = Mantissa * 10 + Digit;
+				if (Mantissa)
+					++Significant;
+				if (Fraction)
+					--Exponent;
+			}
+			else {
+				Truncated |= Digit != 0;
+				if (!Fraction)
+					++Exponent;
+			}
+		}
+	};
+
+	addDigits(scanDigits(Data, Pos, Text.size()), false);
+	bool HasDigits = Pos > 0;
+	if (Pos < Text.size() && Data[Pos] == '.') {
+		size_t FractionStart = ++Pos;
+		addDigits(scanDigits(Data, Pos, Text.size()), true);
+		HasDigits |= Pos > FractionStart;
+	}
+	if (!HasDigits)
+		return 0;
+
+	// An 'e' without digits after it isn't an exponent, it's left for the caller to reject.
+	if (Pos < Text.size() && (Data[Pos] == 'e' || Data[Pos] == 'E')) {
+		size_t ExponentStart = Pos + 1;
+		bool Negative = false;
+		if (ExponentStart < Text.size() && (Data[ExponentStart] == '+' || Data[ExponentStart] == '-'))
+			Negative = Data[ExponentStart++] == '-';
+		size_t ExponentEnd = scanDigits(Data, ExponentStart, Text.size());
+		if (ExponentEnd > ExponentStart) {
+			// Far beyond the range of doubles, the exact value doesn't matter any more.
+			int64_t Explicit = 0;
+			for (size_t i = ExponentStart; i < ExponentEnd && Explicit < 100000; ++i)
+				Explicit = Explicit * 10 + (Data[i] - '0');
+			Exponent += Negative ? -Explicit : Explicit;
+			Pos = ExponentEnd;
+		}
+	}
+
+	if (Mantissa == 0 && !Truncated) {
+		Value = 0;
+		return Pos;
+	}
+	if (!Truncated && Mantissa <= (1ull << 53) && Exponent >= -22 && Exponent <= 22) {
+		Value = Exponent < 0 ? (double)Mantissa / ExactPowersOf10[-Exponent] : (double)Mantissa * ExactPowersOf10[Exponent];
+		return Pos;
+	}
+
+	APFloat Result(APFloat::IEEEdouble());
+	auto Status = Result.convertFromString(Text.take_front(Pos), APFloat::rmNearestTiesToEven);
+	if (!Status) {
+		consumeError(Status.takeError());
+		return 0;
+	}
+	Value = Result.convertToDouble();
+	return Pos;
+}
+
+// Whether C continues a number token after Prev. Letters, digits and dots all do, so "1.2.3" and "2x" are single
+// malformed numbers rather than a number followed by something else. So does the sign of an exponent.
+bool continuesNumber(int Prev, int C)
+{
+	return isalnum(C) || C == '.' || ((C == '+' || C == '-') && (Prev == 'e' || Prev == 'E'));
+}
+
+} // end anonymous namespace
+
 Token Lexer::getToken()
 {
-	// Skip any whitespace.
+	// Skip any whitespace. The initial LastChar isn't part of the buffer, the scan starts once it's been read.
+	if (Source && !Pos)
+		LastChar = getNextChar();
+	if (Source && isspace(LastChar))
+		skipWhitespaceTo(scanWhitespace(Source->data(), Pos, Source->size()));
 	while (isspace(LastChar))
-		LastChar = getchar();
+		LastChar = getNextChar();
+
+	TokenStart = Pos - 1;
+	TokenLine = Line;
+	TokenColumn = Column;
 
 	if (isalpha(LastChar)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
 		string IdentifierStr;
-		IdentifierStr = LastChar;
+		if (Source) {
+			size_t End = scanIdentifier(Source->data(), Pos, Source->size());
+			IdentifierStr.assign(*Source, TokenStart, End - TokenStart);
+			advanceTo(End);
+		}
+		else {
+			IdentifierStr = LastChar;
+			while (isalnum((LastChar = getNextChar())))
+				IdentifierStr += LastChar;
+		}
 
-		while (isalnum((LastChar = getchar())))
-			IdentifierStr += LastChar;
-
-		if (IdentifierStr == "def")
-			return Token(TokenType::tok_def);
-
-		if (IdentifierStr == "extern")
-			return Token(TokenType::tok_extern);
+		TokenType Type = lookupKeyword(IdentifierStr);
+		if (Type != tok_identifier)
+			return Token(Type);
 
 		// Create a token with the Identifier string encapsulated within
 		Token _Token = Token(TokenType::tok_identifier);
@@ -32,24 +177,64 @@ Token Lexer::getToken()
 		return _Token;
 	}
 
-	if (isdigit(LastChar) || LastChar == '.') { // Number: [0-9.]+
-		string NumStr;
-		do {
-			NumStr += LastChar;
-			LastChar = getchar();
-		} while (isdigit(LastChar) || LastChar == '.');
+	if (isdigit(LastChar) || LastChar == '.') { // Number, see parseNumber
+		// Buffers are parsed in place, stdin is gathered up to the end of the token first.
+		double NumVal = 0;
+		StringRef Text;
+		size_t Length;
+		SmallString<32> Buffered;
+		if (Source) {
+			Text = StringRef(*Source).drop_front(TokenStart);
+			Length = parseNumber(Text, NumVal);
+			size_t End = Length ? Length : 1;
+			while (End < Text.size() && continuesNumber((unsigned char)Text[End - 1], (unsigned char)Text[End]))
+				++End;
+			Text = Text.take_front(End);
+			advanceTo(TokenStart + End);
+		}
+		else {
+			do {
+				Buffered.push_back((char)LastChar);
+				LastChar = getNextChar();
+			} while (continuesNumber((unsigned char)Buffered.back(), LastChar));
+			Text = Buffered;
+			Length = parseNumber(Text, NumVal);
+		}
+
+		if (Length != Text.size()) {
+			Token _Token = Token(TokenType::tok_error);
+			_Token.setIdentifierString("malformed number '" + Text.str() + "'");
+			return _Token;
+		}
 
-		int NumVal = strtod(NumStr.c_str(), nullptr);
 		Token _Token = Token(TokenType::tok_number);
 		_Token.setNumValue(NumVal);
 		return _Token;
 	}
 
+	if (LastChar == '"') { // String: '"' [^"\n]* '"'
+		string Str;
+		while ((LastChar = getNextChar()) != '"' && LastChar != EOF && LastChar != '\n')
+			Str += LastChar;
+
+		// An unterminated string ends at the end of the line.
+		if (LastChar == '"')
+			LastChar = getNextChar();
+
+		Token _Token = Token(TokenType::tok_string);
+		_Token.setIdentifierString(Str);
+		return _Token;
+	}
+
 	if (LastChar == '#') {
 		// Comment until end of line.
-		do
-			LastChar = getchar();
-		while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
+		if (Source)
+			advanceTo(scanLineEnd(Source->data(), Pos, Source->size()));
+		else {
+			do
+				LastChar = getNextChar();
+			while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
+		}
 
 		if (LastChar != EOF)
 			return getToken();
@@ -61,8 +246,62 @@ Token Lexer::getToken()
 
 	// Otherwise, just return the character as its ascii value.
 	int ThisChar = LastChar;
-	LastChar = getchar();
+	LastChar = getNextChar();
 	Token _Token = Token(TokenType::tok_char);
 	_Token.setNumValue(ThisChar);
 	return _Token;
 }
+
+void Lexer::skipWhitespaceTo(size_t Offset)
+{
+	// Whitespace runs are the only ones with newlines in them. Past the last one, the column counts from it.
+	const char* Data = Source->data();
+	const char* End = Data + Offset;
+	const char* LastNewline = nullptr;
+	for (const char* Next = Data + Pos - 1; const char* Newline = (const char*)memchr(Next, '\n', End - Next);
+		Next = Newline + 1) {
+		++Line;
+		LastNewline = Newline;
+	}
+	if (LastNewline) {
+		Column = 0;
+		Pos = LastNewline - Data + 1;
+	}
+	advanceTo(Offset);
+}
+
+void Lexer::advanceTo(size_t Offset)
+{
+	// Lines and columns as if getNextChar had stepped over [Pos - 1, Offset). Identifier, number and comment runs
+	// have no newlines in them, so only the column moves.
+	const char* Data = Source->data();
+	Column += (unsigned)(Offset - (Pos - 1));
+
+	if (Offset >= Source->size()) {
+		Pos = Source->size() + 1;
+		LastChar = EOF;
+		return;
+	}
+	Pos = Offset + 1;
+	LastChar = (unsigned char)Data[Offset];
+}
+
+int Lexer::getNextChar()
+{
+	// The character being replaced is the one the position moves past.
+	if (LastChar == '\n') {
+		++Line;
+		Column = 0;
+	}
+	++Column;
+
+	if (!Source)
+		return getchar();
+
+	// Pos keeps counting at the end of the buffer so the EOF "character" sits at offset Source->size().
+	if (Pos >= Source->size()) {
+		Pos = Source->size() + 1;
+		return EOF;
+	}
+	return (unsigned char)(*Source)[Pos++];
+}
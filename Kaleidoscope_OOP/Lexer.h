@@ -1,13 +1,62 @@
 #pragma once
+#include <memory>
 #include <string>
 #include "Token.h"
 
 using namespace std;
 
+/**
+* The Lexer either reads the REPL's stdin or a source buffer held in memory (a file, or a chunk of one). In buffer
+* mode it keeps track of offsets so callers can map tokens back to spans of the source, which is what the
+* incremental compiler hashes. The buffer is shared so copying a Lexer (the Parser holds one by value) is cheap.
+* Lines and columns (1-based) are tracked in both modes, for debug line info.
+*/
+
 class Lexer {
 public:
+	// Reads from stdin.
+	Lexer() {}
+
+	// Reads from an in-memory source buffer. FirstLine is the line the buffer starts at within its file.
+	Lexer(string Source, unsigned FirstLine = 1) : Source(make_shared<const string>(move(Source))), Line(FirstLine) {}
+
 	Token getToken();
 
+	// Offset into the source buffer at which the token last returned by getToken starts.
+	size_t getTokenStart() { return TokenStart; }
+
+	// Offset of the lookahead character, which is just past the end of the token last returned by getToken.
+	size_t getOffset() { return Pos ? Pos - 1 : 0; }
+
+	// The source buffer, or null when reading stdin.
+	const string* getSource() { return Source.get(); }
+
+	// Line and column at which the token last returned by getToken starts.
+	unsigned getTokenLine() { return TokenLine; }
+	unsigned getTokenColumn() { return TokenColumn; }
+
 private:
 	int LastChar = ' ';
+
+	shared_ptr<const string> Source;
+
+	// Offset of the character after LastChar, and the start offset of the last token.
+	size_t Pos = 0;
+	size_t TokenStart = 0;
+
+	// Position of LastChar, and the start position of the last token.
+	unsigned Line = 1;
+	unsigned Column = 0;
+	unsigned TokenLine = 0;
+	unsigned TokenColumn = 0;
+
+	// Reads the next character from the source buffer, or stdin if there is none.
+	int getNextChar();
+
+	// Makes the character at Offset of the source buffer LastChar, skipping the ones before it (see CharScan.h).
+	// They must not include a newline.
+	void advanceTo(size_t Offset);
+
+	// advanceTo for a run of whitespace, which may include newlines.
+	void skipWhitespaceTo(size_t Offset);
 };
\ No newline at end of file
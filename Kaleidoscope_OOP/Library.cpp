@@ -0,0 +1,164 @@
+#include "stdafx.h"
+#include "Library.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+static const char LibraryMagic[4] = { 'K', 'S', 'L', 'B' };
+static const uint32_t LibraryVersion = 1;
+static const size_t HeaderSize = 16;
+
+namespace {
+
+// Reads the index of a library with bounds checking. Any read past the end of the index marks it as malformed.
+class IndexReader {
+public:
+	IndexReader(StringRef Index) : Index(Index) {}
+
+	bool Malformed = false;
+
+	uint8_t readU8() {
+		if (Index.size() < 1) {
+			Malformed = true;
+			return 0;
+		}
+		uint8_t Value = Index[0];
+		Index = Index.drop_front(1);
+		return Value;
+	}
+
+	uint32_t readU32() {
+		if (Index.size() < 4) {
+			Malformed = true;
+			return 0;
+		}
+		uint32_t Value = support::endian::read32le(Index.data());
+		Index = Index.drop_front(4);
+		return Value;
+	}
+
+	string readString() {
+		uint32_t Length = readU32();
+		if (Index.size() < Length) {
+			Malformed = true;
+			return string();
+		}
+		string Value = Index.take_front(Length).str();
+		Index = Index.drop_front(Length);
+		return Value;
+	}
+
+private:
+	StringRef Index;
+};
+
+bool isValidValueType(uint8_t Type)
+{
+	return (Type >= type_bool && Type <= type_f64) || (Type >= type_bool_ptr && Type <= type_f64_ptr);
+}
+
+} // end anonymous namespace
+
+unique_ptr<CompiledLibrary> CompiledLibrary::open(const string& FileName)
+{
+	// getFile maps the file rather than reading it, unless it's very small.
+	auto File = MemoryBuffer::getFile(FileName, -1, false);
+	if (!File) {
+		fprintf(stderr, "Error: can't read library %s\n", FileName.c_str());
+		return nullptr;
+	}
+
+	auto Library = make_unique<CompiledLibrary>();
+	Library->FileName = FileName;
+	Library->Buffer = move(*File);
+	StringRef Contents = Library->Buffer->getBuffer();
+
+	if (Contents.size() < HeaderSize || memcmp(Contents.data(), LibraryMagic, 4) != 0 ||
+		support::endian::read32le(Contents.data() + 4) != LibraryVersion) {
+		fprintf(stderr, "Error: %s isn't a library (or was built by another version)\n", FileName.c_str());
+		return nullptr;
+	}
+
+	uint32_t NumPrototypes = support::endian::read32le(Contents.data() + 8);
+	uint32_t IndexSize = support::endian::read32le(Contents.data() + 12);
+	size_t BitcodeStart = alignTo(HeaderSize + IndexSize, 4);
+	if (BitcodeStart > Contents.size()) {
+		fprintf(stderr, "Error: library %s is truncated\n", FileName.c_str());
+		return nullptr;
+	}
+
+	IndexReader Reader(Contents.substr(HeaderSize, IndexSize));
+	for (uint32_t i = 0; i != NumPrototypes && !Reader.Malformed; ++i) {
+		string Name = Reader.readString();
+		uint8_t ReturnType = Reader.readU8();
+		bool IsOperator = Reader.readU8() != 0;
+		unsigned Precedence = Reader.readU8();
+
+		uint32_t NumArgs = Reader.readU32();
+		vector<string> Args;
+		vector<ValueType> ArgTypes;
+		for (uint32_t a = 0; a != NumArgs && !Reader.Malformed; ++a) {
+			Args.push_back(Reader.readString());
+			uint8_t ArgType = Reader.readU8();
+			Reader.Malformed |= !isValidValueType(ArgType);
+			ArgTypes.push_back((ValueType)ArgType);
+		}
+		Reader.Malformed |= !isValidValueType(ReturnType);
+
+		Library->Prototypes.push_back(make_unique<PrototypeAST>(Name, move(Args), move(ArgTypes),
+			(ValueType)ReturnType, IsOperator, Precedence));
+	}
+
+	if (Reader.Malformed) {
+		fprintf(stderr, "Error: library %s has a malformed index\n", FileName.c_str());
+		return nullptr;
+	}
+
+	Library->Bitcode = MemoryBufferRef(Contents.substr(BitcodeStart), FileName);
+	return Library;
+}
+
+bool CompiledLibrary::write(const string& FileName, const Module& M, const vector<const PrototypeAST*>& Prototypes)
+{
+	string Index;
+	raw_string_ostream IndexStream(Index);
+	support::endian::Writer IndexWriter(IndexStream, support::little);
+
+	auto WriteString = [&](const string& Str) {
+		IndexWriter.write<uint32_t>(Str.size());
+		IndexStream << Str;
+	};
+
+	for (auto Proto : Prototypes) {
+		WriteString(Proto->Name);
+		IndexWriter.write<uint8_t>(Proto->ReturnType);
+		IndexWriter.write<uint8_t>(Proto->IsOperator);
+		IndexWriter.write<uint8_t>(Proto->Precedence);
+		IndexWriter.write<uint32_t>(Proto->Args.size());
+		for (size_t i = 0, e = Proto->Args.size(); i != e; ++i) {
+			WriteString(Proto->Args[i]);
+			IndexWriter.write<uint8_t>(Proto->ArgTypes[i]);
+		}
+	}
+	IndexStream.flush();
+
+	error_code EC;
+	raw_fd_ostream OS(FileName, EC, sys::fs::OF_None);
+	if (EC) {
+		fprintf(stderr, "Error: can't write library %s: %s\n", FileName.c_str(), EC.message().c_str());
+		return false;
+	}
+
+	support::endian::Writer Writer(OS, support::little);
+	OS.write(LibraryMagic, 4);
+	Writer.write<uint32_t>(LibraryVersion);
+	Writer.write<uint32_t>(Prototypes.size());
+	Writer.write<uint32_t>(Index.size());
+	OS << Index;
+	OS.write_zeros(alignTo(HeaderSize + Index.size(), 4) - (HeaderSize + Index.size()));
+
+	WriteBitcodeToFile(M, OS);
+	return true;
+}
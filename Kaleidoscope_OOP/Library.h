@@ -0,0 +1,52 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "AST.h"
+
+using namespace std;
+using namespace llvm;
+
+/**
+* A precompiled library (".ksl") holds optimized bitcode together with an index of the prototypes of the functions
+* it defines. Importing one ("import \"mathlib\"") doesn't lex, parse or generate anything: the file is memory
+* mapped, the index is read into PrototypeASTs for the code generator (FunctionProtos), and the bitcode is handed
+* to the JIT untouched. It's only parsed once one of its functions is looked up, and then compiled a function at a
+* time through the compile-on-demand layer.
+*
+* Layout (all integers little endian):
+*   header      "KSLB", u32 version, u32 prototype count, u32 index size in bytes
+*   index       per prototype: string name, u8 return type, u8 is operator, u8 precedence, u32 argument count,
+*               then per argument: string name, u8 type. Strings are a u32 length followed by the characters.
+*   padding     to a multiple of 4 bytes, so the bitcode is aligned like the bitcode reader expects
+*   bitcode     to the end of the file
+*
+* A library that calls functions from other libraries only declares them, those libraries have to be imported
+* before it.
+*/
+
+class CompiledLibrary {
+public:
+	string FileName;
+
+	// Prototypes of the functions defined in the library.
+	vector<unique_ptr<PrototypeAST>> Prototypes;
+
+	// The mapped file, shared with the JIT until the bitcode has been materialized.
+	shared_ptr<MemoryBuffer> Buffer;
+
+	MemoryBufferRef getBitcode() const { return Bitcode; }
+
+	/// open - Maps a library file and reads its prototype index. Returns null (after logging) if the file can't
+	/// be read or isn't a library.
+	static unique_ptr<CompiledLibrary> open(const string& FileName);
+
+	/// write - Writes a library holding module M, which defines the functions of the given prototypes.
+	/// Returns false (after logging) on error.
+	static bool write(const string& FileName, const Module& M, const vector<const PrototypeAST*>& Prototypes);
+
+private:
+	MemoryBufferRef Bitcode;
+};
@@ -0,0 +1,19 @@
+#pragma once
+
+/**
+* The binary operators every program starts out with, and their precedence (1 is lowest). The REPL installs them
+* in the Parser's BinopPrecedence, the compile-time front end (ConstexprFormula.h) parses with them directly.
+* More operators are defined with "def binary".
+*/
+
+struct StandardBinaryOperator {
+	char Op;
+	int Precedence;
+};
+
+constexpr StandardBinaryOperator StandardBinaryOperators[] = {
+	{ '<', 10 },
+	{ '+', 20 },
+	{ '-', 20 },
+	{ '*', 40 }, // highest.
+};
@@ -0,0 +1,131 @@
+#include "stdafx.h"
+#include "ParallelEvaluator.h"
+#include "CalleeCollector.h"
+#include "Builtins.h"
+
+void ParallelEvaluator::add(const FunctionAST* Expression)
+{
+	if (!Expression)
+		return;
+
+	fprintf(stderr, "Parsed a top-level expr\n");
+	ASTCodeGenVisitor* CodeGen = TheParser.CodeGenVisitor;
+
+	// An expression that may call externs gets a module of its own: if an extern isn't defined, that module fails
+	// to link, and the other expressions shouldn't fail with it.
+	bool Serial = !isPure(Expression);
+	if (Serial && InCurrentModule)
+		addModule();
+
+	if (const_cast<FunctionAST*>(Expression)->accept(CodeGen)) {
+		// Each expression of the run needs a name of its own.
+		string Name = "__anon_expr." + to_string(NextExpression++);
+		CodeGen->TheModule->getFunction("__anon_expr")->setName(Name);
+		Run.push_back({ Name, Serial, 0.0 });
+
+		if (++InCurrentModule == ExpressionsPerModule || Serial)
+			addModule();
+	}
+
+	// Clean up the memory allocated for this AST node (the code generator still knows its prototype).
+	CodeGen->forgetFunction("__anon_expr");
+	delete Expression;
+
+	if (Run.size() == MaxRunLength)
+		flush();
+}
+
+void ParallelEvaluator::addModule()
+{
+	auto& JIT = TheParser.CodeGenVisitor->JIT;
+	if (!RT)
+		RT = JIT.getJITDylib().createResourceTracker();
+	if (auto Err = JIT.TheJIT->addModule(TheParser.CodeGenVisitor->takeModule(), RT)) {
+		// The module's expressions are the last of the run, they're skipped and the rest of the run goes ahead.
+		logAllUnhandledErrors(move(Err), errs(), "Error: ");
+		Run.erase(Run.end() - InCurrentModule, Run.end());
+	}
+	InCurrentModule = 0;
+}
+
+void ParallelEvaluator::flush()
+{
+	if (InCurrentModule)
+		addModule();
+	PureFunctions.clear();
+	if (Run.empty())
+		return;
+
+	// Compile every module of the run with one lookup, so they're compiled concurrently with link threads.
+	auto& JIT = TheParser.CodeGenVisitor->JIT;
+	vector<string> Names;
+	for (auto& Expr : Run)
+		Names.push_back(Expr.Name);
+	vector<JITTargetAddress> Addresses;
+	if (auto Batch = JIT.TheJIT->lookupAll(JIT.getJITDylib(), Names))
+		Addresses = move(*Batch);
+	else {
+		// One expression that fails to link fails the whole lookup. Looked up one at a time, only the ones that
+		// fail are skipped (their address stays 0).
+		consumeError(Batch.takeError());
+		Addresses.resize(Run.size());
+		for (size_t i = 0, e = Run.size(); i != e; ++i) {
+			if (auto Symbol = JIT.TheJIT->lookup(JIT.getJITDylib(), Run[i].Name))
+				Addresses[i] = Symbol->getAddress();
+			else
+				logAllUnhandledErrors(Symbol.takeError(), errs(), "Error: ");
+		}
+	}
+
+	for (size_t i = 0, e = Run.size(); i != e; ++i) {
+		if (Run[i].Serial || !Addresses[i])
+			continue;
+		Pool.async([this, i, FP = (double (*)())(intptr_t)Addresses[i]]() { Run[i].Result = FP(); });
+	}
+	for (size_t i = 0, e = Run.size(); i != e; ++i) {
+		if (Run[i].Serial && Addresses[i])
+			Run[i].Result = ((double (*)())(intptr_t)Addresses[i])();
+	}
+	Pool.wait();
+
+	for (size_t i = 0, e = Run.size(); i != e; ++i) {
+		if (!Addresses[i])
+			continue;
+		fprintf(stderr, "Read top-level expression: ");
+		fprintf(stderr, "Evaluated to %f\n", Run[i].Result);
+		fprintf(stderr, "\n");
+	}
+
+	// Delete the anonymous expression modules from the JIT.
+	if (auto Err = RT->remove())
+		logAllUnhandledErrors(move(Err), errs(), "Error: ");
+	RT = nullptr;
+	Run.clear();
+}
+
+bool ParallelEvaluator::isPure(const FunctionAST* Expression)
+{
+	// Walk everything the expression may call. Once the walk is through without finding an extern, every
+	// function it saw is known to be pure: what they call was walked as well.
+	set<string> Seen;
+	vector<const FunctionAST*> Worklist{ Expression };
+	while (!Worklist.empty()) {
+		CalleeCollector Callees;
+		const_cast<FunctionAST*>(Worklist.back())->accept(&Callees);
+		Worklist.pop_back();
+
+		for (auto& Callee : Callees.Callees) {
+			// Builtin math functions are intrinsics, they have no side effects.
+			if (getBuiltinFunction(Callee) || PureFunctions.count(Callee) || !Seen.insert(Callee).second)
+				continue;
+
+			const FunctionAST* Definition = TheParser.CodeGenVisitor->getDefinition(Callee);
+			if (!Definition)
+				return false;
+			Worklist.push_back(Definition);
+		}
+	}
+
+	PureFunctions.insert(Seen.begin(), Seen.end());
+	return true;
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <set>
+#include <string>
+#include <vector>
+#include "llvm/Support/ThreadPool.h"
+#include "Parser.h"
+
+using namespace std;
+using namespace llvm;
+
+/**
+* Evaluates runs of consecutive top-level expressions together. Expressions are pure unless they call externs
+* (directly, or through the definitions and operators they use), so they don't depend on each other: the
+* expressions of a run are generated as the parser hands them over, into modules of ExpressionsPerModule
+* functions (__anon_expr.<n>), and when the run ends (at a definition, extern or import, or the end of the input)
+* all of them are compiled by one lookup and run on a thread pool. Their results are printed in source order.
+*
+* An expression that may call an extern (or a function of an imported library, whose body isn't known) can have
+* side effects, so those run one after the other in source order on the calling thread, while the pure ones run
+* on the pool. Their results are printed in order with the others, after the run has been executed. Each of them
+* gets a module of its own, so one that fails to link (e.g. it calls an extern that isn't defined) is reported and
+* skipped while the rest of the run goes ahead.
+*
+* Nothing is printed for a run until it has ended, so this is for scripts rather than interactive use. With
+* executor processes (see ExecutorPool.h) expressions already run in parallel, the two aren't combined.
+*/
+
+class ParallelEvaluator {
+public:
+	ParallelEvaluator(Parser& TheParser, unsigned NumThreads)
+		: TheParser(TheParser), Pool(hardware_concurrency(NumThreads)) {}
+
+	/// add - Generates a top-level expression and takes its AST (null if it failed to parse).
+	void add(const FunctionAST* Expression);
+
+	/// flush - Evaluates the expressions added since the last flush and prints their results in order.
+	void flush();
+
+private:
+	static const unsigned ExpressionsPerModule = 256;
+	static const unsigned MaxRunLength = 4096;
+
+	struct Expression {
+		string Name;
+
+		// Runs on the calling thread, in order with the other serial expressions.
+		bool Serial;
+
+		double Result;
+	};
+
+	Parser& TheParser;
+	ThreadPool Pool;
+
+	vector<Expression> Run;
+	orc::ResourceTrackerSP RT;
+
+	// Expressions of the run in the code generator's current module.
+	unsigned InCurrentModule = 0;
+
+	// Functions known not to call externs, for the current run.
+	set<string> PureFunctions;
+
+	// Numbers the expression functions.
+	uint64_t NextExpression = 0;
+
+	// Hands the code generator's current module over to the JIT.
+	void addModule();
+
+	// Whether an expression can't call an extern.
+	bool isPure(const FunctionAST* Expression);
+};
@@ -0,0 +1,128 @@
+#include "stdafx.h"
+#include <algorithm>
+#include <cstring>
+#include "ParallelParser.h"
+#include "llvm/Support/ThreadPool.h"
+
+void ParallelParser::parseRegion(const string& Source, Region& R)
+{
+	Parser P(Lexer(Source.substr(R.Begin, R.End - R.Begin), R.FirstLine), Parser::ParseOnly());
+	memcpy(P.BinopPrecedence, R.BinopPrecedence, sizeof(P.BinopPrecedence));
+	memcpy(P.UnaryOperators, R.UnaryOperators, sizeof(P.UnaryOperators));
+
+	P.getNextToken();
+	for (ParsedItem Item; P.ParseItem(Item); Item = ParsedItem())
+		R.Items.push_back(move(Item));
+}
+
+void ParallelParser::parse(const string& Source, function_ref<void(ParsedItem&)> Handle)
+{
+	ThreadPool Pool(hardware_concurrency(NumThreads));
+
+	// Aim for a few regions per thread so an expensive one doesn't hold up the others.
+	size_t RegionSize = max(MinRegionSize, Source.size() / (NumThreads * 4 + 1));
+
+	// The pre-scan follows operator prototypes ('def'/'extern' then 'unary'/'binary', the operator and the
+	// precedence) and imports (then the library name).
+	enum { scan_none, scan_prototype, scan_unary, scan_binary, scan_precedence, scan_import } State = scan_none;
+	unsigned char Operator = 0;
+	size_t ImportStart = 0;
+
+	Lexer Scanner(Source);
+	Token Tok = Scanner.getToken();
+	while (Tok.getType() != tok_eof) {
+		// A segment starts with the parser's tables as they are after handling everything before it.
+		int BinopPrecedence[256];
+		bool UnaryOperators[256];
+		memcpy(BinopPrecedence, TheParser.BinopPrecedence, sizeof(BinopPrecedence));
+		memcpy(UnaryOperators, TheParser.UnaryOperators, sizeof(UnaryOperators));
+
+		vector<unique_ptr<Region>> Regions;
+		auto StartRegion = [&]() {
+			auto R = make_unique<Region>();
+			R->Begin = Scanner.getTokenStart();
+			R->End = Source.size();
+			R->FirstLine = Scanner.getTokenLine();
+			memcpy(R->BinopPrecedence, BinopPrecedence, sizeof(BinopPrecedence));
+			memcpy(R->UnaryOperators, UnaryOperators, sizeof(UnaryOperators));
+			Regions.push_back(move(R));
+		};
+		StartRegion();
+
+		string ImportName;
+		bool AfterSemicolon = false;
+		for (; Tok.getType() != tok_eof; Tok = Scanner.getToken()) {
+			size_t Start = Scanner.getTokenStart();
+
+			if (State == scan_import) {
+				State = scan_none;
+				if (Tok.getType() == tok_string) {
+					Regions.back()->End = ImportStart;
+					ImportName = Parser::getLibraryFileName(Tok.getIdentifierString());
+					Tok = Scanner.getToken();
+					break;
+				}
+				// A malformed import is left for the region's parser to report.
+			}
+
+			bool Boundary = AfterSemicolon || Tok.getType() == tok_def || Tok.getType() == tok_extern ||
+				Tok.getType() == tok_import;
+			AfterSemicolon = Tok.getType() == tok_char && Tok.getNumValue() == ';';
+			if (Boundary && Start - Regions.back()->Begin >= RegionSize) {
+				Regions.back()->End = Start;
+				StartRegion();
+			}
+
+			switch (State) {
+			case scan_prototype:
+				State = Tok.getType() == tok_unary ? scan_unary : Tok.getType() == tok_binary ? scan_binary : scan_none;
+				break;
+			case scan_unary:
+				if (Tok.getType() == tok_char)
+					UnaryOperators[(unsigned char)Tok.getNumValue()] = true;
+				State = scan_none;
+				break;
+			case scan_binary:
+				Operator = (unsigned char)Tok.getNumValue();
+				State = Tok.getType() == tok_char ? scan_precedence : scan_none;
+				break;
+			case scan_precedence:
+				// Same defaults and limits as Parser::ParsePrototype.
+				if (Tok.getType() != tok_number)
+					BinopPrecedence[Operator] = 30;
+				else if (Tok.getNumValue() >= 1 && Tok.getNumValue() <= 100)
+					BinopPrecedence[Operator] = (int)Tok.getNumValue();
+				State = scan_none;
+				break;
+			default:
+				if (Tok.getType() == tok_def || Tok.getType() == tok_extern)
+					State = scan_prototype;
+				else if (Boundary && Tok.getType() == tok_import) {
+					State = scan_import;
+					ImportStart = Start;
+				}
+				break;
+			}
+		}
+
+		vector<shared_future<void>> Parsed;
+		for (auto& R : Regions) {
+			Region* Unowned = R.get();
+			Parsed.push_back(Pool.async([&Source, Unowned]() { parseRegion(Source, *Unowned); }));
+		}
+
+		for (size_t i = 0, e = Regions.size(); i != e; ++i) {
+			Parsed[i].wait();
+			for (auto& Item : Regions[i]->Items)
+				Handle(Item);
+			Regions[i]->Items.clear();
+		}
+
+		if (!ImportName.empty()) {
+			ParsedItem Import;
+			Import.Kind = ParsedItem::item_import;
+			Import.LibraryName = ImportName;
+			Handle(Import);
+		}
+	}
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include "llvm/ADT/STLExtras.h"
+#include "Parser.h"
+
+using namespace std;
+using namespace llvm;
+
+/**
+* Parses a whole source buffer on a thread pool. A serial pre-scan with just the lexer splits the source into
+* regions at top-level boundaries ('def', 'extern', 'import' and after ';', like the incremental compiler's
+* chunks), each a task for a parser of its own. The items come back to the calling thread in source order, and
+* each item's errors are printed right before it is handled, so the output is the same for any number of threads.
+*
+* Parsing depends on state that earlier items change: the operators defined ('def binary| 5 ...') and imported.
+* The pre-scan follows operator prototypes itself, so every region starts with the operator tables the serial
+* parse would have there. Imports can't be followed without opening the library, so an import ends a segment of
+* regions: the segment is parsed and handled, then the import, and only then the rest of the source is scanned.
+* Code generation overlaps with parsing, region i is handled while the regions after it are still being parsed.
+*/
+
+class ParallelParser {
+public:
+	ParallelParser(Parser& TheParser, unsigned NumThreads) : TheParser(TheParser), NumThreads(NumThreads) {}
+
+	/// parse - Parses Source and hands its items to Handle in source order, on this thread.
+	void parse(const string& Source, function_ref<void(ParsedItem&)> Handle);
+
+private:
+	// A run of top-level items parsed by one task.
+	struct Region {
+		size_t Begin, End;
+		unsigned FirstLine;
+
+		// The parser's operator tables at the start of the region.
+		int BinopPrecedence[256];
+		bool UnaryOperators[256];
+
+		vector<ParsedItem> Items;
+	};
+
+	Parser& TheParser;
+	unsigned NumThreads;
+
+	// Regions are cut at the first boundary past this many bytes (at least), so tasks aren't too small to pay off.
+	static const size_t MinRegionSize = 16 * 1024;
+
+	static void parseRegion(const string& Source, Region& R);
+};
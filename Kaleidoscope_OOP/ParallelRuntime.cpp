@@ -0,0 +1,129 @@
+#include "stdafx.h"
+#include <algorithm>
+#include "ParallelRuntime.h"
+
+// Set while a thread runs chunks, the loops it starts in the meantime run on their own.
+static thread_local bool RunningChunks = false;
+
+ParallelRuntime& ParallelRuntime::get()
+{
+	static ParallelRuntime Runtime(std::max(std::thread::hardware_concurrency(), 1u));
+	return Runtime;
+}
+
+ParallelRuntime::ParallelRuntime(unsigned NumThreads)
+{
+	for (unsigned i = 0; i != NumThreads; ++i)
+		Queues.push_back(make_unique<WorkQueue>());
+	for (unsigned i = 1; i != NumThreads; ++i)
+		Workers.emplace_back([this, i]() { workerLoop(i); });
+}
+
+ParallelRuntime::~ParallelRuntime()
+{
+	{
+		lock_guard<mutex> Lock(WakeLock);
+		ShuttingDown = true;
+	}
+	WakeUp.notify_all();
+	for (auto& Worker : Workers)
+		Worker.join();
+}
+
+double ParallelRuntime::run(ChunkFunction Chunk, void* Env, int64_t Begin, int64_t End)
+{
+	if (End <= Begin)
+		return 0.0;
+
+	int64_t Length = End - Begin;
+	int64_t ChunkSize = (Length + MaxChunks - 1) / MaxChunks;
+	unsigned NumChunks = (unsigned)((Length + ChunkSize - 1) / ChunkSize);
+
+	unique_lock<mutex> Running(LoopLock, defer_lock);
+	if (RunningChunks || Workers.empty() || NumChunks == 1 || !Running.try_lock()) {
+		double Sum = 0.0;
+		for (unsigned C = 0; C != NumChunks; ++C)
+			Sum += Chunk(Env, Begin + C * ChunkSize, std::min(End, Begin + (C + 1) * ChunkSize));
+		return Sum;
+	}
+
+	this->Chunk = Chunk;
+	this->Env = Env;
+	this->Begin = Begin;
+	this->End = End;
+	this->ChunkSize = ChunkSize;
+	Sums.assign(NumChunks, 0.0);
+	ChunksLeft.store(NumChunks, memory_order_relaxed);
+
+	unsigned NumQueues = (unsigned)Queues.size();
+	for (unsigned Q = 0; Q != NumQueues; ++Q) {
+		lock_guard<mutex> Lock(Queues[Q]->Lock);
+		for (unsigned C = Q * NumChunks / NumQueues, E = (Q + 1) * NumChunks / NumQueues; C != E; ++C)
+			Queues[Q]->Chunks.push_back(C);
+	}
+	{
+		lock_guard<mutex> Lock(WakeLock);
+		++Generation;
+	}
+	WakeUp.notify_all();
+
+	work(0);
+
+	// The last chunks may still be running on other threads.
+	while (ChunksLeft.load(memory_order_acquire) != 0)
+		std::this_thread::yield();
+
+	double Sum = 0.0;
+	for (double ChunkSum : Sums)
+		Sum += ChunkSum;
+	return Sum;
+}
+
+void ParallelRuntime::workerLoop(unsigned Index)
+{
+	uint64_t Seen = 0;
+	while (true) {
+		{
+			unique_lock<mutex> Lock(WakeLock);
+			WakeUp.wait(Lock, [&]() { return ShuttingDown || Generation != Seen; });
+			if (ShuttingDown)
+				return;
+			Seen = Generation;
+		}
+		work(Index);
+	}
+}
+
+void ParallelRuntime::work(unsigned Index)
+{
+	RunningChunks = true;
+	unsigned C;
+	while (takeChunk(Index, C)) {
+		int64_t ChunkBegin = Begin + C * ChunkSize;
+		Sums[C] = Chunk(Env, ChunkBegin, std::min(End, ChunkBegin + ChunkSize));
+		ChunksLeft.fetch_sub(1, memory_order_release);
+	}
+	RunningChunks = false;
+}
+
+bool ParallelRuntime::takeChunk(unsigned Index, unsigned& C)
+{
+	unsigned NumQueues = (unsigned)Queues.size();
+	for (unsigned i = 0; i != NumQueues; ++i) {
+		WorkQueue& Queue = *Queues[(Index + i) % NumQueues];
+		lock_guard<mutex> Lock(Queue.Lock);
+		if (Queue.Chunks.empty())
+			continue;
+
+		if (i == 0) {
+			C = Queue.Chunks.back();
+			Queue.Chunks.pop_back();
+		}
+		else {
+			C = Queue.Chunks.front();
+			Queue.Chunks.pop_front();
+		}
+		return true;
+	}
+	return false;
+}
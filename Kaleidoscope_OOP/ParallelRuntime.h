@@ -0,0 +1,81 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/**
+* The runtime of the parallel loops (parallelfor and parallelsum, see ParallelExprAST in AST.h). The code
+* generator outlines a loop's body into a chunk function, which runs the iterations [Begin, End) in order and
+* returns the sum of their values, and calls run() with it through the JIT symbol __kaleidoscope_parallel.
+*
+* run() cuts the range into chunks whose size only depends on its length (there are at most MaxChunks). Every
+* thread starts with an equal, contiguous share of the chunks in a deque of its own. It takes chunks off the
+* back of its deque, and once that's empty steals them off the front of the others', so chunks that take longer
+* than others even out. The calling thread works along. The chunks' sums are added up in chunk order at the end,
+* so a loop's result doesn't depend on the number of threads or on who ran what.
+*
+* One loop runs at a time. A loop started while another one runs (from within a loop's body, or on another
+* thread) runs on its calling thread alone, with the same chunks in the same order, so its result is the same.
+*/
+
+class ParallelRuntime {
+public:
+	typedef double (*ChunkFunction)(void* Env, int64_t Begin, int64_t End);
+
+	/// get - The runtime of the process, with a thread per hardware thread.
+	static ParallelRuntime& get();
+
+	/// run - Runs Chunk over [Begin, End) and returns the sum of what the chunks returned.
+	double run(ChunkFunction Chunk, void* Env, int64_t Begin, int64_t End);
+
+	/// runLoop - run() for JIT'd code.
+	static double runLoop(ChunkFunction Chunk, void* Env, int64_t Begin, int64_t End) {
+		return get().run(Chunk, Env, Begin, End);
+	}
+
+	~ParallelRuntime();
+
+private:
+	static const int64_t MaxChunks = 1024;
+
+	// Chunk indices of the running loop. The owner pops the back, thieves the front.
+	struct WorkQueue {
+		mutex Lock;
+		deque<unsigned> Chunks;
+	};
+
+	// Queues[0] belongs to the thread that runs the loop, the others to Workers[i - 1].
+	vector<unique_ptr<WorkQueue>> Queues;
+	vector<std::thread> Workers;
+
+	// Held while a loop runs.
+	mutex LoopLock;
+
+	// The running loop. Written before its chunks are queued, and only read by threads that took one of them.
+	ChunkFunction Chunk = nullptr;
+	void* Env = nullptr;
+	int64_t Begin = 0, End = 0, ChunkSize = 1;
+	vector<double> Sums;
+	atomic<unsigned> ChunksLeft{ 0 };
+
+	// Wakes the workers for a loop (Generation counts them), or to exit.
+	mutex WakeLock;
+	condition_variable WakeUp;
+	uint64_t Generation = 0;
+	bool ShuttingDown = false;
+
+	ParallelRuntime(unsigned NumThreads);
+
+	void workerLoop(unsigned Index);
+
+	// Runs chunks until there are none left to take, for the thread owning Queues[Index].
+	void work(unsigned Index);
+	bool takeChunk(unsigned Index, unsigned& C);
+};
@@ -1,5 +1,8 @@
 #include "stdafx.h"
 #include "Parser.h"
+#include "ParallelParser.h"
+#include "ParallelEvaluator.h"
+#include "llvm/Support/Path.h"
 
 /**
 * Changes made by justice: all memory allocation for AST's happens here. All AST's are collapsed into one large
@@ -10,7 +13,16 @@
 
 Token Parser::getNextToken()
 {
-	return CurTok = Scanner.getToken();
+	if (TokenSource) {
+		TokenSource(CurTok, PrevTokEnd, CurLoc);
+		return CurTok;
+	}
+
+	PrevTokEnd = Scanner.getOffset();
+	CurTok = Scanner.getToken();
+	CurLoc.Line = Scanner.getTokenLine();
+	CurLoc.Column = Scanner.getTokenColumn();
+	return CurTok;
 }
 
 int Parser::GetTokPrecedence()
@@ -19,42 +31,175 @@ int Parser::GetTokPrecedence()
 		return -1;
 
 	// Make sure it's a declared binop.
-	int TokPrec = BinopPrecedence[CurTok.getNumValue()];
+	int TokPrec = BinopPrecedence[(unsigned char)CurTok.getNumValue()];
 	if (TokPrec <= 0)
 		return -1;
 	return TokPrec;
 }
 
+/**
+* Expressions are parsed with an explicit stack of the operators waiting for their right operand (operator
+* precedence parsing) rather than by recursing per operator and parenthesis, so deeply nested formulas don't use up
+* the native stack (see AST.h). Operators of equal precedence are folded as soon as the next one is read, so a long
+* chain of them leaves the stack empty and is parsed in linear time.
+*/
+
 const ExprAST* Parser::ParseExpression()
 {
-	auto LHS = ParsePrimary();
-	if (!LHS)
+	// A unary operator, a binary operator with its left operand, or an open parenthesis.
+	struct PendingOperator {
+		enum PendingKind { pending_unary, pending_binary, pending_paren } Kind;
+		char Op;
+		int Precedence;
+		SourceLocation Loc;
+		const ExprAST* LHS;
+	};
+	vector<PendingOperator> Pending;
+
+	// Deletes what has been parsed when there's an error.
+	auto discard = [&](const ExprAST* Operand) -> const ExprAST* {
+		vector<const ExprAST*> Parsed{ Operand };
+		for (auto& P : Pending)
+			Parsed.push_back(P.LHS);
+		deleteExprs(Parsed);
 		return nullptr;
+	};
 
-	return ParseBinOpRHS(0, LHS);
+	while (true) {
+		// Unary operators and open parentheses in front of the operand.
+		while (CurTok.getType() == tok_char) {
+			char C = CurTok.getNumValue();
+			if (UnaryOperators[(unsigned char)C])
+				Pending.push_back({ PendingOperator::pending_unary, C, 0, CurLoc, nullptr });
+			else if (C == '(')
+				Pending.push_back({ PendingOperator::pending_paren, C, 0, CurLoc, nullptr });
+			else
+				break;
+			getNextToken();
+		}
+
+		const ExprAST* Operand = ParsePrimary();
+		if (!Operand)
+			return discard(nullptr);
+
+		while (true) {
+			// Unary operators bind tighter than any binary operator.
+			while (!Pending.empty() && Pending.back().Kind == PendingOperator::pending_unary) {
+				Operand = located(new UnaryExprAST(Pending.back().Op, Operand), Pending.back().Loc);
+				Pending.pop_back();
+			}
+
+			// Binary operators binding at least as tightly as the next one take the operand as their right hand
+			// side. Folding equal precedences makes operators associate to the left. Anything that isn't a binary
+			// operator ends the expression or the parenthesis, so everything up to the parenthesis folds.
+			int TokPrec = GetTokPrecedence();
+			while (!Pending.empty() && Pending.back().Kind == PendingOperator::pending_binary &&
+				Pending.back().Precedence >= TokPrec) {
+				Operand = located(new BinaryExprAST(Pending.back().Op, Pending.back().LHS, Operand), Pending.back().Loc);
+				Pending.pop_back();
+			}
+
+			if (TokPrec > 0) {
+				Pending.push_back({ PendingOperator::pending_binary, (char)CurTok.getNumValue(), TokPrec, CurLoc, Operand });
+				getNextToken(); // eat binop
+				break;
+			}
+
+			if (Pending.empty())
+				return Operand;
+
+			if (CurTok.getType() != tok_char || CurTok.getNumValue() != ')') {
+				LogError("expected ')'");
+				return discard(Operand);
+			}
+			getNextToken(); // eat ).
+			Pending.pop_back();
+		}
+	}
 }
 
 const PrototypeAST* Parser::ParsePrototype()
 {
-	if (CurTok.getType() != tok_identifier)
-		return LogErrorP("Expected function name in prototype");
+	string FnName;
+	SourceLocation FnLoc = CurLoc;
 
-	string FnName = CurTok.getIdentifierString();
-	getNextToken();
+	unsigned Kind = 0; // 0 = identifier, 1 = unary, 2 = binary.
+	unsigned BinaryPrecedence = 30;
+
+	switch (CurTok.getType()) {
+	case tok_identifier:
+		FnName = CurTok.getIdentifierString();
+		getNextToken();
+		break;
+	case tok_unary:
+	case tok_binary: {
+		Kind = CurTok.getType() == tok_unary ? 1 : 2;
+		getNextToken(); // eat unary/binary.
+
+		// Characters that already mean something to the parser can't be operators.
+		char Op = CurTok.getNumValue();
+		if (CurTok.getType() != tok_char || string("(),;[]=:").find(Op) != string::npos)
+			return LogErrorP("Expected operator character");
+		if (Kind == 2 && isBuiltinBinaryOperator(Op))
+			return LogErrorP("Builtin operators can't be redefined");
+
+		FnName = (Kind == 1 ? "unary" : "binary") + string(1, Op);
+		getNextToken();
+
+		// Read the precedence if present.
+		if (Kind == 2 && CurTok.getType() == tok_number) {
+			if (CurTok.getNumValue() < 1 || CurTok.getNumValue() > 100)
+				return LogErrorP("Invalid precedence: must be 1..100");
+			BinaryPrecedence = (unsigned)CurTok.getNumValue();
+			getNextToken();
+		}
+		break;
+	}
+	default:
+		return LogErrorP("Expected function name in prototype");
+	}
 
 	if (CurTok.getNumValue() != '(')
 		return LogErrorP("Expected '(' in prototype");
 
 	vector<string> ArgNames;
-	while (getNextToken().getType() == tok_identifier)
+	vector<ValueType> ArgTypes;
+	getNextToken(); // eat '('.
+	while (CurTok.getType() == tok_identifier) {
 		ArgNames.push_back(CurTok.getIdentifierString());
+		getNextToken(); // eat identifier.
+
+		// Arguments are doubles unless annotated otherwise.
+		ValueType ArgType = type_f64;
+		if (!ParseTypeAnnotation(ArgType, true))
+			return nullptr;
+		ArgTypes.push_back(ArgType);
+	}
 	if (CurTok.getNumValue() != ')')
 		return LogErrorP("Expected ')' in prototype");
 
-	// success.
 	getNextToken(); // eat ')'.
 
-	return new PrototypeAST(FnName, move(ArgNames));
+	// The return type is inferred from the body when it isn't annotated.
+	ValueType ReturnType = type_unknown;
+	if (!ParseTypeAnnotation(ReturnType))
+		return nullptr;
+
+	// Verify right number of names for operator.
+	if (Kind && ArgNames.size() != Kind)
+		return LogErrorP("Invalid number of operands for operator");
+
+	// Install operators straight away so the body and everything that follows parses with them.
+	unsigned char OpIndex = FnName.back();
+	if (Kind == 1)
+		UnaryOperators[OpIndex] = true;
+	else if (Kind == 2)
+		BinopPrecedence[OpIndex] = BinaryPrecedence;
+
+	// success.
+	auto Proto = new PrototypeAST(FnName, move(ArgNames), move(ArgTypes), ReturnType, Kind != 0, BinaryPrecedence);
+	Proto->Loc = FnLoc;
+	return Proto;
 }
 
 const FunctionAST* Parser::ParseDefinition()
@@ -65,15 +210,17 @@ const FunctionAST* Parser::ParseDefinition()
 		return nullptr;
 
 	if (auto E = ParseExpression())
-		return new FunctionAST(FunctionAST(Proto, E));
+		return new FunctionAST(Proto, E);
 	return nullptr;
 }
 
 const FunctionAST* Parser::ParseTopLevelExpr()
 {
+	SourceLocation ExprLoc = CurLoc;
 	if (auto E = ParseExpression()) {
-		// Make an anonymous proto.
-		auto Proto = new PrototypeAST("__anon_expr", vector<string>());
+		// Make an anonymous proto. It always returns a double since that's how the JIT'd code is called.
+		auto Proto = new PrototypeAST("__anon_expr", vector<string>(), vector<ValueType>(), type_f64);
+		Proto->Loc = ExprLoc;
 		return new FunctionAST(Proto, E);
 	}
 	return nullptr;
@@ -82,126 +229,327 @@ const FunctionAST* Parser::ParseTopLevelExpr()
 const PrototypeAST* Parser::ParseExtern()
 {
 	getNextToken(); // eat extern.
-	return ParsePrototype();
+	auto Proto = ParsePrototype();
+
+	// There is no body to infer the return type of an extern from, so it defaults to a double.
+	if (Proto && Proto->ReturnType == type_unknown)
+		const_cast<PrototypeAST*>(Proto)->ReturnType = type_f64;
+	return Proto;
 }
 
-void Parser::HandleDefinition()
+bool Parser::ParseItem(ParsedItem& Item)
 {
-	const FunctionAST* Definition = ParseDefinition();
-	if (Definition) {
-		fprintf(stderr, "Parsed a function definition.\n");
-		if (auto* FnIR = const_cast<FunctionAST*>(Definition)->accept(CodeGenVisitor)) {
-			fprintf(stderr, "Read function definition:");
-			FnIR->print(errs());
-			fprintf(stderr, "\n");
+	// ignore top-level semicolons.
+	while (CurTok.getType() == tok_char && CurTok.getNumValue() == ';')
+		getNextToken();
+	if (CurTok.getType() == tok_eof)
+		return false;
 
-			auto TSM = orc::ThreadSafeModule(
-				move(unique_ptr<Module>(CodeGenVisitor->TheModule)),
-				move(unique_ptr<LLVMContext>(CodeGenVisitor->TheContext))
-			);
+	switch (CurTok.getType()) {
+	case tok_def:
+		Item.Kind = ParsedItem::item_definition;
+		Item.Function = ParseDefinition();
+		break;
+	case tok_extern:
+		Item.Kind = ParsedItem::item_extern;
+		Item.Extern = ParseExtern();
+		break;
+	case tok_import:
+		// A malformed import leaves the unexpected token to be parsed as the next item.
+		Item.Kind = ParsedItem::item_import;
+		ParseImport(Item.LibraryName);
+		break;
+	default:
+		// Anything else starts a top-level expression (e.g. a unary operator or a parenthesis).
+		Item.Kind = ParsedItem::item_expression;
+		Item.Function = ParseTopLevelExpr();
+		break;
+	}
 
-			CodeGenVisitor->JIT.ExitOnError(CodeGenVisitor->JIT.TheJIT->addModule(move(TSM)));
-			
-			CodeGenVisitor->InitializeModuleAndPassManager();
+	// Skip token for error recovery.
+	if (!Item.Function && !Item.Extern && Item.Kind != ParsedItem::item_import)
+		getNextToken();
+
+	Item.Diagnostics = move(Diagnostics);
+	Diagnostics.clear();
+	return true;
+}
+
+void Parser::HandleItem(ParsedItem& Item)
+{
+	fputs(Item.Diagnostics.c_str(), stderr);
+
+	// A run of top-level expressions is evaluated once it ends, before anything else changes the JIT.
+	if (Evaluator) {
+		if (Item.Kind == ParsedItem::item_expression) {
+			Evaluator->add(Item.Function);
+			return;
 		}
+		Evaluator->flush();
 	}
-	else {
-		// Skip token for error recovery.
-		getNextToken();
+
+	switch (Item.Kind) {
+	case ParsedItem::item_definition:
+		HandleDefinition(Item.Function);
+		break;
+	case ParsedItem::item_extern:
+		HandleExtern(Item.Extern);
+		break;
+	case ParsedItem::item_expression:
+		HandleTopLevelExpression(Item.Function);
+		break;
+	case ParsedItem::item_import:
+		if (!Item.LibraryName.empty())
+			ImportLibrary(Item.LibraryName);
+		break;
+	default:
+		break;
 	}
 }
 
-void Parser::HandleExtern()
+void Parser::HandleDefinition(const FunctionAST* Definition)
 {
-	const PrototypeAST* Extern = ParseExtern();
-	if (Extern) {
-		fprintf(stderr, "Parsed an extern\n");
-		if (auto* FnIR = const_cast<PrototypeAST*>(Extern)->accept(CodeGenVisitor)) {
-			fprintf(stderr, "Read extern: ");
-			FnIR->print(errs());
-			fprintf(stderr, "\n");
-			CodeGenVisitor->FunctionProtos[Extern->Name] = move(Extern);
-		}
+	if (!Definition)
+		return;
 
-		delete Extern; // Clean up the memory allocated for this AST node
+	fprintf(stderr, "Parsed a function definition.\n");
+	if (auto* FnIR = const_cast<FunctionAST*>(Definition)->accept(CodeGenVisitor)) {
+		fprintf(stderr, "Read function definition:");
+		FnIR->print(errs());
+		fprintf(stderr, "\n");
+
+		CodeGenVisitor->AddModuleToJIT();
+	}
+}
+
+void Parser::HandleExtern(const PrototypeAST* Extern)
+{
+	if (!Extern)
+		return;
+
+	fprintf(stderr, "Parsed an extern\n");
+	if (auto* FnIR = const_cast<PrototypeAST*>(Extern)->accept(CodeGenVisitor)) {
+		fprintf(stderr, "Read extern: ");
+		FnIR->print(errs());
+		fprintf(stderr, "\n");
+		// FunctionProtos owns the prototype from here on.
+		CodeGenVisitor->FunctionProtos[Extern->Name] = move(Extern);
 	}
 	else {
-		// Skip token for error recovery.
-		getNextToken();
+		delete Extern; // Clean up the memory allocated for this AST node
 	}
 }
 
-void Parser::HandleTopLevelExpression()
+bool Parser::EvaluateTopLevelExpression(const FunctionAST* TopLevelExpression, double& Result)
+{
+	if (!const_cast<FunctionAST*>(TopLevelExpression)->accept(CodeGenVisitor))
+		return false;
+
+	// Notes from Justice: This is where JIT implementation starts!
+
+	// Create a ResourceTracker to track JIT'd memory allocated to our
+	// anonymous expression -- that way we can free it after executing.
+	auto RT = CodeGenVisitor->JIT.getJITDylib().createResourceTracker();
+	CodeGenVisitor->AddModuleToJIT(RT);
+
+	// Search the JIT for the __anon_expr symbol.
+	auto ExprSymbol = CodeGenVisitor->JIT.ExitOnError(
+		CodeGenVisitor->JIT.TheJIT->lookup(CodeGenVisitor->JIT.getJITDylib(), "__anon_expr"));
+
+	// Get the symbol's address and cast it to the right type (takes no
+	// arguments, returns a double) so we can call it as a native function.
+	double (*FP)() = (double (*)())(intptr_t)ExprSymbol.getAddress();
+	Result = FP();
+
+	// Delete the anonymous expression module from the JIT.
+	CodeGenVisitor->JIT.ExitOnError(RT->remove());
+	return true;
+}
+
+void Parser::HandleTopLevelExpression(const FunctionAST* TopLevelExpression)
 {
 	// Evaluate a top-level expression into an anonymous function.
-	const FunctionAST* TopLevelExpression = ParseTopLevelExpr();
-	if (TopLevelExpression) {
-		fprintf(stderr, "Parsed a top-level expr\n");
-		if (auto* FnIR = const_cast<FunctionAST*>(TopLevelExpression)->accept(CodeGenVisitor)) {
-			fprintf(stderr, "Read top-level expression: ");
-			// Notes from Justice: This is where JIT implementation starts!
-
-			// Create a ResourceTracker to track JIT'd memory allocated to our
-			// anonymous expression -- that way we can free it after executing.
-			auto RT = CodeGenVisitor->JIT.TheJIT->getMainJITDylib().createResourceTracker();
-
-			auto TSM = orc::ThreadSafeModule(
-				move(unique_ptr<Module>(CodeGenVisitor->TheModule)),
-				move(unique_ptr<LLVMContext>(CodeGenVisitor->TheContext))
-			);
-
-			CodeGenVisitor->JIT.ExitOnError(CodeGenVisitor->JIT.TheJIT->addModule(move(TSM), RT));
-			CodeGenVisitor->InitializeModuleAndPassManager();
-
-			// Search the JIT for the __anon_expr symbol.
-			auto ExprSymbol = CodeGenVisitor->JIT.ExitOnError(CodeGenVisitor->JIT.TheJIT->lookup("__anon_expr"));
-
-			// Get the symbol's address and cast it to the right type (takes no
-			// arguments, returns a double) so we can call it as a native function.
-			double (*FP)() = (double (*)())(intptr_t)ExprSymbol.getAddress();
-			fprintf(stderr, "Evaluated to %f\n", FP());
-
-			// Delete the anonymous expression module from the JIT.
-			CodeGenVisitor->JIT.ExitOnError(RT->remove());
-			fprintf(stderr, "\n");
+	if (!TopLevelExpression)
+		return;
+
+	fprintf(stderr, "Parsed a top-level expr\n");
+	double Result;
+	if (CodeGenVisitor->Executors) {
+		// The executor prints the result once it has run the expression, parsing carries on meanwhile.
+		if (const_cast<FunctionAST*>(TopLevelExpression)->accept(CodeGenVisitor)) {
+			CodeGenVisitor->finalizeDebugInfo();
+			uint64_t Id = CodeGenVisitor->Executors->evaluate(*CodeGenVisitor->TheModule);
+			fprintf(stderr, "Sent top-level expression #%llu to an executor\n", (unsigned long long)Id);
 		}
-		delete TopLevelExpression; // Clean up the memory allocated for this AST node
+		CodeGenVisitor->DiscardModule();
+	}
+	else if (EvaluateTopLevelExpression(TopLevelExpression, Result)) {
+		fprintf(stderr, "Read top-level expression: ");
+		fprintf(stderr, "Evaluated to %f\n", Result);
+		fprintf(stderr, "\n");
+	}
+
+	// Clean up the memory allocated for this AST node (the code generator still knows its prototype).
+	CodeGenVisitor->forgetFunction("__anon_expr");
+	delete TopLevelExpression;
+}
+
+string Parser::getLibraryFileName(string Name)
+{
+	// import "mathlib" refers to mathlib.ksl.
+	if (sys::path::extension(Name).empty())
+		Name += ".ksl";
+	return Name;
+}
+
+bool Parser::ParseImport(string& FileName)
+{
+	getNextToken(); // eat import.
+	if (CurTok.getType() != tok_string) {
+		LogError("Expected a library name in quotes after import");
+		return false;
+	}
+
+	FileName = getLibraryFileName(CurTok.getIdentifierString());
+	getNextToken(); // eat the library name.
+	return true;
+}
+
+void Parser::HandleImport()
+{
+	string FileName;
+	if (ParseImport(FileName))
+		ImportLibrary(FileName);
+}
+
+void Parser::ImportLibrary(const string& FileName)
+{
+	const CompiledLibrary* Library = CodeGenVisitor->importLibrary(FileName);
+	if (!Library)
+		return;
+	if (CodeGenVisitor->Executors)
+		CodeGenVisitor->Executors->importLibrary(FileName);
+
+	// Imported operators parse like the ones defined here. They're called rather than inlined though, there
+	// is no AST to inline.
+	for (auto& Proto : Library->Prototypes) {
+		unsigned char OpIndex = Proto->getOperatorName();
+		if (Proto->isUnaryOp())
+			UnaryOperators[OpIndex] = true;
+		else if (Proto->isBinaryOp())
+			BinopPrecedence[OpIndex] = Proto->Precedence;
+	}
+
+	fprintf(stderr, "Imported %u functions from %s\n", (unsigned)Library->Prototypes.size(), FileName.c_str());
+}
+
+bool Parser::AddLibraryItem(ParsedItem& Item, vector<const PrototypeAST*>& Exported)
+{
+	fputs(Item.Diagnostics.c_str(), stderr);
+
+	switch (Item.Kind) {
+	case ParsedItem::item_extern:
+		HandleExtern(Item.Extern);
+		return true;
+	case ParsedItem::item_import:
+		if (!Item.LibraryName.empty())
+			ImportLibrary(Item.LibraryName);
+		return true;
+	case ParsedItem::item_expression:
+		LogError("A library can only contain definitions, externs and imports");
+		delete Item.Function;
+		return false;
+	case ParsedItem::item_definition:
+		break;
+	default:
+		return true;
+	}
+
+	const FunctionAST* Definition = Item.Function;
+	if (!Definition)
+		return false;
+
+	// All definitions go into the same module, so the library can't define a function twice.
+	Function* Existing = CodeGenVisitor->TheModule->getFunction(Definition->Proto->Name);
+	if (Existing && !Existing->isDeclaration()) {
+		fprintf(stderr, "Error: %s is defined twice\n", Definition->Proto->Name.c_str());
+		return false;
+	}
+	if (!const_cast<FunctionAST*>(Definition)->accept(CodeGenVisitor))
+		return false;
+
+	Exported.push_back(Definition->Proto);
+	return true;
+}
+
+bool Parser::BuildLibrary(const string& FileName, unsigned ParseThreads)
+{
+	vector<const PrototypeAST*> Exported;
+	bool Failed = false;
+	auto AddItem = [&](ParsedItem& Item) {
+		if (!AddLibraryItem(Item, Exported))
+			Failed = true;
+	};
+
+	if (ParseThreads && Scanner.getSource()) {
+		ParallelParser(*this, ParseThreads).parse(*Scanner.getSource(), AddItem);
 	}
 	else {
-		// Skip token for error recovery.
 		getNextToken();
+		for (ParsedItem Item; ParseItem(Item); Item = ParsedItem())
+			AddItem(Item);
 	}
+
+	if (Failed)
+		return false;
+	if (!CodeGenVisitor->writeLibrary(FileName, Exported))
+		return false;
+
+	fprintf(stderr, "Wrote %u functions to %s\n", (unsigned)Exported.size(), FileName.c_str());
+	return true;
 }
 
-void Parser::MainLoop()
+bool Parser::GenerateModules(vector<orc::ThreadSafeModule>& Modules)
 {
 	getNextToken();
+	for (ParsedItem Item; ParseItem(Item); Item = ParsedItem()) {
+		fputs(Item.Diagnostics.c_str(), stderr);
+		if (Item.Kind == ParsedItem::item_extern) {
+			HandleExtern(Item.Extern);
+			continue;
+		}
+		if (Item.Kind != ParsedItem::item_definition) {
+			LogError("Only definitions and externs can be generated into modules");
+			delete Item.Function;
+			return false;
+		}
+		if (!Item.Function || !const_cast<FunctionAST*>(Item.Function)->accept(CodeGenVisitor))
+			return false;
+		Modules.push_back(CodeGenVisitor->takeModule());
+	}
+	return true;
+}
 
-	while (true) {
-		fprintf(stderr, "ready> ");
-		switch (CurTok.getType()) {
-		case tok_eof:
-			return;
-		case tok_char:
-			if (CurTok.getNumValue() == ';') {
-				// ignore top-level semicolons.
-				getNextToken();
+void Parser::MainLoop(unsigned ParseThreads)
+{
+	if (ParseThreads && Scanner.getSource()) {
+		ParallelParser(*this, ParseThreads).parse(*Scanner.getSource(), [this](ParsedItem& Item) {
+			HandleItem(Item);
+		});
+	}
+	else {
+		getNextToken();
+		while (true) {
+			fprintf(stderr, "ready> ");
+			ParsedItem Item;
+			if (!ParseItem(Item))
 				break;
-			}
-
-			// fallthrough to default
-			HandleTopLevelExpression();
-		case tok_def:
-			HandleDefinition();
-			break;
-		case tok_extern:
-			HandleExtern();
-			break;
-		default:
-			HandleTopLevelExpression();
-			break;
+			HandleItem(Item);
 		}
 	}
+
+	if (Evaluator)
+		Evaluator->flush();
 }
 
 void Parser::PrintLLIRModule()
@@ -210,9 +558,32 @@ void Parser::PrintLLIRModule()
 	CodeGenVisitor->PrintIR();
 }
 
+void Parser::PrintJITMemoryUsage()
+{
+	CodeGenVisitor->JIT.TheJIT->getMemoryPool().printUsage(errs());
+}
+
+bool Parser::FuseKernel(const string& Name, const vector<string>& Formulas, vector<string>& InputColumns)
+{
+	// The host calls the kernel, so it has to be in this process.
+	if (CodeGenVisitor->Executors) {
+		LogError("Fused kernels can't run in executor processes");
+		return false;
+	}
+
+	if (!CodeGenVisitor->emitFusedKernel(Name, Formulas, InputColumns))
+		return false;
+
+	CodeGenVisitor->AddModuleToJIT();
+	return true;
+}
+
 const ExprAST* Parser::LogError(const char * Str)
 {
-	fprintf(stderr, "Error: %s\n", Str);
+	if (BufferDiagnostics)
+		Diagnostics += "Error: " + string(Str) + "\n";
+	else
+		fprintf(stderr, "Error: %s\n", Str);
 	return nullptr;
 }
 
@@ -222,34 +593,57 @@ const ExprAST* Parser::LogError(const char * Str)
 	return nullptr;
 }
 
-const ExprAST* Parser::ParseNumberExpr()
+bool Parser::ParseTypeAnnotation(ValueType& Type, bool AllowPointer)
 {
-	auto Result = new NumberExprAST(CurTok.getNumValue());
-	getNextToken(); // consume the number
-	return Result;
+	if (CurTok.getType() != tok_char || CurTok.getNumValue() != ':')
+		return true;
+	getNextToken(); // eat ':'.
+
+	ValueType Annotated = CurTok.getType() == tok_identifier ? getValueType(CurTok.getIdentifierString()) : type_unknown;
+	if (Annotated == type_unknown) {
+		LogError("Expected a type (f64, f32, i64 or bool) after ':'");
+		return false;
+	}
+	getNextToken(); // eat type.
+
+	if (AllowPointer && CurTok.getType() == tok_char && CurTok.getNumValue() == '*') {
+		getNextToken(); // eat '*'.
+		Annotated = getPointerType(Annotated);
+	}
+
+	Type = Annotated;
+	return true;
 }
 
-const ExprAST* Parser::ParseParenExpr()
+const ExprAST* Parser::ParseNumberExpr()
 {
-	getNextToken(); // eat (.
-	auto V = ParseExpression();
-	if (!V)
-		return nullptr;
+	double Val = CurTok.getNumValue();
+	SourceLocation NumLoc = CurLoc;
+	getNextToken(); // consume the number
 
-	if (CurTok.getNumValue() != ')')
-		return LogError("expected ')'");
-	getNextToken(); // eat ).
-	return V;
+	// Untyped literals take their type from the context they're used in.
+	ValueType Type = type_unknown;
+	if (!ParseTypeAnnotation(Type))
+		return nullptr;
+	return located(new NumberExprAST(Val, Type), NumLoc);
 }
 
 const ExprAST* Parser::ParseIdentifierExpr()
 {
 	string IdName = CurTok.getIdentifierString();
+	SourceLocation IdLoc = CurLoc;
 
 	getNextToken(); // eat identifier.
 
+	if (CurTok.getType() == tok_char && CurTok.getNumValue() == '[')
+		return ParseIndexExpr(IdName, IdLoc);
+
 	if (CurTok.getNumValue() != '(') // Simple variable ref.
-		return new VariableExprAST(IdName);
+		return located(new VariableExprAST(IdName), IdLoc);
+
+	if (IdName == "parallelfor" || IdName == "parallelsum")
+		return ParseParallelExpr(IdName == "parallelsum" ? ParallelExprAST::parallel_sum : ParallelExprAST::parallel_for,
+			IdLoc);
 
 	// Call.
 	getNextToken(); // eat (
@@ -273,55 +667,81 @@ const ExprAST* Parser::ParseIdentifierExpr()
 	// Eat the ')'.
 	getNextToken();
 
-	return new CallExprAST(IdName, Args);
+	return located(new CallExprAST(IdName, Args), IdLoc);
 }
 
-const ExprAST* Parser::ParsePrimary()
+const ExprAST* Parser::ParseParallelExpr(ParallelExprAST::LoopKind Kind, SourceLocation Loc)
 {
-	switch (CurTok.getType()) {
-	default:
-		return LogError("unknown token when expecting an expression");
-	case tok_identifier:
-		return ParseIdentifierExpr();
-	case tok_number:
-		return ParseNumberExpr();
-	case tok_char:
-		if (CurTok.getNumValue() == '(') return ParseParenExpr();
+	getNextToken(); // eat (
+	if (CurTok.getType() != tok_identifier)
+		return LogError("expected loop variable");
+	string VarName = CurTok.getIdentifierString();
+	getNextToken(); // eat identifier.
 
-		return LogError("unknown token when expecting an expression");
+	// The bounds and the body, each after a ','.
+	const ExprAST* Operands[3] = {};
+	for (auto& Operand : Operands) {
+		if (CurTok.getType() != tok_char || CurTok.getNumValue() != ',') {
+			LogError("expected ',' in parallel loop");
+			break;
+		}
+		getNextToken(); // eat ,
+		if (!(Operand = ParseExpression()))
+			break;
 	}
+
+	bool Parsed = Operands[2] != nullptr;
+	if (Parsed && (CurTok.getType() != tok_char || CurTok.getNumValue() != ')')) {
+		LogError("expected ')' after parallel loop");
+		Parsed = false;
+	}
+	if (!Parsed) {
+		for (auto Operand : Operands)
+			delete Operand;
+		return nullptr;
+	}
+	getNextToken(); // eat ).
+
+	return located(new ParallelExprAST(Kind, VarName, Operands[0], Operands[1], Operands[2]), Loc);
 }
 
-const ExprAST* Parser::ParseBinOpRHS(int ExprPrec, const ExprAST* LHS)
+const ExprAST* Parser::ParseIndexExpr(string& IdName, SourceLocation IdLoc)
 {
-	// If this is a binop, find its precedence.
-	while (true) {
-		int TokPrec = GetTokPrecedence();
-
-		// If this is a binop that binds at least as tightly as the current binop,
-		// consume it, otherwise we are done.
-		if (TokPrec < ExprPrec)
-			return LHS;
+	getNextToken(); // eat [
+	auto Index = ParseExpression();
+	if (!Index)
+		return nullptr;
 
-		// Okay, we know this is a binop.
-		int BinOp = CurTok.getNumValue();
-		getNextToken(); // eat binop
+	if (CurTok.getType() != tok_char || CurTok.getNumValue() != ']') {
+		delete Index;
+		return LogError("expected ']'");
+	}
+	getNextToken(); // eat ].
 
-		// Parse the primary expression after the binary operator.
-		auto RHS = ParsePrimary();
-		if (!RHS)
-			return nullptr;
+	// Load.
+	if (CurTok.getType() != tok_char || CurTok.getNumValue() != '=')
+		return located(new IndexExprAST(IdName, Index), IdLoc);
 
-		// If BinOp binds less tightly with RHS than the operator after RHS, let
-		// the pending operator take RHS as its LHS.
-		int NextPrec = GetTokPrecedence();
-		if (TokPrec < NextPrec) {
-			RHS = ParseBinOpRHS(TokPrec + 1, RHS);
-			if (!RHS)
-				return nullptr;
-		}
+	// Store.
+	getNextToken(); // eat =.
+	auto Val = ParseExpression();
+	if (!Val) {
+		delete Index;
+		return nullptr;
+	}
+	return located(new IndexAssignExprAST(IdName, Index, Val), IdLoc);
+}
 
-		// Merge LHS/RHS.
-		LHS = new BinaryExprAST(BinOp, LHS, RHS);
+const ExprAST* Parser::ParsePrimary()
+{
+	switch (CurTok.getType()) {
+	default:
+		return LogError("unknown token when expecting an expression");
+	case tok_identifier:
+		return ParseIdentifierExpr();
+	case tok_number:
+		return ParseNumberExpr();
+	case tok_error:
+		return LogError(CurTok.getIdentifierString().c_str());
 	}
 }
@@ -1,4 +1,5 @@
 #pragma once
+#include <functional>
 #include <map>
 #include "Lexer.h"
 #include "AST.h"
@@ -6,42 +7,135 @@
 
 using namespace std;
 
+class ParallelEvaluator;
+
 /**
 * Changes made by justice: Obviously wrapping the Parser into a proper class. The public API for the parser now is limited to
 * BinopPrecedence and the main function MainLoop.
 */
 
+// A top-level item that has been parsed but not handled yet. Parsing and handling are separate steps so whole
+// sources can be parsed ahead of code generation, on several threads (see ParallelParser.h).
+struct ParsedItem {
+	enum ItemKind { item_none, item_definition, item_extern, item_expression, item_import };
+
+	ItemKind Kind = item_none;
+
+	// The ASTs, null if the item failed to parse.
+	const FunctionAST* Function = nullptr; // Definitions and top-level expressions.
+	const PrototypeAST* Extern = nullptr;
+
+	// The library file name of an import, empty if the import failed to parse.
+	string LibraryName;
+
+	// Errors reported while parsing the item, when the parser buffers them.
+	string Diagnostics;
+};
+
 class Parser {
 public:
-	Parser(Lexer _Scanner) : Scanner(_Scanner), CurTok(Token(TokenType::tok_eof)) {};
+	Parser(Lexer _Scanner, const orc::KaleidoscopeJITOptions& JITOptions = {})
+		: Scanner(_Scanner), CodeGenVisitor(new ASTCodeGenVisitor(JITOptions)), CurTok(Token(TokenType::tok_eof)) {};
+
+	// A parser generating code into an existing JIT, e.g. a session's (see SessionManager.h).
+	Parser(Lexer _Scanner, const JITRuntimeWrapper& JIT)
+		: Scanner(_Scanner), CodeGenVisitor(new ASTCodeGenVisitor(JIT)), CurTok(Token(TokenType::tok_eof)) {};
 
 	/// BinopPrecedence - This holds the precedence for each binary operator that is
-	/// defined.
-	map<char, int> BinopPrecedence;
+	/// defined, indexed by the operator character. 0 means the character isn't a binary operator.
+	int BinopPrecedence[256] = {};
+
+	/// top ::= definition | external | import | expression | ';'
+	/// With ParseThreads, a scanner reading a source buffer has it parsed on that many threads first.
+	void MainLoop(unsigned ParseThreads = 0);
+
+	/// BuildLibrary - Compiles the definitions read from the scanner into a precompiled library (see Library.h)
+	/// instead of running them. Returns false if anything failed to compile. ParseThreads as for MainLoop.
+	bool BuildLibrary(const string& FileName, unsigned ParseThreads = 0);
+
+	/// GenerateModules - Generates a module per definition read from the scanner and hands them to the caller rather
+	/// than to the JIT, e.g. to compile them to objects with getJIT().compileToObject. Returns false if anything
+	/// failed to compile.
+	bool GenerateModules(vector<orc::ThreadSafeModule>& Modules);
 
-	/// top ::= definition | external | expression | ';'
-	void MainLoop();
+	// The JIT the parser's code goes to.
+	orc::KaleidoscopeJIT& getJIT() { return *CodeGenVisitor->JIT.TheJIT; }
 
 	// Dumps code gen LLIR from code gen Module to stdout
 	void PrintLLIRModule();
 
+	// Runs code in executor processes rather than in this one (see ExecutorPool.h)
+	void SetExecutorPool(ExecutorPool* Pool) { CodeGenVisitor->Executors = Pool; }
+
+	// Evaluates runs of top-level expressions together, on threads (see ParallelEvaluator.h)
+	void SetParallelEvaluator(ParallelEvaluator* _Evaluator) { Evaluator = _Evaluator; }
+
+	// Emits source line info for SourceFileName into the generated code. Call before parsing anything.
+	void EnableLineInfo(const string& SourceFileName) { CodeGenVisitor->enableDebugInfo(SourceFileName); }
+
+	// Reports the JIT memory in use per JITDylib and ResourceTracker (see SlabMemoryManager.h)
+	void PrintJITMemoryUsage();
+
+	/// FuseKernel - Compiles the functions named in Formulas into one kernel, Name, that evaluates them all in a single
+	/// pass over their input columns (see ASTCodeGenVisitor::emitFusedKernel). InputColumns is set to the order the
+	/// kernel takes the input columns in. Call it through getJITFunction<FusedKernel>(Name).
+	bool FuseKernel(const string& Name, const vector<string>& Formulas, vector<string>& InputColumns);
+
+	/// getJITFunction - Looks up a JIT'd function as a native function pointer for the host to call,
+	/// e.g. getJITFunction<double(double*, int64_t)>("sum"). See JITRuntimeWrapper::getFunction.
+	template <typename Signature> Signature* getJITFunction(StringRef Name) {
+		return CodeGenVisitor->JIT.getFunction<Signature>(Name);
+	}
+
 	~Parser() {
 		// free up memory from code gen module
 		delete CodeGenVisitor;
 	};
 
 private:
+	// Parsers of the regions of a source parsed in parallel only parse: they have no code generator, and they
+	// buffer their errors so they can be reported in source order.
+	struct ParseOnly {};
+	Parser(Lexer _Scanner, ParseOnly)
+		: Scanner(_Scanner), CodeGenVisitor(nullptr), CurTok(Token(TokenType::tok_eof)), BufferDiagnostics(true) {}
+
 	// Handle to the Scanner instance which will be used by this Parser
 	Lexer Scanner;
 
+	// When set, tokens come from here rather than from the Scanner, e.g. from the lexer stage of a CompilePipeline.
+	// It sets the next token, the source offset just past the token before it and where it starts.
+	function<void(Token&, size_t&, SourceLocation&)> TokenSource;
+
 	// Create object to handle LLIR code generation via visitor pattern
-	ASTCodeGenVisitor* CodeGenVisitor = new ASTCodeGenVisitor;
+	ASTCodeGenVisitor* CodeGenVisitor;
+
+	// Set when top-level expressions are evaluated in parallel runs, null otherwise.
+	ParallelEvaluator* Evaluator = nullptr;
+
+	/// UnaryOperators - Flags the characters which are user defined unary operators.
+	bool UnaryOperators[256] = {};
 
 	/// CurTok/getNextToken - Provide a simple token buffer.  CurTok is the current
 	/// token the parser is looking at.  getNextToken reads another token from the
 	/// lexer and updates CurTok with its results.
 	Token CurTok;
 
+	// Source offset just past the token before CurTok, i.e. the end of the last fully parsed construct.
+	size_t PrevTokEnd = 0;
+
+	// Where CurTok starts.
+	SourceLocation CurLoc;
+
+	// When set, LogError collects errors in Diagnostics instead of printing them.
+	bool BufferDiagnostics = false;
+	string Diagnostics;
+
+	// Records where an expression node starts.
+	template <class NodeType> NodeType* located(NodeType* Node, SourceLocation Loc) {
+		Node->Loc = Loc;
+		return Node;
+	}
+
 	// LogError* - These are little helper functions for error handling.
 	const ExprAST* LogError(const char *Str);
 
@@ -53,34 +147,51 @@ private:
 	/// GetTokPrecedence - Get the precedence of the pending binary operator token.
 	int GetTokPrecedence();
 
-	/// numberexpr ::= number
-	const ExprAST* ParseNumberExpr();
+	/// typeannotation ::= (':' type)?
+	/// argtypeannotation ::= (':' type '*'?)?
+	/// Leaves Type untouched if there is no annotation. Returns false on a malformed annotation.
+	/// Pointer types are only allowed on arguments (AllowPointer), elsewhere "2:f32*x" is a multiply.
+	bool ParseTypeAnnotation(ValueType& Type, bool AllowPointer = false);
 
-	/// parenexpr ::= '(' expression ')'
-	const ExprAST* ParseParenExpr();
+	/// numberexpr ::= number typeannotation
+	const ExprAST* ParseNumberExpr();
 
 	/// identifierexpr
 	///   ::= identifier
 	///   ::= identifier '(' expression* ')'
+	///   ::= identifier '[' expression ']'
+	///   ::= identifier '[' expression ']' '=' expression
+	///   ::= parallelexpr
 	const ExprAST* ParseIdentifierExpr();
 
+	/// indexexpr
+	///   ::= '[' expression ']'
+	///   ::= '[' expression ']' '=' expression
+	/// Parses the part of an identifierexpr following the identifier.
+	const ExprAST* ParseIndexExpr(string& IdName, SourceLocation IdLoc);
+
+	/// parallelexpr
+	///   ::= ('parallelfor' | 'parallelsum') '(' identifier ',' expression ',' expression ',' expression ')'
+	/// Parses the part of an identifierexpr following the identifier.
+	const ExprAST* ParseParallelExpr(ParallelExprAST::LoopKind Kind, SourceLocation Loc);
+
 	/// primary
 	///   ::= identifierexpr
 	///   ::= numberexpr
-	///   ::= parenexpr
 	const ExprAST* ParsePrimary();
 
-	/// binoprhs
-	///   ::= ('+' primary)*
-	const ExprAST* ParseBinOpRHS(int ExprPrec, const ExprAST* LHS);
-
 	/// expression
-	///   ::= primary binoprhs
-	///
+	///   ::= unary (binop unary)*
+	/// unary
+	///   ::= unaryop* primary
+	///   ::= unaryop* '(' expression ')'
+	/// Parsed with an explicit stack rather than recursion, see Parser.cpp.
 	const ExprAST* ParseExpression();
 
 	/// prototype
-	///   ::= id '(' id* ')'
+	///   ::= id '(' (id argtypeannotation)* ')' typeannotation
+	///   ::= 'binary' LETTER number? '(' id argtypeannotation id argtypeannotation ')' typeannotation
+	///   ::= 'unary' LETTER '(' id argtypeannotation ')' typeannotation
 	const PrototypeAST* ParsePrototype();
 
 	/// definition ::= 'def' prototype expression
@@ -92,13 +203,44 @@ private:
 	/// external ::= 'extern' prototype
 	const PrototypeAST* ParseExtern();
 
+	/// import ::= 'import' string
+	/// Sets FileName to the library's file name. Returns false on error.
+	bool ParseImport(string& FileName);
+
+	// The file name of a library imported by name: the name, with the library extension if it has none.
+	static string getLibraryFileName(string Name);
+
 	//===----------------------------------------------------------------------===//
 	// Top-Level parsing
 	//===----------------------------------------------------------------------===//
 
-	void HandleDefinition();
+	/// ParseItem - Parses the next top-level item into Item. Returns false at the end of the input.
+	bool ParseItem(ParsedItem& Item);
+
+	// Runs a parsed item: generates code for it, evaluates it or imports it.
+	void HandleItem(ParsedItem& Item);
+
+	void HandleDefinition(const FunctionAST* Definition);
+
+	void HandleExtern(const PrototypeAST* Extern);
+
+	void HandleTopLevelExpression(const FunctionAST* TopLevelExpression);
+
+	// Parses an import and imports the library.
+	void HandleImport();
+
+	void ImportLibrary(const string& FileName);
+
+	// Adds a parsed item to the library being built. Returns false if the item is an error.
+	bool AddLibraryItem(ParsedItem& Item, vector<const PrototypeAST*>& Exported);
 
-	void HandleExtern();
+	// Generates code for a top-level expression, runs it and frees its code again. Returns false on error.
+	bool EvaluateTopLevelExpression(const FunctionAST* TopLevelExpression, double& Result);
 
-	void HandleTopLevelExpression();
+	// The incremental compiler drives the parsing and code generation steps itself.
+	friend class IncrementalCompiler;
+	friend class ParallelParser;
+	friend class CompilePipeline;
+	friend class ParallelEvaluator;
+	friend class SessionManager;
 };
\ No newline at end of file
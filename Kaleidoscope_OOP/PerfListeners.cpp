@@ -0,0 +1,78 @@
+#include "stdafx.h"
+#include "PerfListeners.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/Process.h"
+
+PerfMapWriter* PerfMapWriter::get()
+{
+	// Removed code isn't taken out of the map: perf maps are append-only, later entries win for reused addresses.
+	static unique_ptr<PerfMapWriter> Writer = []() -> unique_ptr<PerfMapWriter> {
+		string FileName = "/tmp/perf-" + to_string(sys::Process::getProcessId()) + ".map";
+		FILE* File = fopen(FileName.c_str(), "w");
+		if (!File) {
+			fprintf(stderr, "Error: Could not create the perf map %s\n", FileName.c_str());
+			return nullptr;
+		}
+		return unique_ptr<PerfMapWriter>(new PerfMapWriter(File));
+	}();
+	return Writer.get();
+}
+
+PerfMapWriter::~PerfMapWriter()
+{
+	fclose(File);
+}
+
+void PerfMapWriter::addFunction(uint64_t Address, uint64_t Size, StringRef Name)
+{
+	if (!Size)
+		return;
+
+	lock_guard<mutex> Lock(Mutex);
+	fprintf(File, "%llx %llx %.*s\n", (unsigned long long)Address, (unsigned long long)Size, (int)Name.size(),
+		Name.data());
+
+	// perf reads the map when the profile is reported, which may be while this process is still running.
+	fflush(File);
+}
+
+void PerfMapEventListener::notifyObjectLoaded(ObjectKey K, const object::ObjectFile& Obj,
+	const RuntimeDyld::LoadedObjectInfo& L)
+{
+	// The debug object is a copy of the object with its sections' addresses set to where they were loaded.
+	object::OwningBinary<object::ObjectFile> DebugObj = L.getObjectForDebug(Obj);
+	if (!DebugObj.getBinary())
+		return;
+
+	for (auto& SymAndSize : object::computeSymbolSizes(*DebugObj.getBinary())) {
+		object::SymbolRef Sym = SymAndSize.first;
+		auto Type = Sym.getType();
+		if (!Type || *Type != object::SymbolRef::ST_Function) {
+			if (!Type)
+				consumeError(Type.takeError());
+			continue;
+		}
+
+		auto Name = Sym.getName();
+		auto Address = Sym.getAddress();
+		if (!Name || !Address) {
+			if (!Name)
+				consumeError(Name.takeError());
+			if (!Address)
+				consumeError(Address.takeError());
+			continue;
+		}
+		Writer.addFunction(*Address, SymAndSize.second, *Name);
+	}
+}
+
+void PerfMapLinkPlugin::modifyPassConfig(orc::MaterializationResponsibility& MR, const Triple& TT,
+	jitlink::PassConfiguration& Config)
+{
+	Config.PostFixupPasses.push_back([this](jitlink::LinkGraph& G) {
+		for (auto* Sym : G.defined_symbols())
+			if (Sym->isCallable() && Sym->hasName())
+				Writer.addFunction(Sym->getAddress(), Sym->getSize(), Sym->getName());
+		return Error::success();
+	});
+}
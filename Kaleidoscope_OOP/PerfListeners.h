@@ -0,0 +1,69 @@
+#pragma once
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
+
+using namespace std;
+using namespace llvm;
+
+/**
+* Lets perf attribute samples in JIT'd code to Kaleidoscope functions. Without this, perf only sees anonymous
+* executable memory and reports raw addresses.
+*
+* Two formats are supported:
+*   - perf maps (/tmp/perf-<pid>.map): one "START SIZE name" line per function, which perf report picks up on its
+*     own. Written here, for either linker: a JITEventListener for RuntimeDyld, a link plugin for JITLink.
+*   - jitdump (jit-<pid>.dump): also carries the code bytes and, if the module was compiled with line info
+*     (--line-info), the source lines, for perf annotate. It has to be merged in with "perf inject --jit". LLVM's own
+*     PerfJITEventListener writes it. That only exists if LLVM was built with LLVM_USE_PERF, and in this LLVM
+*     version it can only listen to RuntimeDyld.
+*/
+
+class PerfMapWriter {
+public:
+	/// get - The process' perf map, opened on first use. Null (after logging) if it can't be created.
+	static PerfMapWriter* get();
+
+	~PerfMapWriter();
+
+	/// addFunction - Records that the code of function Name occupies [Address, Address + Size).
+	void addFunction(uint64_t Address, uint64_t Size, StringRef Name);
+
+private:
+	PerfMapWriter(FILE* File) : File(File) {}
+
+	FILE* File;
+
+	// Objects are linked on several threads when materialization is dispatched to a pool.
+	mutex Mutex;
+};
+
+// Writes the functions of every object RuntimeDyld loads to the perf map.
+class PerfMapEventListener : public JITEventListener {
+public:
+	PerfMapEventListener(PerfMapWriter& Writer) : Writer(Writer) {}
+
+	void notifyObjectLoaded(ObjectKey K, const object::ObjectFile& Obj,
+		const RuntimeDyld::LoadedObjectInfo& L) override;
+
+private:
+	PerfMapWriter& Writer;
+};
+
+// Writes the functions of every graph JITLink links to the perf map, once their addresses are final.
+class PerfMapLinkPlugin : public orc::ObjectLinkingLayer::Plugin {
+public:
+	PerfMapLinkPlugin(PerfMapWriter& Writer) : Writer(Writer) {}
+
+	void modifyPassConfig(orc::MaterializationResponsibility& MR, const Triple& TT,
+		jitlink::PassConfiguration& Config) override;
+
+	Error notifyFailed(orc::MaterializationResponsibility& MR) override { return Error::success(); }
+	Error notifyRemovingResources(orc::ResourceKey K) override { return Error::success(); }
+	void notifyTransferringResources(orc::ResourceKey DstKey, orc::ResourceKey SrcKey) override {}
+
+private:
+	PerfMapWriter& Writer;
+};
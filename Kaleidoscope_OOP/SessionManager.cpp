@@ -0,0 +1,122 @@
+#include "stdafx.h"
+#include "SessionManager.h"
+#include "Operators.h"
+
+SessionManager::SessionManager(const orc::KaleidoscopeJITOptions& JITOptions) : JIT(JITOptions)
+{
+}
+
+bool SessionManager::createSession(const string& Name)
+{
+	auto& Slot = Sessions[Name];
+	if (Slot) {
+		fprintf(stderr, "Error: there is a session %s already\n", Name.c_str());
+		return false;
+	}
+
+	Slot = make_unique<Session>();
+	Slot->RT = JIT.TheJIT->createSessionJITDylib().createResourceTracker();
+	Slot->TheParser = make_unique<Parser>(Lexer(""), JITRuntimeWrapper(JIT.TheJIT, Slot->RT));
+	for (const StandardBinaryOperator& Op : StandardBinaryOperators)
+		Slot->TheParser->BinopPrecedence[(unsigned char)Op.Op] = Op.Precedence;
+	return true;
+}
+
+bool SessionManager::addSource(const string& Name, const string& Source)
+{
+	auto SI = Sessions.find(Name);
+	if (SI == Sessions.end()) {
+		fprintf(stderr, "Error: there is no session %s\n", Name.c_str());
+		return false;
+	}
+
+	Session& S = *SI->second;
+	Parser& P = *S.TheParser;
+	ASTCodeGenVisitor* CodeGen = P.CodeGenVisitor;
+	bool Failed = false;
+
+	P.Scanner = Lexer(Source);
+	P.getNextToken();
+	for (ParsedItem Item; P.ParseItem(Item); Item = ParsedItem()) {
+		switch (Item.Kind) {
+		case ParsedItem::item_definition:
+			if (!Item.Function) {
+				Failed = true;
+				break;
+			}
+			S.Definitions.emplace_back(Item.Function);
+			// Added under the session's tracker, the code generator's default.
+			if (const_cast<FunctionAST*>(Item.Function)->accept(CodeGen))
+				CodeGen->AddModuleToJIT();
+			else
+				Failed = true;
+			break;
+		case ParsedItem::item_extern:
+			if (Item.Extern && const_cast<PrototypeAST*>(Item.Extern)->accept(CodeGen)) {
+				CodeGen->FunctionProtos[Item.Extern->Name] = Item.Extern;
+				S.Externs.emplace_back(Item.Extern);
+			}
+			else {
+				delete Item.Extern;
+				Failed = true;
+			}
+			break;
+		case ParsedItem::item_expression: {
+			double Result;
+			if (Item.Function && P.EvaluateTopLevelExpression(Item.Function, Result))
+				fprintf(stderr, "%s: evaluated to %f\n", Name.c_str(), Result);
+			else
+				Failed = true;
+			CodeGen->forgetFunction("__anon_expr");
+			delete Item.Function;
+			break;
+		}
+		case ParsedItem::item_import:
+			if (!Item.LibraryName.empty())
+				P.ImportLibrary(Item.LibraryName);
+			else
+				Failed = true;
+			break;
+		default:
+			break;
+		}
+	}
+	return !Failed;
+}
+
+JITTargetAddress SessionManager::lookup(const string& SessionName, StringRef Name)
+{
+	auto SI = Sessions.find(SessionName);
+	if (SI == Sessions.end()) {
+		fprintf(stderr, "Error: there is no session %s\n", SessionName.c_str());
+		return 0;
+	}
+
+	auto Symbol = JIT.TheJIT->lookup(SI->second->RT->getJITDylib(), Name);
+	if (!Symbol) {
+		logAllUnhandledErrors(Symbol.takeError(), errs(), "Error: ");
+		return 0;
+	}
+	return Symbol->getAddress();
+}
+
+bool SessionManager::removeSession(const string& Name)
+{
+	auto SI = Sessions.find(Name);
+	if (SI == Sessions.end()) {
+		fprintf(stderr, "Error: there is no session %s\n", Name.c_str());
+		return false;
+	}
+
+	// All of the session's code goes in one step. Then its parser, code generator and ASTs.
+	unique_ptr<Session> S = move(SI->second);
+	Sessions.erase(SI);
+	orc::JITDylib& JD = S->RT->getJITDylib();
+	if (auto Err = S->RT->remove())
+		logAllUnhandledErrors(move(Err), errs(), "Error: ");
+	S.reset();
+
+	if (auto Err = JIT.TheJIT->releaseSessionJITDylib(JD))
+		logAllUnhandledErrors(move(Err), errs(), "Error: ");
+	return true;
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "llvm/ADT/StringRef.h"
+#include "Parser.h"
+
+using namespace std;
+using namespace llvm;
+
+/**
+* Hosts many independent sets of definitions, e.g. one per customer, in one process and one JIT. Each is a named
+* session with:
+*   - a JITDylib of its own, linked against a shared one holding the builtins and the process's symbols (see
+*     KaleidoscopeJIT::createSessionJITDylib), so sessions can define the same names without seeing each other,
+*   - a parser and code generator of its own, so its prototypes and operators are its own as well,
+*   - a ResourceTracker all its code is added under.
+* Removing a session removes its tracker, which frees all its code in one operation, then hands its JITDylib back to
+* the JIT for the next session.
+*
+* Sessions are driven from one thread at a time, like the parser.
+*/
+
+class SessionManager {
+public:
+	SessionManager(const orc::KaleidoscopeJITOptions& JITOptions = {});
+
+	/// createSession - Starts an empty session. Returns false (after logging) if there is one named Name already.
+	bool createSession(const string& Name);
+
+	/// addSource - Compiles the definitions, externs and imports of Source into a session and evaluates its
+	/// top-level expressions. Returns false if there is no such session or anything in Source failed.
+	bool addSource(const string& Name, const string& Source);
+
+	/// getFunction - Looks a function of a session up as a native function pointer (see
+	/// JITRuntimeWrapper::getFunction), compiling it if it's the first lookup. Null (after logging) if there is no
+	/// such session or function. The pointer is valid until the session is removed.
+	template <typename Signature> Signature* getFunction(const string& Session, StringRef Name) {
+		return (Signature*)(intptr_t)lookup(Session, Name);
+	}
+
+	/// removeSession - Frees all code of a session and forgets its definitions. Returns false (after logging) if
+	/// there is no such session.
+	bool removeSession(const string& Name);
+
+	size_t getNumSessions() const { return Sessions.size(); }
+
+	/// getMemoryPool - The JIT memory all sessions allocate from (see SlabMemoryManager.h).
+	JITMemoryPool& getMemoryPool() { return JIT.TheJIT->getMemoryPool(); }
+
+private:
+	struct Session {
+		orc::ResourceTrackerSP RT;
+
+		// The ASTs of the session's definitions and externs. The code generator refers to them, so it goes first.
+		vector<unique_ptr<const FunctionAST>> Definitions;
+		vector<unique_ptr<const PrototypeAST>> Externs;
+		unique_ptr<Parser> TheParser;
+	};
+
+	// Owns the JIT the sessions share. Nothing is added to its main JITDylib.
+	JITRuntimeWrapper JIT;
+
+	map<string, unique_ptr<Session>> Sessions;
+
+	// Address of Name in a session, 0 (after logging) if it isn't there.
+	JITTargetAddress lookup(const string& SessionName, StringRef Name);
+};
@@ -0,0 +1,247 @@
+#include "stdafx.h"
+#include "SlabMemoryManager.h"
+#include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Process.h"
+
+SlabMemoryManager::~SlabMemoryManager()
+{
+	Pool.release(*this);
+}
+
+uint8_t* SlabMemoryManager::allocateCodeSection(uintptr_t Size, unsigned Alignment, unsigned SectionID,
+	StringRef SectionName)
+{
+	return Pool.allocate(*this, true, Size, Alignment);
+}
+
+uint8_t* SlabMemoryManager::allocateDataSection(uintptr_t Size, unsigned Alignment, unsigned SectionID,
+	StringRef SectionName, bool IsReadOnly)
+{
+	return Pool.allocate(*this, false, Size, Alignment);
+}
+
+void SlabMemoryManager::registerEHFrames(uint8_t* Addr, uint64_t LoadAddr, size_t Size)
+{
+	// The code runs in this process, so the frames are registered with the process' unwinder.
+	RTDyldMemoryManager::registerEHFramesInProcess(Addr, Size);
+	EHFrames.push_back(sys::MemoryBlock(Addr, Size));
+}
+
+void SlabMemoryManager::deregisterEHFrames()
+{
+	for (auto& Frame : EHFrames)
+		RTDyldMemoryManager::deregisterEHFramesInProcess((uint8_t*)Frame.base(), Frame.allocatedSize());
+	EHFrames.clear();
+}
+
+bool SlabMemoryManager::finalizeMemory(string* ErrMsg)
+{
+	lock_guard<mutex> Lock(Pool.Mutex);
+
+	// Only the code is protected, it has pages of its own. Data stays writable.
+	for (auto& A : Allocations) {
+		if (!A.IsCode || A.Finalized)
+			continue;
+
+		sys::MemoryBlock Block(A.Address, A.Size);
+		if (auto EC = sys::Memory::protectMappedMemory(Block, sys::Memory::MF_READ | sys::Memory::MF_EXEC)) {
+			if (ErrMsg)
+				*ErrMsg = EC.message();
+			return true;
+		}
+		sys::Memory::InvalidateInstructionCache(A.Address, A.Size);
+		A.Finalized = true;
+	}
+	return false;
+}
+
+JITMemoryPool::JITMemoryPool(size_t SlabSize) : SlabSize(SlabSize)
+{
+	PageSize = sys::Process::getPageSizeEstimate();
+}
+
+JITMemoryPool::~JITMemoryPool()
+{
+	for (auto& S : Slabs)
+		sys::Memory::releaseMappedMemory(S->Block);
+}
+
+uintptr_t JITMemoryPool::allocateFromSlab(Slab& S, uintptr_t Size, uintptr_t Alignment)
+{
+	for (auto FI = S.FreeBlocks.begin(), FE = S.FreeBlocks.end(); FI != FE; ++FI) {
+		uintptr_t Start = FI->first, End = FI->first + FI->second;
+		uintptr_t Aligned = alignTo(Start, Alignment);
+		if (Aligned + Size > End)
+			continue;
+
+		// Split the free block around the allocation.
+		S.FreeBlocks.erase(FI);
+		if (Aligned > Start)
+			S.FreeBlocks[Start] = Aligned - Start;
+		if (Aligned + Size < End)
+			S.FreeBlocks[Aligned + Size] = End - (Aligned + Size);
+		return Aligned;
+	}
+	return 0;
+}
+
+uint8_t* JITMemoryPool::allocate(SlabMemoryManager& Manager, bool IsCode, uintptr_t Size, unsigned Alignment)
+{
+	uintptr_t Align = max<uintptr_t>(Alignment, 1);
+	if (IsCode) {
+		Size = alignTo(max<uintptr_t>(Size, 1), PageSize);
+		Align = max<uintptr_t>(Align, PageSize);
+	}
+
+	lock_guard<mutex> Lock(Mutex);
+	Managers.insert(&Manager);
+
+	uintptr_t Address = 0;
+	for (auto& S : Slabs)
+		if (S->IsCode == IsCode && (Address = allocateFromSlab(*S, Size, Align)))
+			break;
+
+	if (!Address) {
+		// Map a new slab, large enough for the allocation if it's bigger than a slab.
+		error_code EC;
+		size_t NewSlabSize = max<size_t>(SlabSize, alignTo(Size + Align, PageSize));
+		auto Block = sys::Memory::allocateMappedMemory(NewSlabSize, nullptr,
+			sys::Memory::MF_READ | sys::Memory::MF_WRITE, EC);
+		if (EC)
+			return nullptr;
+
+		auto S = make_unique<Slab>();
+		S->Block = Block;
+		S->IsCode = IsCode;
+		S->FreeBlocks[(uintptr_t)Block.base()] = Block.allocatedSize();
+		Address = allocateFromSlab(*S, Size, Align);
+		Slabs.push_back(move(S));
+	}
+
+	Manager.Allocations.push_back({ (uint8_t*)Address, Size, IsCode, false });
+	Owners[Address] = &Manager;
+	return (uint8_t*)Address;
+}
+
+void JITMemoryPool::release(SlabMemoryManager& Manager)
+{
+	lock_guard<mutex> Lock(Mutex);
+	Managers.erase(&Manager);
+
+	for (auto& A : Manager.Allocations) {
+		uintptr_t Start = (uintptr_t)A.Address;
+		Owners.erase(Start);
+
+		// Code pages are made writable again before they're reused.
+		if (A.IsCode && A.Finalized)
+			sys::Memory::protectMappedMemory(sys::MemoryBlock(A.Address, A.Size),
+				sys::Memory::MF_READ | sys::Memory::MF_WRITE);
+
+		auto SI = find_if(Slabs.begin(), Slabs.end(), [&](const unique_ptr<Slab>& S) {
+			uintptr_t Base = (uintptr_t)S->Block.base();
+			return Start >= Base && Start < Base + S->Block.allocatedSize();
+		});
+		if (SI == Slabs.end())
+			continue;
+		Slab& S = **SI;
+
+		// Put the block back and merge it with the free blocks on either side.
+		uintptr_t Size = A.Size;
+		auto Next = S.FreeBlocks.lower_bound(Start);
+		if (Next != S.FreeBlocks.end() && Start + Size == Next->first) {
+			Size += Next->second;
+			Next = S.FreeBlocks.erase(Next);
+		}
+		if (Next != S.FreeBlocks.begin()) {
+			auto Prev = prev(Next);
+			if (Prev->first + Prev->second == Start) {
+				Start = Prev->first;
+				Size += Prev->second;
+				S.FreeBlocks.erase(Prev);
+			}
+		}
+		S.FreeBlocks[Start] = Size;
+
+		// Give entirely free slabs back to the OS, but keep one of each kind around for the next module.
+		bool Empty = S.FreeBlocks.size() == 1 && Size == S.Block.allocatedSize();
+		bool IsLast = count_if(Slabs.begin(), Slabs.end(), [&](const unique_ptr<Slab>& Other) {
+			return Other->IsCode == S.IsCode;
+		}) == 1;
+		if (Empty && !IsLast) {
+			sys::Memory::releaseMappedMemory(S.Block);
+			Slabs.erase(SI);
+		}
+	}
+	Manager.Allocations.clear();
+}
+
+void JITMemoryPool::notifyLoaded(orc::MaterializationResponsibility& R, const object::ObjectFile& Obj,
+	const RuntimeDyld::LoadedObjectInfo& Info)
+{
+	orc::ResourceKey Key = 0;
+	if (auto Err = R.withResourceKeyDo([&](orc::ResourceKey K) { Key = K; }))
+		consumeError(move(Err));
+
+	lock_guard<mutex> Lock(Mutex);
+
+	// Any allocated section leads to the object's memory manager.
+	for (auto& Section : Obj.sections()) {
+		uintptr_t Address = Info.getSectionLoadAddress(Section);
+		auto OI = Owners.upper_bound(Address);
+		if (!Address || OI == Owners.begin())
+			continue;
+
+		SlabMemoryManager* Manager = prev(OI)->second;
+		Manager->JITDylibName = R.getTargetJITDylib().getName();
+		Manager->Key = Key;
+		return;
+	}
+}
+
+map<pair<string, orc::ResourceKey>, JITMemoryUsage> JITMemoryPool::getUsage()
+{
+	lock_guard<mutex> Lock(Mutex);
+
+	map<pair<string, orc::ResourceKey>, JITMemoryUsage> Usage;
+	for (auto Manager : Managers) {
+		auto& Entry = Usage[{ Manager->JITDylibName, Manager->Key }];
+		for (auto& A : Manager->Allocations)
+			(A.IsCode ? Entry.CodeBytes : Entry.DataBytes) += A.Size;
+	}
+	return Usage;
+}
+
+size_t JITMemoryPool::getReservedBytes()
+{
+	lock_guard<mutex> Lock(Mutex);
+
+	size_t Reserved = 0;
+	for (auto& S : Slabs)
+		Reserved += S->Block.allocatedSize();
+	return Reserved;
+}
+
+void JITMemoryPool::printUsage(raw_ostream& OS)
+{
+	JITMemoryUsage Total;
+	map<string, JITMemoryUsage> PerJITDylib;
+	auto Usage = getUsage();
+	for (auto& U : Usage) {
+		PerJITDylib[U.first.first].CodeBytes += U.second.CodeBytes;
+		PerJITDylib[U.first.first].DataBytes += U.second.DataBytes;
+		Total.CodeBytes += U.second.CodeBytes;
+		Total.DataBytes += U.second.DataBytes;
+	}
+
+	OS << "JIT memory: " << Total.CodeBytes << " bytes of code, " << Total.DataBytes << " bytes of data in use, "
+		<< getReservedBytes() << " bytes reserved\n";
+	for (auto& J : PerJITDylib) {
+		OS << "  " << (J.first.empty() ? "<not loaded>" : J.first) << ": " << J.second.CodeBytes << " code, "
+			<< J.second.DataBytes << " data\n";
+		for (auto& U : Usage)
+			if (U.first.first == J.first)
+				OS << "    tracker " << format_hex(U.first.second, 10) << ": " << U.second.CodeBytes << " code, "
+					<< U.second.DataBytes << " data\n";
+	}
+}
@@ -0,0 +1,130 @@
+#pragma once
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/RuntimeDyld.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace std;
+using namespace llvm;
+
+/**
+* RuntimeDyld wants a memory manager per object it links, and SectionMemoryManager maps fresh pages for every one
+* of them. With a module per definition and per top-level expression that's a handful of mappings per line typed,
+* and since the pages of removed modules are simply unmapped the address space fragments and RSS keeps growing in
+* long sessions.
+*
+* Here all memory managers sub-allocate from slabs owned by one JITMemoryPool. Code is allocated in whole pages,
+* so every object's code can be made executable on its own while its neighbours are still being written. Data
+* sections (including read-only data, which stays writable) are packed byte-granular into their own slabs. When
+* a ResourceTracker is removed, the linking layer destroys the memory managers of its objects and their memory goes
+* back to the slab's free list, where it's coalesced and reused. Slabs that become entirely free are unmapped again.
+*
+* The pool also accounts for the memory in use. Memory managers are created before the linking layer knows what
+* they're for, so their memory is attributed to a JITDylib and ResourceTracker when the object is loaded
+* (notifyLoaded finds the memory manager from the load address of one of the object's sections).
+*/
+
+// Bytes of JIT'd code and data in use.
+struct JITMemoryUsage {
+	size_t CodeBytes = 0;
+	size_t DataBytes = 0;
+};
+
+class JITMemoryPool;
+
+class SlabMemoryManager : public RuntimeDyld::MemoryManager {
+public:
+	SlabMemoryManager(JITMemoryPool& Pool) : Pool(Pool) {}
+
+	~SlabMemoryManager();
+
+	uint8_t* allocateCodeSection(uintptr_t Size, unsigned Alignment, unsigned SectionID,
+		StringRef SectionName) override;
+
+	uint8_t* allocateDataSection(uintptr_t Size, unsigned Alignment, unsigned SectionID,
+		StringRef SectionName, bool IsReadOnly) override;
+
+	void registerEHFrames(uint8_t* Addr, uint64_t LoadAddr, size_t Size) override;
+
+	void deregisterEHFrames() override;
+
+	bool finalizeMemory(string* ErrMsg = nullptr) override;
+
+private:
+	friend class JITMemoryPool;
+
+	struct Allocation {
+		uint8_t* Address;
+		uintptr_t Size;
+		bool IsCode;
+		bool Finalized;
+	};
+
+	JITMemoryPool& Pool;
+	vector<Allocation> Allocations;
+	vector<sys::MemoryBlock> EHFrames;
+
+	// The JITDylib and tracker the memory is attributed to, once the object has been loaded.
+	string JITDylibName;
+	orc::ResourceKey Key = 0;
+};
+
+class JITMemoryPool {
+public:
+	JITMemoryPool(size_t SlabSize = 1 << 20);
+
+	~JITMemoryPool();
+
+	/// createMemoryManager - A memory manager for one object, allocating from this pool.
+	unique_ptr<SlabMemoryManager> createMemoryManager() { return make_unique<SlabMemoryManager>(*this); }
+
+	/// notifyLoaded - Attributes the memory of a loaded object to the JITDylib and tracker it was loaded for.
+	/// Meant to be the linking layer's NotifyLoaded callback.
+	void notifyLoaded(orc::MaterializationResponsibility& R, const object::ObjectFile& Obj,
+		const RuntimeDyld::LoadedObjectInfo& Info);
+
+	/// getUsage - Live bytes by JITDylib name and tracker.
+	map<pair<string, orc::ResourceKey>, JITMemoryUsage> getUsage();
+
+	/// getReservedBytes - Bytes mapped for slabs, live or free.
+	size_t getReservedBytes();
+
+	/// printUsage - Prints the live bytes per JITDylib and tracker, and the totals.
+	void printUsage(raw_ostream& OS);
+
+private:
+	friend class SlabMemoryManager;
+
+	struct Slab {
+		sys::MemoryBlock Block;
+		bool IsCode;
+
+		// Free ranges as start address -> size, coalesced.
+		map<uintptr_t, uintptr_t> FreeBlocks;
+	};
+
+	mutex Mutex;
+	size_t SlabSize;
+	size_t PageSize;
+	vector<unique_ptr<Slab>> Slabs;
+
+	// The memory manager each allocation belongs to, by start address.
+	map<uintptr_t, SlabMemoryManager*> Owners;
+	set<SlabMemoryManager*> Managers;
+
+	// Allocates memory for a memory manager. Code is rounded up to whole pages. Returns null when out of memory.
+	uint8_t* allocate(SlabMemoryManager& Manager, bool IsCode, uintptr_t Size, unsigned Alignment);
+
+	// Returns all memory of a memory manager to the slabs.
+	void release(SlabMemoryManager& Manager);
+
+	// Carves an aligned block out of a slab's free list. Returns 0 if it doesn't fit.
+	static uintptr_t allocateFromSlab(Slab& S, uintptr_t Size, uintptr_t Alignment);
+};
@@ -14,11 +14,20 @@ enum TokenType {
 	// commands
 	tok_def = -2,
 	tok_extern = -3,
+	tok_import = -9,
 
 	// primary
 	tok_identifier = -4,
 	tok_number = -5,
 	tok_char = -6,
+	tok_string = -10,
+
+	// A malformed token, its identifier string says what's wrong with it.
+	tok_error = -11,
+
+	// operators
+	tok_binary = -7,
+	tok_unary = -8,
 };
 
 class Token {
@@ -36,7 +45,7 @@ public:
 	TokenType getType() { return Type; }
 	
 private:
-	string IdentifierStr;      // Filled in if tok_identifier
+	string IdentifierStr;      // Filled in if tok_identifier, tok_string or tok_error
 	double NumVal = 0;      // Filled in if tok_number
 	TokenType Type;            // Always filled. Desribes token data type.
 };
\ No newline at end of file
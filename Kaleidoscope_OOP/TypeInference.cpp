@@ -0,0 +1,342 @@
+#include "stdafx.h"
+#include "TypeInference.h"
+#include <cstring>
+#include "Builtins.h"
+
+/**
+* Same const_cast finagling as IRCodeGen.cpp: the AST hands out pointers to const nodes, but visitors take
+* non-const ones. Inference is the one visitor that legitimately writes to the nodes (the Type fields).
+*/
+
+ValueType ASTTypeInferenceVisitor::inferWithContext(const ExprAST* Expr, ValueType Context)
+{
+	ValueType SavedContext = ContextType;
+	ContextType = Context;
+	ValueType Result = const_cast<ExprAST*>(Expr)->accept(this);
+	ContextType = SavedContext;
+	return Result;
+}
+
+ValueType ASTTypeInferenceVisitor::visit(NumberExprAST* NumberExpr)
+{
+	// Annotated literals keep their type, untyped ones take the context's type once there is one.
+	NumberExpr->Type = NumberExpr->AnnotatedType != type_unknown ? NumberExpr->AnnotatedType : ContextType;
+	return NumberExpr->Type;
+}
+
+ValueType ASTTypeInferenceVisitor::visit(VariableExprAST* VariableExpr)
+{
+	// Unknown variables are reported by the code generator.
+	auto TI = NamedTypes.find(VariableExpr->Name);
+	VariableExpr->Type = TI != NamedTypes.end() ? TI->second : type_unknown;
+	return VariableExpr->Type;
+}
+
+/**
+* Operator expressions (unary, binary and user defined operators) are inferred by inferOperatorTree, which walks the
+* tree of operator expressions below the outermost one with explicit stacks instead of recursing, see AST.h. Its
+* leaves are all other expressions, inferred as usual.
+*
+* The rules for the builtin binary operators infer an untyped operand a second time in the context of the other
+* side's type (or the context of the expression). Followed recursively down a long chain of untyped operands that is
+* quadratic, so each node's type in each context is worked out once and remembered. A second walk from the root then
+* stores on every node the types from the context it is inferred in last, which is what the recursive rules leave.
+*/
+
+namespace {
+
+const unsigned NumContexts = type_f64_ptr + 1;
+const uint8_t NotInferred = 0xFF;
+
+struct OperatorTreeNode {
+	const ExprAST* Expr;
+
+	// Operator expressions have operands, leaves don't. Operands are nodes of the tree too.
+	unsigned NumOperands = 0;
+	unsigned Operands[2] = { 0, 0 };
+
+	// Builtin binary operators, or the prototype of a user defined one (null if there is none).
+	bool IsBuiltin = false;
+	const PrototypeAST* Operator = nullptr;
+
+	// The type the node has in each context, NotInferred until it's been worked out.
+	uint8_t Types[NumContexts];
+
+	// The context a leaf was inferred in last.
+	uint8_t LastContext = NotInferred;
+
+	OperatorTreeNode(const ExprAST* Expr) : Expr(Expr) { memset(Types, NotInferred, sizeof(Types)); }
+};
+
+// What applying the rules of an operator node in some context gives.
+struct OperatorRules {
+	ValueType Type = type_unknown;
+	ValueType OperandType = type_unknown; // Builtin binary operators
+	ValueType OperandContexts[2] = { type_unknown, type_unknown }; // The contexts the operands are inferred in last.
+	bool Typed = true; // False if the node is left untyped (untyped arithmetic without a context).
+};
+
+// Applies the inference rules of operator node I in Context, using the operand types worked out so far. If one is
+// missing, it's returned in Missing (node and context) and the result is false.
+bool applyOperatorRules(const vector<OperatorTreeNode>& Nodes, unsigned I, ValueType Context, OperatorRules& Rules,
+	pair<unsigned, ValueType>& Missing)
+{
+	const OperatorTreeNode& N = Nodes[I];
+	auto operandType = [&](unsigned Operand, ValueType OperandContext, ValueType& Type) {
+		uint8_t T = Nodes[N.Operands[Operand]].Types[OperandContext];
+		if (T == NotInferred) {
+			Missing = { N.Operands[Operand], OperandContext };
+			return false;
+		}
+		Type = (ValueType)T;
+		return true;
+	};
+
+	if (!N.IsBuiltin) {
+		// Operators are typed like calls to their prototype. Unknown operators are reported by the code generator.
+		for (unsigned i = 0; i < N.NumOperands; ++i) {
+			Rules.OperandContexts[i] = N.Operator && i < N.Operator->ArgTypes.size() ? N.Operator->ArgTypes[i] : type_f64;
+			ValueType OperandType;
+			if (!operandType(i, Rules.OperandContexts[i], OperandType))
+				return false;
+		}
+		Rules.Type = N.Operator && N.Operator->ReturnType != type_unknown ? N.Operator->ReturnType : type_f64;
+		return true;
+	}
+
+	const BinaryExprAST* BinaryExpr = N.Expr->asBinary();
+	bool IsComparison = BinaryExpr->Op == '<';
+
+	// Infer both sides on their own first, then let an untyped side adopt the type of the typed side.
+	// A literal next to a bool is a number rather than a truth value, so that case adopts f64 instead.
+	ValueType L, R;
+	if (!operandType(0, type_unknown, L) || !operandType(1, type_unknown, R))
+		return false;
+	if (L == type_unknown && R != type_unknown) {
+		Rules.OperandContexts[0] = R == type_bool ? type_f64 : R;
+		if (!operandType(0, Rules.OperandContexts[0], L))
+			return false;
+	}
+	else if (R == type_unknown && L != type_unknown) {
+		Rules.OperandContexts[1] = L == type_bool ? type_f64 : L;
+		if (!operandType(1, Rules.OperandContexts[1], R))
+			return false;
+	}
+	else if (L == type_unknown && R == type_unknown) {
+		// Both sides are untyped. Arithmetic takes the type of its context, but a comparison says nothing
+		// about the type of its operands and neither does a bool context, so those default to f64.
+		ValueType OperandContext = IsComparison || Context == type_bool ? type_f64 : Context;
+		if (OperandContext == type_unknown) {
+			Rules.Typed = false;
+			return true;
+		}
+		Rules.OperandContexts[0] = Rules.OperandContexts[1] = OperandContext;
+		if (!operandType(0, OperandContext, L) || !operandType(1, OperandContext, R))
+			return false;
+	}
+
+	Rules.OperandType = promoteValueTypes(L, R);
+
+	// There is no bool arithmetic, true + true is 2.
+	if (!IsComparison && Rules.OperandType == type_bool)
+		Rules.OperandType = type_i64;
+
+	Rules.Type = IsComparison ? type_bool : Rules.OperandType;
+	return true;
+}
+
+} // end anonymous namespace
+
+ValueType ASTTypeInferenceVisitor::inferOperatorTree(const ExprAST* Root)
+{
+	// Collect the tree, breadth first.
+	vector<OperatorTreeNode> Nodes;
+	Nodes.emplace_back(Root);
+	for (unsigned i = 0; i < Nodes.size(); ++i) {
+		const ExprAST* Operands[2] = { nullptr, nullptr };
+		unsigned NumOperands = 0;
+		if (auto UnaryExpr = Nodes[i].Expr->asUnary()) {
+			Operands[NumOperands++] = UnaryExpr->Operand;
+			auto FI = FunctionProtos.find(string("unary") + UnaryExpr->Opcode);
+			Nodes[i].Operator = FI != FunctionProtos.end() ? FI->second : nullptr;
+		}
+		else if (auto BinaryExpr = Nodes[i].Expr->asBinary()) {
+			Operands[NumOperands++] = BinaryExpr->LHS;
+			Operands[NumOperands++] = BinaryExpr->RHS;
+			Nodes[i].IsBuiltin = isBuiltinBinaryOperator(BinaryExpr->Op);
+			if (!Nodes[i].IsBuiltin) {
+				auto FI = FunctionProtos.find(string("binary") + BinaryExpr->Op);
+				Nodes[i].Operator = FI != FunctionProtos.end() ? FI->second : nullptr;
+			}
+		}
+
+		for (unsigned j = 0; j < NumOperands; ++j) {
+			Nodes[i].Operands[j] = Nodes.size();
+			Nodes.emplace_back(Operands[j]);
+		}
+		Nodes[i].NumOperands = NumOperands;
+	}
+
+	// Work out the types the rules need, depth first. A node missing an operand's type is retried once it's there.
+	OperatorRules Rules;
+	pair<unsigned, ValueType> Missing;
+	vector<pair<unsigned, ValueType>> Stack{ { 0, ContextType } };
+	while (!Stack.empty()) {
+		unsigned I = Stack.back().first;
+		ValueType Context = Stack.back().second;
+		OperatorTreeNode& N = Nodes[I];
+		if (N.Types[Context] != NotInferred) {
+			Stack.pop_back();
+			continue;
+		}
+
+		if (!N.NumOperands) {
+			N.Types[Context] = inferWithContext(N.Expr, Context);
+			N.LastContext = Context;
+			Stack.pop_back();
+		}
+		else if (applyOperatorRules(Nodes, I, Context, Rules = OperatorRules(), Missing)) {
+			N.Types[Context] = Rules.Type;
+			Stack.pop_back();
+		}
+		else
+			Stack.push_back(Missing);
+	}
+	ValueType Result = (ValueType)Nodes[0].Types[ContextType];
+
+	// Store the types from the context every node is inferred in last.
+	Stack.push_back({ 0, ContextType });
+	while (!Stack.empty()) {
+		unsigned I = Stack.back().first;
+		ValueType Context = Stack.back().second;
+		Stack.pop_back();
+		const OperatorTreeNode& N = Nodes[I];
+
+		if (!N.NumOperands) {
+			if (N.LastContext != Context)
+				inferWithContext(N.Expr, Context);
+			continue;
+		}
+
+		applyOperatorRules(Nodes, I, Context, Rules = OperatorRules(), Missing);
+		if (Rules.Typed) {
+			ExprAST* Expr = const_cast<ExprAST*>(N.Expr);
+			Expr->Type = Rules.Type;
+			if (N.IsBuiltin)
+				static_cast<BinaryExprAST*>(Expr)->OperandType = Rules.OperandType;
+		}
+
+		for (unsigned j = 0; j < N.NumOperands; ++j)
+			Stack.push_back({ N.Operands[j], Rules.OperandContexts[j] });
+	}
+	return Result;
+}
+
+ValueType ASTTypeInferenceVisitor::visit(UnaryExprAST* UnaryExpr)
+{
+	return inferOperatorTree(UnaryExpr);
+}
+
+ValueType ASTTypeInferenceVisitor::visit(BinaryExprAST* BinaryExpr)
+{
+	return inferOperatorTree(BinaryExpr);
+}
+
+ValueType ASTTypeInferenceVisitor::visit(CallExprAST* CallExpr)
+{
+	// Builtin math functions are overloaded: they work in f32 when every typed argument is an f32 and in f64
+	// otherwise. Untyped arguments take the chosen type. Only those are inferred again: a call is always typed, so
+	// they have no calls in them, and nested builtin calls are inferred once each rather than twice per level.
+	if (getBuiltinFunction(CallExpr->Callee)) {
+		bool AllF32 = true, AnyTyped = false;
+		SmallVector<ValueType, 3> ArgTypes;
+		for (auto Arg : CallExpr->Args) {
+			ArgTypes.push_back(inferWithContext(Arg, type_unknown));
+			if (ArgTypes.back() != type_unknown) {
+				AnyTyped = true;
+				AllF32 = AllF32 && ArgTypes.back() == type_f32;
+			}
+		}
+
+		CallExpr->Type = AnyTyped && AllF32 ? type_f32 : type_f64;
+		for (unsigned i = 0, e = CallExpr->Args.size(); i != e; ++i)
+			if (ArgTypes[i] == type_unknown)
+				inferWithContext(CallExpr->Args[i], CallExpr->Type);
+		return CallExpr->Type;
+	}
+
+	auto FI = FunctionProtos.find(CallExpr->Callee);
+	const PrototypeAST* Callee = FI != FunctionProtos.end() ? FI->second : nullptr;
+
+	// Each argument is inferred in the context of its parameter type.
+	for (unsigned i = 0, e = CallExpr->Args.size(); i != e; ++i) {
+		ValueType ParamType = Callee && i < Callee->ArgTypes.size() ? Callee->ArgTypes[i] : type_f64;
+		inferWithContext(CallExpr->Args[i], ParamType);
+	}
+
+	// Calls to unknown functions are reported by the code generator. A callee whose return type is still
+	// being inferred (a recursive call) is treated as f64.
+	CallExpr->Type = Callee && Callee->ReturnType != type_unknown ? Callee->ReturnType : type_f64;
+	return CallExpr->Type;
+}
+
+ValueType ASTTypeInferenceVisitor::visit(IndexExprAST* IndexExpr)
+{
+	// Indices are always i64's. The load has the pointer's element type.
+	inferWithContext(IndexExpr->Index, type_i64);
+
+	auto TI = NamedTypes.find(IndexExpr->Name);
+	IndexExpr->Type = TI != NamedTypes.end() ? getElementType(TI->second) : type_unknown;
+	return IndexExpr->Type;
+}
+
+ValueType ASTTypeInferenceVisitor::visit(IndexAssignExprAST* IndexAssignExpr)
+{
+	inferWithContext(IndexAssignExpr->Index, type_i64);
+
+	auto TI = NamedTypes.find(IndexAssignExpr->Name);
+	IndexAssignExpr->Type = TI != NamedTypes.end() ? getElementType(TI->second) : type_unknown;
+
+	// The stored value is converted to the element type, so that's its context.
+	inferWithContext(IndexAssignExpr->Val, IndexAssignExpr->Type);
+	return IndexAssignExpr->Type;
+}
+
+ValueType ASTTypeInferenceVisitor::visit(ParallelExprAST* ParallelExpr)
+{
+	inferWithContext(ParallelExpr->Start, type_i64);
+	inferWithContext(ParallelExpr->End, type_i64);
+
+	// The loop variable is an f64, hiding an argument of the same name within the body. A sum adds up f64's.
+	map<string, ValueType> OuterTypes = NamedTypes;
+	NamedTypes[ParallelExpr->VarName] = type_f64;
+	inferWithContext(ParallelExpr->Body, ParallelExpr->Kind == ParallelExprAST::parallel_sum ? type_f64 : type_unknown);
+	NamedTypes.swap(OuterTypes);
+
+	ParallelExpr->Type = type_f64;
+	return ParallelExpr->Type;
+}
+
+ValueType ASTTypeInferenceVisitor::visit(PrototypeAST* PrototypeExpr)
+{
+	return PrototypeExpr->ReturnType;
+}
+
+ValueType ASTTypeInferenceVisitor::visit(FunctionAST* FunctionExpr)
+{
+	PrototypeAST* Proto = const_cast<PrototypeAST*>(FunctionExpr->Proto);
+
+	// Record the argument types for variable references in the body.
+	NamedTypes.clear();
+	for (unsigned i = 0, e = Proto->Args.size(); i != e; ++i)
+		NamedTypes[Proto->Args[i]] = Proto->ArgTypes[i];
+
+	// The body is inferred against the declared return type. If neither gives a type, default to f64.
+	ValueType BodyType = inferWithContext(FunctionExpr->Body, Proto->AnnotatedReturnType);
+	if (BodyType == type_unknown)
+		BodyType = inferWithContext(FunctionExpr->Body, type_f64);
+
+	Proto->ReturnType = Proto->AnnotatedReturnType != type_unknown ? Proto->AnnotatedReturnType : BodyType;
+
+	return Proto->ReturnType;
+}
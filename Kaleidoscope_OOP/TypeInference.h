@@ -0,0 +1,51 @@
+#pragma once
+#include <map>
+#include <string>
+#include "AST.h"
+#include "Types.h"
+
+using namespace std;
+
+/**
+* Type inference runs as its own visitor over a FunctionAST right before code generation. It annotates every
+* expression node with its ValueType (ExprAST::Type) and fills in the return type of prototypes that weren't
+* annotated. Keeping this out of ASTCodeGenVisitor means the code generator only has to read the types and
+* insert conversions where they differ.
+*
+* Unannotated literals are the interesting part: they adopt the type of whatever they're combined with, so
+* "x * 2" stays an f32 multiply when x is an f32 instead of promoting everything to f64. A literal whose
+* context gives no type at all falls back to f64, which is the old Kaleidoscope behaviour.
+*/
+
+class ASTTypeInferenceVisitor : public ExprASTVisitor<ValueType>
+{
+public:
+	// Prototypes are needed to resolve the types of call expressions.
+	ASTTypeInferenceVisitor(map<string, const PrototypeAST*>& FunctionProtos) : FunctionProtos(FunctionProtos) {}
+
+	ValueType visit(NumberExprAST* NumberExpr);
+	ValueType visit(VariableExprAST* VariableExpr);
+	ValueType visit(UnaryExprAST* UnaryExpr);
+	ValueType visit(BinaryExprAST* BinaryExpr);
+	ValueType visit(CallExprAST* CallExpr);
+	ValueType visit(IndexExprAST* IndexExpr);
+	ValueType visit(IndexAssignExprAST* IndexAssignExpr);
+	ValueType visit(ParallelExprAST* ParallelExpr);
+	ValueType visit(PrototypeAST* PrototypeExpr);
+	ValueType visit(FunctionAST* FunctionExpr);
+
+private:
+	map<string, const PrototypeAST*>& FunctionProtos;
+
+	// Types of the arguments of the function currently being inferred.
+	map<string, ValueType> NamedTypes;
+
+	// The type an untyped literal should take in the current position (type_unknown if there is none).
+	ValueType ContextType = type_unknown;
+
+	// Infers an expression, giving untyped literals within it the supplied context type.
+	ValueType inferWithContext(const ExprAST* Expr, ValueType Context);
+
+	// Infers a tree of operator expressions in the current context, with explicit stacks (see TypeInference.cpp).
+	ValueType inferOperatorTree(const ExprAST* Root);
+};
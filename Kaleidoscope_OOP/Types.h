@@ -0,0 +1,102 @@
+#pragma once
+#include <string>
+
+using namespace std;
+
+/**
+* Kaleidoscope originally only knew about doubles. ValueType describes the scalar types a value can carry so that
+* prototypes and literals can be annotated (e.g. "def scale(x:f32 k:f32):f32 x*k"). The enum is ordered by
+* promotion rank: when two different types meet in a binary expression the one with the higher value wins.
+* type_unknown is used by the type inference pass for values whose type is decided by their context
+* (unannotated literals and not yet inferred return types).
+*
+* Function arguments can also be pointers to host buffers ("a:f32*"). Pointer types mirror the scalar types at a
+* fixed offset so the element type is a subtraction away. Pointers can only be indexed ("a[i]", "a[i] = v") or
+* passed on to other functions; they never take part in arithmetic or promotion.
+*/
+
+enum ValueType {
+	type_unknown = 0,
+	type_bool = 1,
+	type_i64 = 2,
+	type_f32 = 3,
+	type_f64 = 4,
+
+	type_bool_ptr = 9,
+	type_i64_ptr = 10,
+	type_f32_ptr = 11,
+	type_f64_ptr = 12,
+};
+
+const int PointerTypeOffset = type_bool_ptr - type_bool;
+
+/// getValueType - Maps a type annotation name to its ValueType. Returns type_unknown if the name isn't a type.
+inline ValueType getValueType(const string& Name)
+{
+	if (Name == "f64" || Name == "double")
+		return type_f64;
+	if (Name == "f32" || Name == "float")
+		return type_f32;
+	if (Name == "i64")
+		return type_i64;
+	if (Name == "bool")
+		return type_bool;
+	return type_unknown;
+}
+
+/// getValueTypeName - Returns the annotation name for a ValueType (used for diagnostics).
+inline const char* getValueTypeName(ValueType Type)
+{
+	switch (Type) {
+	case type_bool:
+		return "bool";
+	case type_i64:
+		return "i64";
+	case type_f32:
+		return "f32";
+	case type_f64:
+		return "f64";
+	case type_bool_ptr:
+		return "bool*";
+	case type_i64_ptr:
+		return "i64*";
+	case type_f32_ptr:
+		return "f32*";
+	case type_f64_ptr:
+		return "f64*";
+	default:
+		return "<unknown>";
+	}
+}
+
+inline bool isPointerType(ValueType Type)
+{
+	return Type >= type_bool_ptr;
+}
+
+/// getPointerType - The pointer type whose elements have the given scalar type.
+inline ValueType getPointerType(ValueType ElementType)
+{
+	return (ValueType)(ElementType + PointerTypeOffset);
+}
+
+/// getElementType - The scalar type a pointer type points to. type_unknown for non-pointers.
+inline ValueType getElementType(ValueType PointerType)
+{
+	return isPointerType(PointerType) ? (ValueType)(PointerType - PointerTypeOffset) : type_unknown;
+}
+
+inline bool isFloatingPointType(ValueType Type)
+{
+	return Type == type_f32 || Type == type_f64;
+}
+
+/// promoteValueTypes - The common type two operands are converted to before a binary operation.
+inline ValueType promoteValueTypes(ValueType LHS, ValueType RHS)
+{
+	if (LHS == type_unknown)
+		return RHS;
+	if (RHS == type_unknown)
+		return LHS;
+	return LHS > RHS ? LHS : RHS;
+}
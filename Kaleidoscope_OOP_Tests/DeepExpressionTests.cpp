@@ -0,0 +1,129 @@
+// DeepExpressionTests.cpp : Checks that expressions as deep as they are long, like machine generated formulas, are
+// parsed, typed, generated, run and freed (see AST.h), and that the JIT'd code computes what they say.
+//
+
+#include "stdafx.h"
+#include "Operators.h"
+#include "Parser.h"
+#include "Tests.h"
+#include <cstring>
+
+// Operators per expression, and per expression of the unary case, whose operators are calls.
+static const unsigned Operators = 300000;
+static const unsigned UnaryOperators = 100000;
+
+// The i-th operand (1-based) and the operator before it. The operands are constants and x appears once, where the
+// code generator folds everything else to a constant as it emits it: a basic block of a few hundred thousand
+// instructions takes LLVM's two-address pass, which is quadratic in the size of a block, minutes to compile. The
+// parser, type inference, code generator and destructors still see every operator, and the folded constant is
+// computed in the order the chain associates in, so a wrong association shows in its rounding.
+static string operandSource(unsigned i) { return to_string(i) + ".25"; }
+static double operand(unsigned i) { return i + 0.25; }
+static const char* operatorSource(unsigned i) { return i % 2 ? " + " : " - "; }
+static double apply(unsigned i, double LHS, double RHS) { return i % 2 ? LHS + RHS : LHS - RHS; }
+
+struct DeepCase {
+	const char* Name;
+	string Body;
+	double (*Expected)(double X);
+};
+
+static DeepCase leftNested()
+{
+	// ((((0.25 + 1.25) - 2.25) + 3.25) ...) + x
+	string Body(Operators, '(');
+	Body += "0.25";
+	for (unsigned i = 1; i <= Operators; ++i)
+		Body += operatorSource(i) + operandSource(i) + ")";
+	Body += " + x";
+	return { "leftnest", Body, [](double X) {
+		double Value = 0.25;
+		for (unsigned i = 1; i <= Operators; ++i)
+			Value = apply(i, Value, operand(i));
+		return Value + X;
+	} };
+}
+
+static DeepCase leftChain()
+{
+	// 0.25 + 1.25 - 2.25 + 3.25 ... - x, left-associated by precedence.
+	string Body = "0.25";
+	for (unsigned i = 1; i <= Operators; ++i)
+		Body += operatorSource(i) + operandSource(i);
+	Body += " - x";
+	return { "leftchain", Body, [](double X) {
+		double Value = 0.25;
+		for (unsigned i = 1; i <= Operators; ++i)
+			Value = apply(i, Value, operand(i));
+		return Value - X;
+	} };
+}
+
+static DeepCase rightNested()
+{
+	// x + (1.25 - (2.25 + (3.25 - (4.25 ...))))
+	string Body = "x";
+	for (unsigned i = 1; i <= Operators; ++i)
+		Body += string(operatorSource(i)) + (i < Operators ? "(" : "") + operandSource(i);
+	Body += string(Operators - 1, ')');
+	return { "rightnest", Body, [](double X) {
+		double Value = operand(Operators);
+		for (unsigned i = Operators - 1; i >= 1; --i)
+			Value = apply(i + 1, operand(i), Value);
+		return apply(1, X, Value);
+	} };
+}
+
+static DeepCase products()
+{
+	// 0.25 + 1.25 * 0.5 - 2.25 * 0.5 ... + x, a chain whose operands are operators of a higher precedence.
+	string Body = "0.25";
+	for (unsigned i = 1; i <= Operators / 2; ++i)
+		Body += operatorSource(i) + operandSource(i) + " * 0.5";
+	Body += " + x";
+	return { "products", Body, [](double X) {
+		double Value = 0.25;
+		for (unsigned i = 1; i <= Operators / 2; ++i)
+			Value = apply(i, Value, operand(i) * 0.5);
+		return Value + X;
+	} };
+}
+
+static DeepCase negations()
+{
+	// ~~~~x, with ~ a user defined unary operator.
+	return { "negations", string(UnaryOperators, '~') + "x", [](double X) {
+		double Value = X;
+		for (unsigned i = 0; i < UnaryOperators; ++i)
+			Value = 0 - Value;
+		return Value;
+	} };
+}
+
+unsigned runDeepExpressionTests()
+{
+	const DeepCase Cases[] = { leftNested(), leftChain(), rightNested(), products(), negations() };
+
+	string Source = "def unary~(v) 0 - v;\n";
+	for (const DeepCase& Case : Cases)
+		Source += "def " + string(Case.Name) + "(x) " + Case.Body + ";\n";
+	Parser TheParser{ Lexer(Source) };
+	for (const StandardBinaryOperator& Op : StandardBinaryOperators)
+		TheParser.BinopPrecedence[(unsigned char)Op.Op] = Op.Precedence;
+	TheParser.MainLoop();
+
+	unsigned Failures = 0;
+	for (const DeepCase& Case : Cases) {
+		auto* Function = TheParser.getJITFunction<double(double)>(Case.Name);
+		for (double X : { 1.5, -0.25 }) {
+			double Expected = Case.Expected(X), Actual = Function(X);
+			if (memcmp(&Expected, &Actual, sizeof(double))) {
+				fprintf(stderr, "FAIL %s(%g): %.17g, JIT'd %.17g\n", Case.Name, X, Expected, Actual);
+				++Failures;
+			}
+		}
+	}
+
+	fprintf(stderr, "%u deep expressions, %u failures\n", (unsigned)(sizeof(Cases) / sizeof(Cases[0])), Failures);
+	return Failures;
+}
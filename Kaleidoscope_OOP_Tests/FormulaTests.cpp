@@ -0,0 +1,90 @@
+// FormulaTests.cpp : Checks that formulas parsed at compile time (ConstexprFormula.h) compute exactly what the JIT'd
+// code of the same source computes.
+//
+
+#include "stdafx.h"
+#include "ConstexprFormula.h"
+#include "Operators.h"
+#include "Parser.h"
+#include "Tests.h"
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+typedef double FormulaFunction(double, double, double);
+
+struct FormulaCase {
+	const char* Name;
+	const char* Source;
+	FormulaFunction* Constexpr;
+};
+
+// Each case is a definition of three arguments named Name. The lambda calls the compile-time formula of Source.
+#define FORMULA_CASE(Name, Source) \
+	{ Name, Source, [](double A, double B, double C) { return KALEIDOSCOPE_FORMULA(Source)(A, B, C); } }
+
+static const FormulaCase Cases[] = {
+	// '<' is unordered: true if either side is NaN.
+	FORMULA_CASE("lt", "def lt(a b c):f64 a < b"),
+	FORMULA_CASE("ltsum", "def ltsum(a b c) (a < b) + (b < c) * 2 + (c < a) * 4"),
+	// Every builtin.
+	FORMULA_CASE("fsqrt", "def fsqrt(a b c) sqrt(a)"),
+	FORMULA_CASE("fsin", "def fsin(a b c) sin(a) + sin(b * c)"),
+	FORMULA_CASE("fcos", "def fcos(a b c) cos(a) - cos(b + c)"),
+	FORMULA_CASE("fexp", "def fexp(a b c) exp(a) * exp(b - c)"),
+	FORMULA_CASE("flog", "def flog(a b c) log(a) + log(b * c)"),
+	FORMULA_CASE("fpow", "def fpow(a b c) pow(a, b) + pow(c, a)"),
+	FORMULA_CASE("ffabs", "def ffabs(a b c) fabs(a) - fabs(b - c)"),
+	FORMULA_CASE("ffma", "def ffma(a b c) fma(a, b, c)"),
+	FORMULA_CASE("nested", "def nested(a b c):f64 sqrt(fabs(pow(a, 2.5) - fma(b, c, sin(a)))) < exp(cos(log(c)))"),
+	// Literals outside the Lexer's fast path: more than 19 significant digits, more than 2^53, or an exponent
+	// beyond 22.
+	FORMULA_CASE("longint", "def longint(a b c) a * 12345678901234567890123 + 9007199254740993"),
+	FORMULA_CASE("longfrac", "def longfrac(a b c) a + 0.1000000000000000055511151231257827021181583404541015625001"),
+	FORMULA_CASE("tie", "def tie(a b c) a * 9007199254740993.00000000000000000000000000000000000000000001 + b * 9007199254740993"),
+	FORMULA_CASE("bigexp", "def bigexp(a b c) a * 1.7976931348623157e308 + b * 3.141592653589793238462643383279e-200"),
+	FORMULA_CASE("denormal", "def denormal(a b c) a * 4.9406564584124654e-324 + b * 2.2250738585072011e-308 + c * 1e-320"),
+	FORMULA_CASE("limits", "def limits(a b c) a * 1e400 + b * 2.4703282292062328e-324 + c * 123456.789e-25"),
+};
+
+unsigned runFormulaTests()
+{
+	const double NaN = std::numeric_limits<double>::quiet_NaN();
+	const double Inf = std::numeric_limits<double>::infinity();
+	const double Arguments[][3] = {
+		{ 1, 2, 3 }, { 2, 1, 0.5 }, { 0.25, 0.25, -7 }, { -0.0, 0.0, 1e-310 }, { 1e300, -1e300, 3.5 },
+		{ NaN, 1, 2 }, { 1, NaN, 2 }, { NaN, NaN, NaN }, { Inf, -Inf, 0 }, { 0.1, 0.7, 1234.5678 },
+	};
+
+	string Source;
+	for (const FormulaCase& Case : Cases)
+		Source += string(Case.Source) + ";\n";
+	Parser TheParser{ Lexer(Source) };
+	for (const StandardBinaryOperator& Op : StandardBinaryOperators)
+		TheParser.BinopPrecedence[(unsigned char)Op.Op] = Op.Precedence;
+	TheParser.MainLoop();
+
+	unsigned Failures = 0;
+	for (const FormulaCase& Case : Cases) {
+		FormulaFunction* JITFunction = TheParser.getJITFunction<FormulaFunction>(Case.Name);
+		if (!JITFunction) {
+			fprintf(stderr, "FAIL %s: not compiled by the JIT\n", Case.Name);
+			++Failures;
+			continue;
+		}
+		for (const double* Args : Arguments) {
+			double Expected = JITFunction(Args[0], Args[1], Args[2]);
+			double Actual = Case.Constexpr(Args[0], Args[1], Args[2]);
+			// Bit for bit, so zeros of different signs differ. Which NaN an operation on NaNs gives depends on the
+			// order of its operands, which the language doesn't define, so any NaN matches any other.
+			if (memcmp(&Expected, &Actual, sizeof(double)) && !(std::isnan(Expected) && std::isnan(Actual))) {
+				fprintf(stderr, "FAIL %s(%g, %g, %g): JIT %.17g, constexpr %.17g\n", Case.Name, Args[0], Args[1],
+					Args[2], Expected, Actual);
+				++Failures;
+			}
+		}
+	}
+
+	fprintf(stderr, "%u formulas, %u failures\n", (unsigned)(sizeof(Cases) / sizeof(Cases[0])), Failures);
+	return Failures;
+}
@@ -0,0 +1,128 @@
+// FusionTests.cpp : Checks that fused kernels (Parser::FuseKernel) compute, for every row, exactly what the functions
+// they fuse compute when called one row at a time.
+//
+
+#include "stdafx.h"
+#include "Operators.h"
+#include "Parser.h"
+#include "Tests.h"
+#include <cmath>
+#include <cstring>
+
+static const char* Source =
+	"def area(x y) x * y + sqrt(x);\n"
+	"def shear(y z) y * z - sqrt(y * (z + 1));\n"
+	"def mix(z x) x * z + z * x * 0.5;\n"
+	"def scale(w:f32):f32 w * 2.5;\n"
+	"def narrow(x:f32):f32 x;\n";
+
+typedef double BinaryFunction(double, double);
+
+// A fused f64 function of two parameters and the columns they're read from.
+struct FusedFormula {
+	const char* Name;
+	const char* Columns[2];
+};
+
+// Bit for bit, except that any NaN matches any other (see FormulaTests.cpp).
+static bool sameResult(double Expected, double Actual)
+{
+	return !memcmp(&Expected, &Actual, sizeof(double)) || (std::isnan(Expected) && std::isnan(Actual));
+}
+
+unsigned runFusionTests()
+{
+	Parser TheParser{ Lexer(Source) };
+	for (const StandardBinaryOperator& Op : StandardBinaryOperators)
+		TheParser.BinopPrecedence[(unsigned char)Op.Op] = Op.Precedence;
+	TheParser.MainLoop();
+
+	// z + 1 is negative on some rows, so shear takes the square root of a negative number there.
+	const int64_t Rows = 1000;
+	map<string, vector<double>> Columns;
+	vector<float> W(Rows);
+	for (const char* Name : { "x", "y", "z" })
+		Columns[Name].resize(Rows);
+	for (int64_t Row = 0; Row < Rows; ++Row) {
+		Columns["x"][Row] = Row * 0.37 - 50;
+		Columns["y"][Row] = 1 + Row % 17;
+		Columns["z"][Row] = (double)(Row % 5) - 2;
+		W[Row] = Row * 0.25f;
+	}
+
+	unsigned Failures = 0;
+	auto fail = [&](const char* Message, const char* Name) {
+		fprintf(stderr, "FAIL %s: %s\n", Name, Message);
+		++Failures;
+	};
+
+	// Three formulas sharing three columns, each reading two of them.
+	const FusedFormula Formulas[] = {
+		{ "area", { "x", "y" } },
+		{ "shear", { "y", "z" } },
+		{ "mix", { "z", "x" } },
+	};
+	vector<string> InputColumns;
+	if (!TheParser.FuseKernel("xyz", { "area", "shear", "mix" }, InputColumns))
+		fail("not fused", "xyz");
+	else if (InputColumns != vector<string>{ "x", "y", "z" })
+		fail("input columns aren't x, y, z in order of first use", "xyz");
+	else {
+		vector<vector<double>> Outputs(3, vector<double>(Rows));
+		void* Inputs[] = { Columns["x"].data(), Columns["y"].data(), Columns["z"].data() };
+		void* OutputColumns[] = { Outputs[0].data(), Outputs[1].data(), Outputs[2].data() };
+		TheParser.getJITFunction<FusedKernel>("xyz")(Inputs, OutputColumns, Rows);
+
+		for (unsigned i = 0; i < 3; ++i) {
+			const FusedFormula& Formula = Formulas[i];
+			BinaryFunction* Function = TheParser.getJITFunction<BinaryFunction>(Formula.Name);
+			for (int64_t Row = 0; Row < Rows; ++Row) {
+				double Expected = Function(Columns[Formula.Columns[0]][Row], Columns[Formula.Columns[1]][Row]);
+				if (!sameResult(Expected, Outputs[i][Row])) {
+					fprintf(stderr, "FAIL xyz.%s, row %lld: %.17g, fused %.17g\n", Formula.Name, (long long)Row,
+						Expected, Outputs[i][Row]);
+					++Failures;
+					break;
+				}
+			}
+		}
+	}
+
+	// Columns of different types, and an empty run.
+	if (!TheParser.FuseKernel("mixed", { "scale", "area" }, InputColumns))
+		fail("not fused", "mixed");
+	else if (InputColumns != vector<string>{ "w", "x", "y" })
+		fail("input columns aren't w, x, y", "mixed");
+	else {
+		vector<float> Scaled(Rows);
+		vector<double> Areas(Rows);
+		void* Inputs[] = { W.data(), Columns["x"].data(), Columns["y"].data() };
+		void* OutputColumns[] = { Scaled.data(), Areas.data() };
+		FusedKernel* Kernel = TheParser.getJITFunction<FusedKernel>("mixed");
+		Kernel(Inputs, OutputColumns, 0);
+		if (Scaled[0] != 0 || Areas[0] != 0)
+			fail("wrote a row of an empty run", "mixed");
+		Kernel(Inputs, OutputColumns, Rows);
+
+		auto* Scale = TheParser.getJITFunction<float(float)>("scale");
+		auto* Area = TheParser.getJITFunction<BinaryFunction>("area");
+		for (int64_t Row = 0; Row < Rows; ++Row) {
+			if (Scale(W[Row]) != Scaled[Row] || !sameResult(Area(Columns["x"][Row], Columns["y"][Row]), Areas[Row])) {
+				fprintf(stderr, "FAIL mixed, row %lld\n", (long long)Row);
+				++Failures;
+				break;
+			}
+		}
+	}
+
+	// What can't be fused.
+	if (TheParser.FuseKernel("unknown", { "area", "nope" }, InputColumns))
+		fail("fused a function that isn't defined", "unknown");
+	if (TheParser.FuseKernel("disagree", { "area", "narrow" }, InputColumns))
+		fail("fused functions that disagree on the type of x", "disagree");
+	if (TheParser.FuseKernel("xyz", { "area" }, InputColumns))
+		fail("defined a kernel twice", "xyz");
+
+	fprintf(stderr, "fused kernels, %u failures\n", Failures);
+	return Failures;
+}
@@ -0,0 +1,153 @@
+// ProfileTests.cpp : Checks that a profile recorded by an instrumented run (JITProfile.h) comes back as the entry
+// counts and branch weights of the same code compiled again.
+//
+
+#include "stdafx.h"
+#include "JITProfile.h"
+#include "Operators.h"
+#include "Parser.h"
+#include "Tests.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include <fstream>
+#include <sstream>
+
+// total counts n iterations of its chunk function's loop per call, however the loop is split into chunks.
+static const char* Source = "def total(n:i64) parallelsum(i, 0, n, i);\n";
+
+static const int64_t Iterations = 1000;
+static const unsigned Calls = 3;
+
+static Parser* createParser(const orc::KaleidoscopeJITOptions& Options)
+{
+	Parser* TheParser = new Parser(Lexer(Source), Options);
+	for (const StandardBinaryOperator& Op : StandardBinaryOperators)
+		TheParser->BinopPrecedence[(unsigned char)Op.Op] = Op.Precedence;
+	return TheParser;
+}
+
+// The taken and not taken weights of a branch, 0 and 0 if it has none.
+static pair<uint64_t, uint64_t> getBranchWeights(const BranchInst* Branch)
+{
+	uint64_t Taken, NotTaken;
+	if (!Branch->extractProfMetadata(Taken, NotTaken))
+		return { 0, 0 };
+	return { Taken, NotTaken };
+}
+
+unsigned runProfileTests()
+{
+	unsigned Failures = 0;
+	auto fail = [&](const char* Message) {
+		fprintf(stderr, "FAIL profile: %s\n", Message);
+		++Failures;
+	};
+
+	SmallString<128> FileName;
+	if (sys::fs::createTemporaryFile("kaleidoscope", "profile", FileName)) {
+		fail("can't create a temporary file");
+		return Failures;
+	}
+
+	// Record: the profile is written when the JIT shuts down.
+	{
+		orc::KaleidoscopeJITOptions Options;
+		Options.ProfileGenerate = FileName.str().str();
+		unique_ptr<Parser> TheParser(createParser(Options));
+		TheParser->MainLoop();
+		auto* Total = TheParser->getJITFunction<double(int64_t)>("total");
+		for (unsigned i = 0; i < Calls; ++i) {
+			if (Total(Iterations) != Iterations * (Iterations - 1) / 2)
+				fail("instrumented code computed the wrong sum");
+		}
+	}
+
+	// Compile the same source again, without the JIT, and attach the profile the way the JIT would.
+	unique_ptr<JITProfile> Profile = JITProfile::load(FileName.str().str());
+	if (!Profile) {
+		fail("can't reload the profile");
+		return Failures;
+	}
+	vector<orc::ThreadSafeModule> Modules;
+	unique_ptr<Parser> TheParser(createParser({}));
+	if (!TheParser->GenerateModules(Modules) || Modules.size() != 1) {
+		fail("can't generate the module again");
+		return Failures;
+	}
+
+	Modules[0].withModuleDo([&](Module& M) {
+		Profile->addModule(M);
+		if (!M.getProfileSummary(false))
+			fail("no profile summary on the module");
+
+		Function* Total = M.getFunction("total");
+		Function* Chunk = M.getFunction("total.parallel");
+		if (!Total || !Chunk) {
+			fail("total or its chunk function is missing");
+			return;
+		}
+
+		auto EntryCount = Total->getEntryCount();
+		if (!EntryCount || EntryCount->getCount() != Calls)
+			fail("total's entry count isn't the number of calls");
+
+		// The chunk function branches past an empty range, then loops while the counter is below the end.
+		vector<BranchInst*> Branches;
+		for (auto& BB : *Chunk) {
+			auto* Branch = dyn_cast<BranchInst>(BB.getTerminator());
+			if (Branch && Branch->isConditional())
+				Branches.push_back(Branch);
+		}
+		auto ChunkCount = Chunk->getEntryCount();
+		if (Branches.size() != 2 || !ChunkCount) {
+			fail("the chunk function has no entry count, or isn't the expected loop");
+			return;
+		}
+		pair<uint64_t, uint64_t> Nonempty = getBranchWeights(Branches[0]);
+		pair<uint64_t, uint64_t> LoopCond = getBranchWeights(Branches[1]);
+		if (Nonempty.first + Nonempty.second != ChunkCount->getCount())
+			fail("the weights of the empty range check don't add up to the chunk calls");
+		if (LoopCond.first + LoopCond.second != Calls * Iterations)
+			fail("the weights of the loop condition don't add up to the iterations");
+		if (LoopCond.second != Nonempty.first)
+			fail("the loop isn't left once per nonempty chunk");
+	});
+
+	// A record with more counters than the function has branches for is ignored, not read past.
+	{
+		std::ifstream In(FileName.str().str());
+		std::ostringstream Out;
+		string Line;
+		while (getline(In, Line)) {
+			std::istringstream Fields(Line);
+			string Name, Hash;
+			unsigned NumCounters;
+			if (Fields >> Name >> Hash >> NumCounters && Name == "total.parallel") {
+				Out << Name << ' ' << Hash << ' ' << NumCounters + 2 << Fields.rdbuf() << " 1 1\n";
+				continue;
+			}
+			Out << Line << '\n';
+		}
+		In.close();
+		std::ofstream(FileName.str().str()) << Out.str();
+	}
+	Profile = JITProfile::load(FileName.str().str());
+	Modules.clear();
+	TheParser.reset(createParser({}));
+	if (!Profile || !TheParser->GenerateModules(Modules) || Modules.size() != 1)
+		fail("can't reload the edited profile");
+	else {
+		Modules[0].withModuleDo([&](Module& M) {
+			Profile->addModule(M);
+			if (M.getFunction("total.parallel")->getEntryCount())
+				fail("counts for another number of branches were attached");
+			if (!M.getFunction("total")->getEntryCount())
+				fail("total lost its counts along with its chunk function's");
+		});
+	}
+
+	sys::fs::remove(FileName);
+	fprintf(stderr, "profiles, %u failures\n", Failures);
+	return Failures;
+}
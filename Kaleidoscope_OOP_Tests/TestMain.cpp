@@ -0,0 +1,17 @@
+// TestMain.cpp : Runs every test suite (see Tests.h). Exits with 1 if any case failed.
+//
+
+#include "stdafx.h"
+#include "Tests.h"
+
+int main()
+{
+	unsigned Failures = 0;
+	Failures += runFormulaTests();
+	Failures += runFusionTests();
+	Failures += runProfileTests();
+	Failures += runDeepExpressionTests();
+
+	fprintf(stderr, "%u failures in all\n", Failures);
+	return Failures ? 1 : 0;
+}
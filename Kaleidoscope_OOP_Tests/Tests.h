@@ -0,0 +1,18 @@
+#pragma once
+
+/**
+* The test suites. Each runs its cases, logs the ones that fail to stderr and returns how many failed. TestMain.cpp
+* runs them all.
+*/
+
+/// runFormulaTests - Compile-time formulas (ConstexprFormula.h) against the JIT (FormulaTests.cpp).
+unsigned runFormulaTests();
+
+/// runFusionTests - Fused kernels (Parser::FuseKernel) against the functions they fuse (FusionTests.cpp).
+unsigned runFusionTests();
+
+/// runProfileTests - Profiles recorded, reloaded and attached to the IR again (ProfileTests.cpp).
+unsigned runProfileTests();
+
+/// runDeepExpressionTests - Chains of a few hundred thousand operators, nested both ways (DeepExpressionTests.cpp).
+unsigned runDeepExpressionTests();